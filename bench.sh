@@ -0,0 +1,169 @@
+#!/bin/sh
+# Throughput benchmark, run by "make bench". A listener and a connector
+# are started for every rate and write size in the sweep, over loopback
+# or, with BENCH_NET=netns, a veth pair into a network namespace so the
+# traffic crosses a real (virtual) link. The connector records every
+# sample and the steady state part of the recording is reduced to what
+# was achieved, the CPU it took and how well the pacer kept time. The
+# results go to a JSON report, one object per case, for comparing one
+# build against another.
+#
+# Settings, from the environment:
+#   BENCH_RATES        rates to sweep ("12mbps 120mbps 1190mbps", about
+#                      100Mbit, 1Gbit and 10Gbit)
+#   BENCH_WRITE_SIZES  write sizes to sweep ("1k 64k")
+#   BENCH_DURATION     seconds measured per case (10)
+#   BENCH_WARMUP       seconds skipped before measuring (2)
+#   BENCH_NET          loopback or netns (loopback, netns needs root)
+#   BENCH_ARGS         extra options for both ends, e.g. "--burst 1ms"
+#   BENCH_PORT         port to use (8590)
+#   BENCH_REPORT       where to write the report (bench.json)
+#   TCPXFER, TCPXFER_READ  the binaries (./tcpxfer, ./tcpxfer-read)
+
+set -eu
+
+TCPXFER=${TCPXFER:-./tcpxfer}
+TCPXFER_READ=${TCPXFER_READ:-./tcpxfer-read}
+RATES=${BENCH_RATES:-"12mbps 120mbps 1190mbps"}
+SIZES=${BENCH_WRITE_SIZES:-"1k 64k"}
+DURATION=${BENCH_DURATION:-10}
+WARMUP=${BENCH_WARMUP:-2}
+NET=${BENCH_NET:-loopback}
+ARGS=${BENCH_ARGS:-}
+PORT=${BENCH_PORT:-8590}
+REPORT=${BENCH_REPORT:-bench.json}
+
+HZ=$(getconf CLK_TCK)
+TMP=$(mktemp -d)
+HOST=localhost
+NS=
+LPID=
+CPID=
+
+cleanup() {
+  if [ -n "$CPID" ]; then kill "$CPID" 2>/dev/null || true; fi
+  if [ -n "$LPID" ]; then kill "$LPID" 2>/dev/null || true; fi
+  wait 2>/dev/null || true
+  if [ -n "$NS" ]; then ip netns del "$NS" 2>/dev/null || true; fi
+  rm -rf "$TMP"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# The listener runs inside the namespace, the connector outside reaches
+# it over the veth pair. Deleting the namespace takes the pair with it
+setup_netns() {
+  NS=tcpxfer-bench-$$
+  ip netns add "$NS"
+  ip link add "txb0-$$" type veth peer name "txb1-$$"
+  ip link set "txb1-$$" netns "$NS"
+  ip addr add 10.201.0.1/30 dev "txb0-$$"
+  ip link set "txb0-$$" up
+  ip netns exec "$NS" ip addr add 10.201.0.2/30 dev "txb1-$$"
+  ip netns exec "$NS" ip link set "txb1-$$" up
+  ip netns exec "$NS" ip link set lo up
+  HOST=10.201.0.2
+}
+
+# User plus system time of a running process, in seconds
+cpu_seconds() {
+  awk -v hz="$HZ" '{ sub(/^.*\) /, ""); printf "%.3f", ($12 + $13) / hz }' "/proc/$1/stat"
+}
+
+run_case() {
+  rate=$1
+  size=$2
+  rec=$TMP/case.rec
+  rm -f "$rec"
+
+  # shellcheck disable=SC2086
+  if [ -n "$NS" ]; then
+    ip netns exec "$NS" "$TCPXFER" -l -p "$PORT" -r "$rate" --write-size "$size" $ARGS \
+      >"$TMP/listener.log" 2>&1 &
+  else
+    "$TCPXFER" -l -p "$PORT" -r "$rate" --write-size "$size" $ARGS >"$TMP/listener.log" 2>&1 &
+  fi
+  LPID=$!
+  sleep 1
+  # shellcheck disable=SC2086
+  "$TCPXFER" -p "$PORT" -r "$rate" --write-size "$size" --record "$rec" $ARGS "$HOST" \
+    >"$TMP/connector.log" 2>&1 &
+  CPID=$!
+
+  sleep "$WARMUP"
+  c0=$(cpu_seconds "$CPID")
+  l0=$(cpu_seconds "$LPID")
+  from=$(date +%s.%N)
+  sleep "$DURATION"
+  c1=$(cpu_seconds "$CPID")
+  l1=$(cpu_seconds "$LPID")
+  to=$(date +%s.%N)
+
+  kill "$CPID" "$LPID" 2>/dev/null || true
+  wait "$CPID" "$LPID" 2>/dev/null || true
+  CPID=
+  LPID=
+
+  # Only samples that measured something, within the measured span
+  "$TCPXFER_READ" "$rec" | awk -F, \
+    -v rate="$rate" -v size="$size" -v net="$NET" -v from="$from" -v to="$to" \
+    -v ccpu="$(echo "$c1 $c0" | awk '{ print $1 - $2 }')" \
+    -v lcpu="$(echo "$l1 $l0" | awk '{ print $1 - $2 }')" '
+    NR == 1 { for (i=1; i <= NF; i++) col[$i] = i; next }
+    $col["epoch"] < from || $col["epoch"] > to || $col["target_bps"] == 0 { next }
+    {
+      n++
+      bps += $col["bps"]
+      tx += $col["tx_bps"]
+      target = $col["target_bps"]
+      ticks += $col["ticks"]
+      overruns += $col["overruns"]
+      skipped += $col["skipped"]
+      stalls += $col["stalls"]
+      retransmits += $col["retransmits"]
+      if ($col["lateness_max_us"] > late) late = $col["lateness_max_us"]
+      latency += $col["latency_us"]
+    }
+    END {
+      if (n) { bps /= n; tx /= n; latency /= n }
+      secs = to - from
+      gbits = bps * 8 * secs / 1e9
+      per = gbits ? (ccpu + lcpu) / gbits : 0
+      printf "{\"net\":\"%s\",\"rate\":\"%s\",\"write_size\":\"%s\",\"samples\":%d,", net, rate, size, n
+      printf "\"target_bps\":%.0f,\"achieved_bps\":%.0f,\"sent_bps\":%.0f,", target, bps, tx
+      printf "\"achieved_ratio\":%.4f,\"pacing_ratio\":%.4f,", target ? bps / target : 0, target ? tx / target : 0
+      printf "\"ticks\":%d,\"overruns\":%d,\"skipped\":%d,\"stalls\":%d,\"lateness_max_us\":%d,", ticks, overruns, skipped, stalls, late
+      printf "\"retransmits\":%d,\"latency_us\":%.1f,", retransmits, latency
+      printf "\"cpu_s_connector\":%.3f,\"cpu_s_listener\":%.3f,", ccpu, lcpu
+      printf "\"cpu_s_per_gbit\":%.4f}", per
+    }'
+}
+
+[ -x "$TCPXFER" ] || { echo "bench: $TCPXFER is not built" >&2; exit 1; }
+[ -x "$TCPXFER_READ" ] || { echo "bench: $TCPXFER_READ is not built" >&2; exit 1; }
+
+case $NET in
+  loopback) ;;
+  netns) setup_netns ;;
+  *) echo "bench: BENCH_NET must be loopback or netns, not $NET" >&2; exit 1 ;;
+esac
+
+{
+  printf '{"build":"%s","date":"%s","kernel":"%s","cpus":%d,"duration":%s,"args":"%s","results":[\n' \
+    "$(git describe --always --dirty 2>/dev/null || echo unknown)" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" \
+    "$(uname -r)" "$(getconf _NPROCESSORS_ONLN)" "$DURATION" "$ARGS"
+  sep=
+  for rate in $RATES; do
+    for size in $SIZES; do
+      echo "bench: $NET $rate write size $size" >&2
+      printf '%s  ' "$sep"
+      run_case "$rate" "$size"
+      sep=",
+"
+    done
+  done
+  printf '\n]}\n'
+} >"$TMP/report"
+
+mv "$TMP/report" "$REPORT"
+echo "bench: report written to $REPORT" >&2
@@ -19,6 +19,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/param.h>
 #include <sys/timerfd.h>
 #include <linux/tcp.h>
 #include <assert.h>
@@ -26,12 +27,47 @@
 #define MILLION 1000000
 #define BILLION 1000000000
 #define DATA_SZ 1024
+#define MAX_WRITE_SZ (16 * 1048576)
+#define MIN_NOTSENT_LOWAT 16384
+#define DEFAULT_READ_SZ 65536
+#define MAX_READ_SZ (16 * 1048576)
+#define URING_ENTRIES 1024
+#define URING_NBUFS 64
+#define URING_BUF_BYTES (4 * 1048576)
+#define URING_BGID 1
+#define URING_MAX_BATCH 32
 #define DEFAULT_PORT "8580"
 #define DEFAULT_RATE_PER_SEC 1048576
 #define CONNECT_TIMEOUT 5.0
+#define CONNECT_RETRY 0.25
+#define MAX_STREAMS 1024
+#define MAX_TARGETS 16384
+#define DEFAULT_CLIENTS 256
+#define MAX_CLIENTS 16384
+#define MAX_CONNECT_RATE 1000000
+#define MAX_THREADS 64
+#define DEFAULT_RT_PRIORITY 40
+#define DEFAULT_BUSY_POLL 50
 
 #define EV_STANDALONE 1
 #include "ev.h"
 
+static inline int64_t monotonic_ns(
+    void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+/* Wall clock, for what the peer has to read */
+static inline int64_t realtime_ns(
+    void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
 
 #endif
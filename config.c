@@ -1,9 +1,310 @@
 #include "common.h"
 #include "config.h"
+#include "stats.h"
+#include "frame.h"
+#include "recorder.h"
+#include "udp.h"
+#include "profile.h"
 #include <getopt.h>
+#include <sched.h>
+
+/* Long options with no short equivalent */
+enum {
+  OPT_TX_MODE = 256,
+  OPT_WRITE_SIZE,
+  OPT_BURST,
+  OPT_PACING,
+  OPT_ENGINE,
+  OPT_SAMPLE,
+  OPT_WINDOW,
+  OPT_SEARCH,
+  OPT_PROFILE,
+  OPT_CONNECTS,
+  OPT_FASTOPEN,
+  OPT_RX_MODE,
+  OPT_READ_SIZE,
+  OPT_FRAMED,
+  OPT_DIAG,
+  OPT_TARGETS,
+  OPT_CLIENTS,
+  OPT_RECORD,
+  OPT_RECORD_SIZE,
+  OPT_REALTIME,
+  OPT_RT_PRIORITY,
+  OPT_BUSY_POLL,
+  OPT_CPUS,
+  OPT_UDP,
+  OPT_UDP_GSO,
+};
 
 struct configuration config;
 
+/* A rate in bps, kbps, mbps or gbps, which are all bytes */
+static int64_t parse_rate(
+    const char *str)
+{
+  double tmpdbl;
+  char rate;
+  int64_t bps = 0;
+  int rc;
+
+  rc = sscanf(str, "%lf%cbps", &tmpdbl, &rate);
+  if (rc != 2) {
+    errx(EXIT_FAILURE, "Rate must be a valid value. But %s was offered.", str);
+  }
+  switch (rate) {
+    case 'g':
+      tmpdbl *= 1024;
+    case 'm':
+      tmpdbl *= 1024;
+    case 'k':
+      tmpdbl *= 1024;
+    case 'b':
+      bps = lroundf(tmpdbl);
+    break;
+
+    default:
+      errx(EXIT_FAILURE, "Rate must be in bps, kbps, mbps, gbps, but was %s", str);
+    break;
+  }
+  if (bps < 1 || bps >= INT32_MAX)
+    errx(EXIT_FAILURE, "Rate must be between %dbps and %dbps but was %s", 1, INT32_MAX, str);
+  return bps;
+}
+
+/* One target per line as "host [port [rate]]", the port and rate default
+ * to the -p and -r options. Blank lines and # comments are skipped */
+static void load_targets(
+    const char *path)
+{
+  FILE *f;
+  char line[512];
+  char host[256], port[32], rate[32];
+  struct target *t;
+  int lineno = 0;
+  int n;
+
+  f = fopen(path, "r");
+  if (!f)
+    err(EXIT_FAILURE, "Cannot open targets file %s", path);
+
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    line[strcspn(line, "#\r\n")] = 0;
+    n = sscanf(line, "%255s %31s %31s", host, port, rate);
+    if (n < 1)
+      continue;
+
+    if (config.ntargets >= MAX_TARGETS)
+      errx(EXIT_FAILURE, "%s: no more than %d targets are supported", path, MAX_TARGETS);
+    config.targets = realloc(config.targets, sizeof(struct target) * (config.ntargets + 1));
+    assert(config.targets);
+
+    t = &config.targets[config.ntargets++];
+    t->host = strdup(host);
+    t->port = strdup(n > 1 ? port : config.port);
+    t->rate = n > 2 ? parse_rate(rate) : config.rate_per_second;
+    assert(t->host && t->port);
+  }
+
+  if (ferror(f))
+    err(EXIT_FAILURE, "Cannot read targets file %s", path);
+  fclose(f);
+
+  if (config.ntargets == 0)
+    errx(EXIT_FAILURE, "%s has no targets in it", path);
+}
+
+/* CPUs as a comma separated list of numbers and ranges, eg 2,4-7. Kept
+ * in the order given, worker n runs on the nth */
+static void parse_cpus(
+    const char *str)
+{
+  const char *s = str;
+  char *p;
+  long lo, hi;
+
+  config.ncpus = 0;
+  while (*s) {
+    errno = 0;
+    lo = hi = strtol(s, &p, 10);
+    if (p == s || errno)
+      errx(EXIT_FAILURE, "CPUs must be a list like 0,2,4-7, not %s", str);
+    if (*p == '-') {
+      s = p + 1;
+      hi = strtol(s, &p, 10);
+      if (p == s || errno)
+        errx(EXIT_FAILURE, "CPUs must be a list like 0,2,4-7, not %s", str);
+    }
+    if (lo < 0 || hi >= CPU_SETSIZE || lo > hi)
+      errx(EXIT_FAILURE, "CPUs must be between 0 and %d, not %s", CPU_SETSIZE - 1, str);
+
+    for (; lo <= hi; lo++) {
+      config.cpus = realloc(config.cpus, sizeof(int) * (config.ncpus + 1));
+      assert(config.cpus);
+      config.cpus[config.ncpus++] = lo;
+    }
+
+    if (*p == ',')
+      p++;
+    else if (*p != 0)
+      errx(EXIT_FAILURE, "CPUs must be a list like 0,2,4-7, not %s", str);
+    s = p;
+  }
+
+  if (config.ncpus == 0)
+    errx(EXIT_FAILURE, "CPUs must be a list like 0,2,4-7, not %s", str);
+}
+
+/* A byte count with an optional k, m or g suffix */
+static int64_t parse_size(
+    const char *str,
+    const char *what,
+    int64_t min,
+    int64_t max)
+{
+  double tmpdbl;
+  char unit = 'b';
+  int rc;
+
+  rc = sscanf(str, "%lf%c", &tmpdbl, &unit);
+  if (rc < 1)
+    errx(EXIT_FAILURE, "%s must be a valid size. But %s was offered.", what, str);
+
+  switch (unit) {
+    case 'g':
+    case 'G':
+      tmpdbl *= 1024;
+    case 'm':
+    case 'M':
+      tmpdbl *= 1024;
+    case 'k':
+    case 'K':
+      tmpdbl *= 1024;
+    case 'b':
+    break;
+
+    default:
+      errx(EXIT_FAILURE, "%s must be in b, k, m or g but was %s", what, str);
+    break;
+  }
+
+  if (tmpdbl < min || tmpdbl > max)
+    errx(EXIT_FAILURE, "%s must be between %ld and %ld bytes but was %s", what, min, max, str);
+  return llround(tmpdbl);
+}
+
+/* Seconds with an optional ms or us suffix */
+static double parse_duration(
+    const char *str,
+    const char *what,
+    double min,
+    double max)
+{
+  double tmpdbl;
+  char *p;
+
+  errno = 0;
+  tmpdbl = strtod(str, &p);
+  if (p == str || errno == ERANGE)
+    errx(EXIT_FAILURE, "%s must be between %g and %g seconds, not %s", what, min, max, str);
+
+  if (strcmp(p, "ms") == 0)
+    tmpdbl /= 1000.0;
+  else if (strcmp(p, "us") == 0)
+    tmpdbl /= MILLION;
+  else if (*p != 0 && strcmp(p, "s") != 0)
+    errx(EXIT_FAILURE, "%s must be in s, ms or us, not %s", what, str);
+
+  if (tmpdbl < min || tmpdbl > max)
+    errx(EXIT_FAILURE, "%s must be between %g and %g seconds, not %s", what, min, max, str);
+  return tmpdbl;
+}
+
+/* A profile rate, which may also be off */
+static double parse_profile_rate(
+    const char *str)
+{
+  return strcmp(str, "off") == 0 ? 0. : parse_rate(str);
+}
+
+/* One segment per line as "direction shape duration ...", the connector
+ * follows the up lines and the listener the down ones:
+ *   up hold 10s 100mbps
+ *   up ramp 30s 10mbps 200mbps
+ *   up square 60s 500mbps off 1s 10%
+ * Blank lines and # comments are skipped */
+static void load_profile(
+    const char *path)
+{
+  FILE *f;
+  char line[512];
+  char dir[16], shape[16], secs[32], a[4][32];
+  const char *mine = config.listener ? "down" : "up";
+  struct profile_seg seg;
+  int lineno = 0;
+  int n;
+
+  f = fopen(path, "r");
+  if (!f)
+    err(EXIT_FAILURE, "Cannot open profile %s", path);
+
+  config.profile = calloc(1, sizeof(struct profile));
+  assert(config.profile);
+
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    line[strcspn(line, "#\r\n")] = 0;
+    n = sscanf(line, "%15s %15s %31s %31s %31s %31s %31s", dir, shape, secs, a[0], a[1], a[2], a[3]);
+    if (n < 1)
+      continue;
+    if (strcmp(dir, "up") != 0 && strcmp(dir, "down") != 0)
+      errx(EXIT_FAILURE, "%s:%d: direction must be up or down, not %s", path, lineno, dir);
+    if (n < 4)
+      errx(EXIT_FAILURE, "%s:%d: expected \"direction shape duration rate ...\"", path, lineno);
+
+    memset(&seg, 0, sizeof(seg));
+    seg.secs = parse_duration(secs, "Profile segment", 0.001, 86400.0);
+    seg.rate = parse_profile_rate(a[0]);
+    if (strcmp(shape, "hold") == 0 && n == 4) {
+      seg.shape = PROFILE_HOLD;
+    }
+    else if (strcmp(shape, "ramp") == 0 && n == 5) {
+      seg.shape = PROFILE_RAMP;
+      seg.rate2 = parse_profile_rate(a[1]);
+    }
+    else if (strcmp(shape, "square") == 0 && (n == 6 || n == 7)) {
+      seg.shape = PROFILE_SQUARE;
+      seg.rate2 = parse_profile_rate(a[1]);
+      seg.period = parse_duration(a[2], "Square wave period", 0.0001, seg.secs);
+      seg.duty = .5;
+      if (n == 7 && (sscanf(a[3], "%lf%%", &seg.duty) != 1 || seg.duty <= 0. || seg.duty >= 100.))
+        errx(EXIT_FAILURE, "%s:%d: duty cycle must be a percentage between 0 and 100, not %s",
+             path, lineno, a[3]);
+      else if (n == 7)
+        seg.duty /= 100.;
+    }
+    else {
+      errx(EXIT_FAILURE, "%s:%d: shape must be \"hold RATE\", \"ramp FROM TO\" or "
+           "\"square HIGH LOW PERIOD [DUTY%%]\"", path, lineno);
+    }
+
+    if (strcmp(dir, mine) == 0)
+      profile_add(config.profile, &seg);
+  }
+
+  if (ferror(f))
+    err(EXIT_FAILURE, "Cannot read profile %s", path);
+  fclose(f);
+
+  if (config.profile->nsegs == 0 || config.profile->bytes <= 0.) {
+    warnx("%s has nothing to send %s, sending at a flat rate", path, mine);
+    free(config.profile->segs);
+    free(config.profile);
+    config.profile = NULL;
+  }
+}
+
 static inline void print_usage(
     void)
 {
@@ -21,20 +322,66 @@ static inline void print_help(
 "    --port                -p PORT      Use port PORT. Default: %s\n"
 "    --interval            -i INTERVAL  Print result data in INTERVAL seconds. Default 10 seconds.\n"
 "    --rate                -r           Ceiling of transfer rate. Default 1mbps.\n"
-"\n", DEFAULT_PORT);
+"    --streams             -s STREAMS   Split the rate across STREAMS connections. Default 1.\n"
+"    --threads             -t THREADS   Run the streams over THREADS event loops. Default 1.\n"
+"    --clients                CLIENTS   Listening, serve up to CLIENTS connections at once, each\n"
+"                                       paced at RATE/STREAMS. Default %d.\n"
+"    --tx-mode                MODE      How to transmit: copy, zerocopy (MSG_ZEROCOPY) or sendfile.\n"
+"                                       Default copy.\n"
+"    --write-size             SIZE      Largest single write to the socket, eg 64k. Default %d.\n"
+"    --rx-mode                MODE      How to receive: copy, trunc (discard in the kernel with\n"
+"                                       MSG_TRUNC) or splice (into a pipe and on to /dev/null).\n"
+"                                       Default copy.\n"
+"    --read-size              SIZE      Largest single read from the socket. Default %d.\n"
+"    --framed                           Stamp every write with a sequence number and send time\n"
+"                                       and report one-way delay and jitter. Both ends need it.\n"
+"    --udp                              Send sequence numbered datagrams instead of a TCP stream and\n"
+"                                       report loss, reordering, duplicates and jitter. The\n"
+"                                       listener sends a report back every sample.\n"
+"    --udp-gso                          With --udp, send with GSO and receive with GRO.\n"
+"    --targets                FILE      Probe every peer in FILE, one \"host [port [rate]]\" per line,\n"
+"                                       with a stream and sliding window each. Replaces hostname.\n"
+"    --diag                             Sample every stream's TCP_INFO from one sock_diag netlink\n"
+"                                       dump per thread rather than a getsockopt() each.\n"
+"    --burst                  INTERVAL  Pace in ticks of INTERVAL (eg 1ms), sending whatever is owed\n"
+"                                       each tick. Default is one tick per write.\n"
+"    --pacing                 PACER     Who paces the sends: timer (userspace) or kernel\n"
+"                                       (SO_MAX_PACING_RATE). Default timer.\n"
+"    --engine                 ENGINE    Drive the sockets with epoll (libev) or io_uring. Default epoll.\n"
+"    --record                 FILE      Keep every sample of every stream in FILE, a ring of fixed\n"
+"                                       size records. Read it back with tcpxfer-read.\n"
+"    --record-size            SIZE      Size of the recording, eg 1g. Default 64m.\n"
+"    --realtime                         Lock memory, run every thread SCHED_FIFO with no timer slack,\n"
+"                                       busy poll the sockets and check the timer jitter at start.\n"
+"    --rt-priority            PRIORITY  SCHED_FIFO priority with --realtime. Default %d.\n"
+"    --busy-poll              USECS     Busy poll each socket for USECS (SO_BUSY_POLL), 0 for none.\n"
+"                                       Default %d with --realtime, otherwise none.\n"
+"    --cpus                   LIST      Pin thread n to the nth CPU in LIST, eg 2,4-7.\n"
+"    --sample                 INTERVAL  Sample the connection every INTERVAL. Default %.1fs.\n"
+"    --window                 SECONDS   Judge the link over a sliding window of SECONDS. Default %lds.\n"
+"    --search                 FLOOR     Find the highest rate between FLOOR and RATE the link carries\n"
+"                                       within the watermarks, a window per step, then exit.\n"
+"    --profile                FILE      Send to the traffic shape in FILE rather than a flat RATE, the\n"
+"                                       connector following its up lines and the listener its down.\n"
+"    --connects               RATE      Open and close RATE connections a second, split over the\n"
+"                                       streams, and judge the handshakes instead of a transfer.\n"
+"                                       Both ends need it, a listener sizing for RATE.\n"
+"    --fastopen                         With --connects, send a request in the SYN with TCP Fast Open.\n"
+"\n", DEFAULT_PORT, DEFAULT_CLIENTS, DATA_SZ, DEFAULT_READ_SZ, DEFAULT_RT_PRIORITY, DEFAULT_BUSY_POLL,
+    STATS_FREQUENCY, STATS_SECS);
 }
 
 void config_parse(
     int argc,
     char **argv)
 {
-  char c;
+  int c;
   int optidx;
 
   double tmpdbl;
   char *p;
-  char rate;
-  int rc;
+  char *targets = NULL;
+  char *profile = NULL;
 
   memset(&config, 0, sizeof(config));
 
@@ -44,6 +391,33 @@ void config_parse(
     { "rate",        required_argument, NULL, 'r' },
     { "interval",    required_argument, NULL, 'i' },
     { "port",        required_argument, NULL, 'p' },
+    { "streams",     required_argument, NULL, 's' },
+    { "threads",     required_argument, NULL, 't' },
+    { "tx-mode",     required_argument, NULL, OPT_TX_MODE },
+    { "write-size",  required_argument, NULL, OPT_WRITE_SIZE },
+    { "rx-mode",     required_argument, NULL, OPT_RX_MODE },
+    { "read-size",   required_argument, NULL, OPT_READ_SIZE },
+    { "framed",      no_argument,       NULL, OPT_FRAMED },
+    { "diag",        no_argument,       NULL, OPT_DIAG },
+    { "udp",         no_argument,       NULL, OPT_UDP },
+    { "udp-gso",     no_argument,       NULL, OPT_UDP_GSO },
+    { "targets",     required_argument, NULL, OPT_TARGETS },
+    { "clients",     required_argument, NULL, OPT_CLIENTS },
+    { "record",      required_argument, NULL, OPT_RECORD },
+    { "record-size", required_argument, NULL, OPT_RECORD_SIZE },
+    { "burst",       required_argument, NULL, OPT_BURST },
+    { "pacing",      required_argument, NULL, OPT_PACING },
+    { "engine",      required_argument, NULL, OPT_ENGINE },
+    { "realtime",    no_argument,       NULL, OPT_REALTIME },
+    { "rt-priority", required_argument, NULL, OPT_RT_PRIORITY },
+    { "busy-poll",   required_argument, NULL, OPT_BUSY_POLL },
+    { "cpus",        required_argument, NULL, OPT_CPUS },
+    { "sample",      required_argument, NULL, OPT_SAMPLE },
+    { "window",      required_argument, NULL, OPT_WINDOW },
+    { "search",      required_argument, NULL, OPT_SEARCH },
+    { "profile",     required_argument, NULL, OPT_PROFILE },
+    { "connects",    required_argument, NULL, OPT_CONNECTS },
+    { "fastopen",    no_argument,       NULL, OPT_FASTOPEN },
     {  0,            0,                 0,     0  },
   };
 
@@ -53,10 +427,24 @@ void config_parse(
   config.rate_per_second = DEFAULT_RATE_PER_SEC;
   config.port = NULL;
   config.hostname = NULL;
-  config.per_packet_wait = 0.0;
+  config.streams = 1;
+  config.threads = 1;
+  config.clients = DEFAULT_CLIENTS;
+  config.record_size = REC_DEFAULT_SZ;
+  config.tx_mode = TX_COPY;
+  config.write_size = DATA_SZ;
+  config.rx_mode = RX_COPY;
+  config.read_size = DEFAULT_READ_SZ;
+  config.burst = 0.0;
+  config.pacing = PACING_TIMER;
+  config.engine = ENGINE_EPOLL;
+  config.rt_priority = DEFAULT_RT_PRIORITY;
+  config.busy_poll = -1;
+  config.stats_frequency = STATS_FREQUENCY;
+  config.stats_secs = STATS_SECS;
 
   while (1) {
-    c = getopt_long(argc, argv, "hlr:i:p:", long_options, &optidx);
+    c = getopt_long(argc, argv, "hlr:i:p:s:t:", long_options, &optidx);
     if (c == -1)
       break;
 
@@ -69,27 +457,7 @@ void config_parse(
     break;
 
     case 'r':
-      rc = sscanf(optarg, "%lf%cbps", &tmpdbl, &rate);
-      if (rc != 2) {
-        err(EXIT_FAILURE, "Rate must be a valid value. But %s was offered.", optarg);
-      }
-      switch (rate) {
-        case 'g':
-          tmpdbl *= 1024;
-        case 'm':
-          tmpdbl *= 1024;
-        case 'k':
-          tmpdbl *= 1024;
-        case 'b':
-          config.rate_per_second = lroundf(tmpdbl);
-        break;
-
-        default:
-          errx(EXIT_FAILURE, "Rate must be in bps, kbps, mbps, gbps, but was %s", optarg);
-        break;
-      }
-      if (config.rate_per_second < 1 || config.rate_per_second >= INT32_MAX)
-        errx(EXIT_FAILURE, "Size must be between %llubps and %llubps but was %s", 1, INT32_MAX, optarg);
+      config.rate_per_second = parse_rate(optarg);
     break;
 
     case 'p':
@@ -112,6 +480,172 @@ void config_parse(
       config.listener = true;
     break;
 
+    case 's':
+      errno = 0;
+      config.streams = strtol(optarg, &p, 10);
+      if (strlen(optarg) != p-optarg || errno == ERANGE)
+        errx(EXIT_FAILURE, "Streams must be between 1 and %d, not %s", MAX_STREAMS, optarg);
+      if (config.streams < 1 || config.streams > MAX_STREAMS)
+        errx(EXIT_FAILURE, "Streams must be between 1 and %d, not %s", MAX_STREAMS, optarg);
+    break;
+
+    case 't':
+      errno = 0;
+      config.threads = strtol(optarg, &p, 10);
+      if (strlen(optarg) != p-optarg || errno == ERANGE)
+        errx(EXIT_FAILURE, "Threads must be between 1 and %d, not %s", MAX_THREADS, optarg);
+      if (config.threads < 1 || config.threads > MAX_THREADS)
+        errx(EXIT_FAILURE, "Threads must be between 1 and %d, not %s", MAX_THREADS, optarg);
+    break;
+
+    case OPT_CLIENTS:
+      errno = 0;
+      config.clients = strtol(optarg, &p, 10);
+      if (strlen(optarg) != p-optarg || errno == ERANGE)
+        errx(EXIT_FAILURE, "Clients must be between 1 and %d, not %s", MAX_CLIENTS, optarg);
+      if (config.clients < 1 || config.clients > MAX_CLIENTS)
+        errx(EXIT_FAILURE, "Clients must be between 1 and %d, not %s", MAX_CLIENTS, optarg);
+    break;
+
+    case OPT_RECORD:
+      config.record_path = strdup(optarg);
+      assert(config.record_path);
+    break;
+
+    case OPT_RECORD_SIZE:
+      config.record_size = parse_size(optarg, "Recording size", REC_MIN_SZ, INT64_MAX);
+    break;
+
+    case OPT_TX_MODE:
+      if (strcmp(optarg, "copy") == 0)
+        config.tx_mode = TX_COPY;
+      else if (strcmp(optarg, "zerocopy") == 0)
+        config.tx_mode = TX_ZEROCOPY;
+      else if (strcmp(optarg, "sendfile") == 0)
+        config.tx_mode = TX_SENDFILE;
+      else
+        errx(EXIT_FAILURE, "Transmit mode must be copy, zerocopy or sendfile, not %s", optarg);
+    break;
+
+    case OPT_WRITE_SIZE:
+      config.write_size = parse_size(optarg, "Write size", 1, MAX_WRITE_SZ);
+    break;
+
+    case OPT_RX_MODE:
+      if (strcmp(optarg, "copy") == 0)
+        config.rx_mode = RX_COPY;
+      else if (strcmp(optarg, "trunc") == 0)
+        config.rx_mode = RX_TRUNC;
+      else if (strcmp(optarg, "splice") == 0)
+        config.rx_mode = RX_SPLICE;
+      else
+        errx(EXIT_FAILURE, "Receive mode must be copy, trunc or splice, not %s", optarg);
+    break;
+
+    case OPT_READ_SIZE:
+      config.read_size = parse_size(optarg, "Read size", 1, MAX_READ_SZ);
+    break;
+
+    case OPT_FRAMED:
+      config.framed = true;
+    break;
+
+    case OPT_DIAG:
+      config.diag = true;
+    break;
+
+    case OPT_UDP:
+      config.udp = true;
+    break;
+
+    case OPT_UDP_GSO:
+      config.udp_gso = true;
+    break;
+
+    case OPT_TARGETS:
+      targets = optarg;
+    break;
+
+    case OPT_BURST:
+      config.burst = parse_duration(optarg, "Burst interval", 0.00001, 1.0);
+    break;
+
+    case OPT_PACING:
+      if (strcmp(optarg, "timer") == 0)
+        config.pacing = PACING_TIMER;
+      else if (strcmp(optarg, "kernel") == 0)
+        config.pacing = PACING_KERNEL;
+      else
+        errx(EXIT_FAILURE, "Pacing must be timer or kernel, not %s", optarg);
+    break;
+
+    case OPT_ENGINE:
+      if (strcmp(optarg, "epoll") == 0)
+        config.engine = ENGINE_EPOLL;
+      else if (strcmp(optarg, "uring") == 0 || strcmp(optarg, "io_uring") == 0)
+        config.engine = ENGINE_URING;
+      else
+        errx(EXIT_FAILURE, "Engine must be epoll or uring, not %s", optarg);
+    break;
+
+    case OPT_REALTIME:
+      config.realtime = true;
+    break;
+
+    case OPT_RT_PRIORITY:
+      errno = 0;
+      config.rt_priority = strtol(optarg, &p, 10);
+      if (strlen(optarg) != p-optarg || errno == ERANGE)
+        errx(EXIT_FAILURE, "Priority must be between %d and %d, not %s",
+             sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO), optarg);
+      if (config.rt_priority < sched_get_priority_min(SCHED_FIFO) ||
+          config.rt_priority > sched_get_priority_max(SCHED_FIFO))
+        errx(EXIT_FAILURE, "Priority must be between %d and %d, not %s",
+             sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO), optarg);
+    break;
+
+    case OPT_BUSY_POLL:
+      errno = 0;
+      config.busy_poll = strtol(optarg, &p, 10);
+      if (strlen(optarg) != p-optarg || errno == ERANGE)
+        errx(EXIT_FAILURE, "Busy poll must be between 0 and %d microseconds, not %s", MILLION, optarg);
+      if (config.busy_poll < 0 || config.busy_poll > MILLION)
+        errx(EXIT_FAILURE, "Busy poll must be between 0 and %d microseconds, not %s", MILLION, optarg);
+    break;
+
+    case OPT_CPUS:
+      parse_cpus(optarg);
+    break;
+
+    case OPT_SAMPLE:
+      config.stats_frequency = parse_duration(optarg, "Sample interval", 0.001, 60.0);
+    break;
+
+    case OPT_WINDOW:
+      config.stats_secs = parse_duration(optarg, "Window", 1.0, 86400.0);
+    break;
+
+    case OPT_SEARCH:
+      config.search_floor = parse_rate(optarg);
+    break;
+
+    case OPT_PROFILE:
+      profile = optarg;
+    break;
+
+    case OPT_CONNECTS:
+      errno = 0;
+      config.connect_rate = strtoll(optarg, &p, 10);
+      if (strlen(optarg) != p-optarg || errno == ERANGE)
+        errx(EXIT_FAILURE, "Connects must be between 1 and %d a second, not %s", MAX_CONNECT_RATE, optarg);
+      if (config.connect_rate < 1 || config.connect_rate > MAX_CONNECT_RATE)
+        errx(EXIT_FAILURE, "Connects must be between 1 and %d a second, not %s", MAX_CONNECT_RATE, optarg);
+    break;
+
+    case OPT_FASTOPEN:
+      config.fastopen = true;
+    break;
+
     default:
       print_usage();
       print_help();
@@ -120,14 +654,23 @@ void config_parse(
     }
   }
 
-  if (argv[optind] == NULL && config.listener == false) 
+  if (argv[optind] == NULL && config.listener == false && !targets) 
     errx(EXIT_FAILURE, "If not listening, must pass a host to connect to.");
 
   if (!config.port)
     config.port = strdup(DEFAULT_PORT);
 
-  if (config.listener) 
+  if (config.listener && targets)
+    errx(EXIT_FAILURE, "A target list is for probing, it cannot be used when listening");
+  else if (config.listener)
     config.hostname = NULL;
+  else if (targets) {
+    if (config.streams > 1)
+      errx(EXIT_FAILURE, "A target list runs one stream per target, it cannot be used with --streams");
+    load_targets(targets);
+    config.hostname = NULL;
+    config.streams = config.ntargets;
+  }
   else {
     config.hostname = strdup(argv[optind]);
     assert(config.hostname);
@@ -135,8 +678,71 @@ void config_parse(
 
   assert(config.port);
 
-  config.per_packet_wait = (double)config.rate_per_second / (double)DATA_SZ;
-  config.per_packet_wait = 1.0 / config.per_packet_wait;
+  if (config.listener && config.threads > config.clients)
+    errx(EXIT_FAILURE, "Cannot run %d threads for only %d clients", config.threads, config.clients);
+  if (!config.listener && config.threads > config.streams)
+    errx(EXIT_FAILURE, "Cannot run %d threads for only %d streams", config.threads, config.streams);
+
+  config.stats_records = lround(config.stats_secs / config.stats_frequency);
+  if (config.stats_records < STATS_MIN_RECORDS)
+    errx(EXIT_FAILURE, "The window must hold at least %d samples, but %.3fs of %.3fs samples is only %d",
+         STATS_MIN_RECORDS, config.stats_secs, config.stats_frequency, config.stats_records);
+
+  if (config.engine == ENGINE_URING && config.pacing != PACING_TIMER)
+    errx(EXIT_FAILURE, "The io_uring engine does its own pacing, it cannot use kernel pacing");
+  if (config.engine == ENGINE_URING && config.tx_mode != TX_COPY)
+    errx(EXIT_FAILURE, "The io_uring engine only transmits in copy mode");
+  if (config.engine == ENGINE_URING && config.rx_mode != RX_COPY)
+    errx(EXIT_FAILURE, "The io_uring engine only receives in copy mode");
+
+  if (config.framed && (config.engine != ENGINE_EPOLL || config.tx_mode != TX_COPY || config.rx_mode != RX_COPY))
+    errx(EXIT_FAILURE, "Framed payloads need the epoll engine and copying sends and receives");
+  if (config.framed && config.write_size < sizeof(struct frame_hdr))
+    errx(EXIT_FAILURE, "Framed payloads need a write size of at least %zu", sizeof(struct frame_hdr));
+
+  if (config.busy_poll < 0)
+    config.busy_poll = config.realtime ? DEFAULT_BUSY_POLL : 0;
+  if (config.ncpus && config.ncpus < config.threads)
+    warnx("Only %d CPUs for %d threads, some threads will share", config.ncpus, config.threads);
+
+  if (config.search_floor && (config.listener || config.ntargets))
+    errx(EXIT_FAILURE, "A search steps the rate to a single peer, it cannot be used listening or with --targets");
+  if (config.search_floor && config.search_floor >= config.rate_per_second)
+    errx(EXIT_FAILURE, "The search floor must be below the rate");
+
+  if (profile && (config.search_floor || config.ntargets))
+    errx(EXIT_FAILURE, "A profile sets the rate itself, it cannot be used with --search or --targets");
+  if (profile && config.pacing != PACING_TIMER)
+    errx(EXIT_FAILURE, "A profile needs timer pacing to follow it");
+  if (profile)
+    load_profile(profile);
+  /* Ticks of a fixed length, each worth what the shape owes over it */
+  if (config.profile && config.burst == 0.)
+    config.burst = PROFILE_TICK;
+
+  if (config.fastopen && !config.connect_rate)
+    errx(EXIT_FAILURE, "--fastopen only goes with --connects");
+  if (config.connect_rate && (config.udp || config.ntargets || config.search_floor || config.profile ||
+                              config.framed || config.diag))
+    errx(EXIT_FAILURE, "Connection rate mode cannot be used with --udp, --targets, --search, --profile, "
+         "--framed or --diag");
+  if (config.connect_rate && (config.engine != ENGINE_EPOLL || config.pacing != PACING_TIMER))
+    errx(EXIT_FAILURE, "Connection rate mode needs the epoll engine and timer pacing");
+  if (config.connect_rate && config.connect_rate < config.streams)
+    errx(EXIT_FAILURE, "Connection rate mode needs at least one connect a second per stream");
+
+  if (config.udp_gso && !config.udp)
+    errx(EXIT_FAILURE, "--udp-gso only goes with --udp");
+  if (config.udp && (config.engine != ENGINE_EPOLL || config.pacing != PACING_TIMER ||
+                     config.tx_mode != TX_COPY || config.rx_mode != RX_COPY))
+    errx(EXIT_FAILURE, "UDP needs the epoll engine, timer pacing and copying sends and receives");
+  if (config.udp && (config.framed || config.diag))
+    errx(EXIT_FAILURE, "UDP datagrams are always framed and have no TCP_INFO, drop --framed and --diag");
+  if (config.udp && (config.write_size < sizeof(struct frame_hdr) || config.write_size > UDP_MAX_PAYLOAD))
+    errx(EXIT_FAILURE, "UDP needs a write size between %zu and %d", sizeof(struct frame_hdr), UDP_MAX_PAYLOAD);
+
+  /* With kernel pacing keep a couple of writes queued but no more */
+  config.notsent_lowat = MAX(config.write_size * 2, MIN_NOTSENT_LOWAT);
 
 }
 
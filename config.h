@@ -2,13 +2,74 @@
 #define _CONFIG_H_
 #include "common.h"
 
+enum tx_mode {
+  TX_COPY,
+  TX_ZEROCOPY,
+  TX_SENDFILE
+};
+
+enum rx_mode {
+  RX_COPY,
+  RX_TRUNC,
+  RX_SPLICE
+};
+
+enum pacing {
+  PACING_TIMER,
+  PACING_KERNEL
+};
+
+enum engine {
+  ENGINE_EPOLL,
+  ENGINE_URING
+};
+
+struct profile;
+
+/* One peer of a multi-target prober */
+struct target {
+  char *host;
+  char *port;
+  int64_t rate;
+};
+
 struct configuration {
   int fd;
   double print_interval;
   int64_t rate_per_second;
-  double per_packet_wait;
+  size_t write_size;
+  double burst;
+  enum pacing pacing;
+  enum engine engine;
+  int notsent_lowat;
+  double stats_frequency;
+  double stats_secs;
+  int stats_records;
+  int64_t search_floor;
+  struct profile *profile;
+  int64_t connect_rate;
+  bool fastopen;
+  int streams;
+  int clients;
+  int threads;
+  enum tx_mode tx_mode;
+  enum rx_mode rx_mode;
+  size_t read_size;
+  bool framed;
+  bool diag;
+  bool udp;
+  bool udp_gso;
+  char *record_path;
+  size_t record_size;
+  bool realtime;
+  int rt_priority;
+  int busy_poll;
+  int *cpus;
+  int ncpus;
   char *port;
   char *hostname;
+  struct target *targets;
+  int ntargets;
   bool listener;
 };
 
@@ -0,0 +1,250 @@
+#include "common.h"
+#include "detector.h"
+
+/* The congestion detector. The stream's transfer and latency totals
+ * should each climb in a straight line over a window of samples, so the
+ * Pearson correlation of each against time is close to one on a healthy
+ * link and falls away as congestion saws the line about */
+
+/* Adds (sign 1) or removes (sign -1) a record from the window sums */
+static void window_update(
+    struct window_sums *w,
+    stat_record_t *r,
+    double sign)
+{
+  double x = r->timestamp - w->x0;
+  double t = r->bytes_total - w->t0;
+  double l = r->latency_total - w->l0;
+
+  w->x += sign * x;
+  w->xx += sign * x * x;
+  w->t += sign * t;
+  w->tt += sign * t * t;
+  w->xt += sign * x * t;
+  w->l += sign * l;
+  w->ll += sign * l * l;
+  w->xl += sign * x * l;
+  w->bps += sign * r->bps;
+  w->latency += sign * r->latency_us;
+  w->datagrams += sign * r->datagrams;
+  w->lost += sign * r->lost;
+  w->connects += sign * r->connects;
+  w->connect_failures += sign * r->connect_failures;
+  if (r->state == LINK_DISCONNECTED)
+    w->disconnects += sign;
+}
+
+
+
+static void window_rebuild(
+    struct detector *d)
+{
+  int i;
+  struct window_sums *w = &d->sums;
+  stat_record_t *oldest = &d->records[d->nextrec % d->nrecs];
+
+  memset(w, 0, sizeof(*w));
+  w->x0 = oldest->timestamp;
+  w->t0 = oldest->bytes_total;
+  w->l0 = oldest->latency_total;
+
+  for (i=0; i < d->nrecs; i++)
+    window_update(w, &d->records[i], 1.);
+}
+
+
+
+/* Pearson's r from the sums, NaN where either side has no variance */
+static double pearson(
+    double n,
+    double x,
+    double xx,
+    double y,
+    double yy,
+    double xy)
+{
+  double sxy = xy - (x * y) / n;
+  double sxx = xx - (x * x) / n;
+  double syy = yy - (y * y) / n;
+
+  if (sxx <= 0. || syy <= 0.)
+    return NAN;
+  return sxy / sqrt(sxx * syy);
+}
+
+
+
+static void detector_fitness(
+    struct detector *d)
+{
+  struct window_sums *w = &d->sums;
+  double n = d->nrecs;
+  double lost = w->lost + w->connect_failures;
+  double tried = w->datagrams + w->connects + lost;
+
+  d->throughput_fitness = pearson(n, w->x, w->xx, w->t, w->tt, w->xt);
+  d->latency_fitness = pearson(n, w->x, w->xx, w->l, w->ll, w->xl);
+  d->latency_mean = w->latency / n;
+  d->throughput_mean = w->bps / n;
+  d->loss = tried > 0. ? lost / tried : 0.;
+}
+
+
+
+static int link_state(
+    struct detector *d)
+{
+  int state=0;
+  int state_old = d->state;
+
+  double rcl = d->latency_fitness;
+  double tp = d->throughput_fitness;
+
+  if (isnan(rcl))
+    state |= LATENCY_CRIT;
+  else if (rcl < WATERMARK_LATENCY_LO)
+    state |= LATENCY_CRIT;
+  else
+    state |= LATENCY_OK;
+
+  if (isnan(tp))
+    state |= THROUGHPUT_CRIT;
+  else if (d->loss > WATERMARK_LOSS)
+    state |= THROUGHPUT_CRIT;
+  else if (tp < WATERMARK_THROUGHPUT_LO)
+    state |= THROUGHPUT_CRIT;
+  else
+    state |= THROUGHPUT_OK;
+
+  if ((state & (LATENCY_OK|THROUGHPUT_OK)) == (LATENCY_OK|THROUGHPUT_OK))
+    d->alerting = false;
+  if (state & (LATENCY_CRIT|THROUGHPUT_CRIT))
+    d->alerting = true;
+
+  d->state = state;
+  return state == state_old ? 0 : state;
+}
+
+
+
+void detector_init(
+    struct detector *d,
+    int nrecs)
+{
+  assert(nrecs > 0);
+  memset(d, 0, sizeof(*d));
+  d->nrecs = nrecs;
+  d->disconnected = true;
+  d->records = calloc(sizeof(stat_record_t), nrecs);
+  assert(d->records);
+  window_rebuild(d);
+}
+
+
+
+void detector_destroy(
+    struct detector *d)
+{
+  free(d->records);
+  d->records = NULL;
+}
+
+
+
+stat_record_t * detector_next(
+    struct detector *d)
+{
+  stat_record_t *r = &d->records[d->nextrec % d->nrecs];
+
+  r->_epoch++;
+  window_update(&d->sums, r, -1.);
+  return r;
+}
+
+
+
+/* The link only changes state here, the detector's own idea of whether
+ * it is up follows in detector_commit() so a caller reporting in between
+ * still sees the old one */
+int detector_mark(
+    struct detector *d,
+    stat_record_t *r,
+    int rc)
+{
+  int events = 0;
+
+  r->measured = rc > 0;
+  r->alerting = false;
+  if (rc <= 0) {
+    if (!d->disconnected) {
+      r->state = LINK_DISCONNECTED;
+      events |= DETECT_LOST;
+    }
+    else {
+      r->state = LINK_UNCHANGED;
+    }
+  }
+  else if (d->disconnected) {
+    r->state = LINK_CONNECTED;
+    events |= DETECT_RESTORED;
+  }
+  else {
+    r->state = LINK_UNCHANGED;
+  }
+
+  /* Nothing was measured, don't let the last pass through the ring
+   * speak for this sample */
+  if (rc == 0) {
+    r->limit = LIMIT_UNKNOWN;
+    r->retransmits = 0;
+    r->tx_bps = r->target_bps = 0.;
+    r->ticks = r->overruns = r->skipped = r->stalls = r->lateness_max_us = 0;
+    r->datagrams = r->lost = r->reordered = r->duplicates = 0;
+    r->connects = r->connect_failures = r->fastopens = 0;
+    r->reconnect_s = 0.;
+  }
+  return events;
+}
+
+
+
+/* Only judges the link once every sample in the window measured it */
+int detector_commit(
+    struct detector *d,
+    stat_record_t *r)
+{
+  int changed = 0;
+
+  if (r->state == LINK_DISCONNECTED)
+    d->disconnected = true;
+  else if (r->state == LINK_CONNECTED)
+    d->disconnected = false;
+
+  window_update(&d->sums, r, 1.);
+  d->nextrec++;
+  if (d->nextrec % d->nrecs == 0)
+    window_rebuild(d);
+  detector_fitness(d);
+
+  if (detector_settled(d))
+    changed = link_state(d);
+  r->alerting = d->alerting;
+  return changed;
+}
+
+
+
+int detector_feed(
+    struct detector *d,
+    const stat_record_t *s)
+{
+  stat_record_t *r = detector_next(d);
+  int epoch = r->_epoch;
+
+  if (s) {
+    *r = *s;
+    r->_epoch = epoch;
+  }
+  detector_mark(d, r, s ? 1 : 0);
+  return detector_commit(d, r);
+}
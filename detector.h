@@ -0,0 +1,84 @@
+#ifndef _DETECTOR_H_
+#define _DETECTOR_H_
+#include "common.h"
+#include "stats.h"
+
+#define WATERMARK_LATENCY_LO    .95
+#define WATERMARK_LATENCY_HI    .99
+#define WATERMARK_THROUGHPUT_LO .95
+#define WATERMARK_THROUGHPUT_HI .99
+/* Share of datagrams, or of handshakes, lost over the window that is
+ * critical */
+#define WATERMARK_LOSS          .01
+
+#define UNCHANGED       0x0
+#define LATENCY_OK      0x1
+#define LATENCY_CRIT    0x2
+#define THROUGHPUT_OK   0x4
+#define THROUGHPUT_CRIT 0x8
+
+/* What a sample did to the link, from detector_mark() */
+#define DETECT_LOST     0x1
+#define DETECT_RESTORED 0x2
+
+/* Running sums over the window so each new sample costs the same however
+ * long the window is. Everything is summed relative to an origin which
+ * moves up every time the ring wraps, when the sums are rebuilt from
+ * scratch, so they neither lose precision nor accumulate drift */
+struct window_sums {
+  double x0, t0, l0;
+
+  double x, xx;
+  double t, tt, xt;
+  double l, ll, xl;
+  double bps;
+  double latency;
+  double datagrams;
+  double lost;
+  double connects;
+  double connect_failures;
+
+  int disconnects;
+};
+
+/* The window of samples and what it says about the link. Knows nothing
+ * of clocks or sockets, so it can be fed live by the stats timer or from
+ * a trace as fast as it will go */
+struct detector {
+  int nrecs;
+  int nextrec;
+  stat_record_t *records;
+  struct window_sums sums;
+  bool disconnected;
+
+  double throughput_fitness;
+  double latency_fitness;
+  double throughput_mean;
+  double latency_mean;
+  double loss;
+  int state;
+  bool alerting;
+};
+
+void detector_init(struct detector *d, int nrecs);
+void detector_destroy(struct detector *d);
+
+/* A sample is taken in three steps so the caller can report between
+ * them. Next takes the oldest record out of the window and hands it
+ * back to be filled in. Mark says how that went, rc as returned by the
+ * stats callback, and returns DETECT_ flags. Commit takes the record
+ * into the window and returns the new link state if it changed */
+stat_record_t * detector_next(struct detector *d);
+int detector_mark(struct detector *d, stat_record_t *r, int rc);
+int detector_commit(struct detector *d, stat_record_t *r);
+
+/* All three at once, for replaying a trace. s is NULL for a sample that
+ * measured nothing */
+int detector_feed(struct detector *d, const stat_record_t *s);
+
+static inline bool detector_settled(
+    const struct detector *d)
+{
+  return d->sums.disconnects == 0;
+}
+#endif
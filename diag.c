@@ -0,0 +1,238 @@
+#include "common.h"
+#include "diag.h"
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+
+/* Batches TCP_INFO for every one of our connections into one netlink
+ * sock_diag dump per address family, rather than a getsockopt() per
+ * connection per sample. The kernel filters the dump down to our port,
+ * the results are kept in a table keyed on the socket cookie until they
+ * are older than maxage, so every stream sampled in the same tick shares
+ * the one dump */
+
+#define DIAG_TCPF_ESTABLISHED (1 << 1)
+#define DIAG_BUFSZ 65536
+
+struct diag_entry {
+  uint64_t cookie;
+  uint32_t gen;
+  struct tcp_info info;
+};
+
+struct diag {
+  int fd;
+  uint16_t port;
+  bool local;
+  double maxage;
+  double stamp;
+  bool warned;
+  bool overflowed;
+
+  uint32_t gen;
+  uint32_t mask;
+  struct diag_entry *table;
+  uint8_t *buf;
+};
+
+/* Port equality as a pair of range checks, every kernel knows these.
+ * Reaching the end of the program accepts, jumping past it rejects */
+struct diag_request {
+  struct nlmsghdr nlh;
+  struct inet_diag_req_v2 req;
+  struct rtattr rta;
+  struct inet_diag_bc_op ops[4];
+};
+
+
+
+static inline uint32_t diag_hash(
+    uint64_t cookie)
+{
+  cookie *= 0x9e3779b97f4a7c15ULL;
+  return cookie >> 32;
+}
+
+
+
+static void diag_store(
+    struct diag *d,
+    uint64_t cookie,
+    void *info,
+    size_t len)
+{
+  uint32_t i = diag_hash(cookie) & d->mask;
+  uint32_t n;
+  struct diag_entry *e;
+
+  for (n=0; n <= d->mask; n++, i = (i + 1) & d->mask) {
+    e = &d->table[i];
+    if (e->gen != d->gen || e->cookie == cookie) {
+      e->cookie = cookie;
+      e->gen = d->gen;
+      memset(&e->info, 0, sizeof(e->info));
+      memcpy(&e->info, info, MIN(len, sizeof(e->info)));
+      return;
+    }
+  }
+  /* Full, there are more connections on the port than were sized for.
+   * Streams left out fall back to asking their sockets */
+  if (!d->overflowed)
+    warnx("sock_diag table of %u is full, the connections left out ask their sockets instead", d->mask + 1);
+  d->overflowed = true;
+}
+
+
+
+static int diag_dump(
+    struct diag *d,
+    int family)
+{
+  struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+  struct diag_request rq;
+  struct nlmsghdr *nlh;
+  struct inet_diag_msg *msg;
+  struct rtattr *rta;
+  ssize_t rc;
+  int len;
+
+  memset(&rq, 0, sizeof(rq));
+  rq.nlh.nlmsg_len = sizeof(rq);
+  rq.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+  rq.nlh.nlmsg_flags = NLM_F_REQUEST|NLM_F_DUMP;
+  rq.req.sdiag_family = family;
+  rq.req.sdiag_protocol = IPPROTO_TCP;
+  rq.req.idiag_states = DIAG_TCPF_ESTABLISHED;
+  rq.req.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+  rq.rta.rta_type = INET_DIAG_REQ_BYTECODE;
+  rq.rta.rta_len = RTA_LENGTH(sizeof(rq.ops));
+  rq.ops[0].code = d->local ? INET_DIAG_BC_S_GE : INET_DIAG_BC_D_GE;
+  rq.ops[0].yes = 8;
+  rq.ops[0].no = sizeof(rq.ops) + 4;
+  rq.ops[1].no = d->port;
+  rq.ops[2].code = d->local ? INET_DIAG_BC_S_LE : INET_DIAG_BC_D_LE;
+  rq.ops[2].yes = 8;
+  rq.ops[2].no = sizeof(rq.ops) - 8 + 4;
+  rq.ops[3].no = d->port;
+
+  if (sendto(d->fd, &rq, sizeof(rq), 0, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+    return -1;
+
+  while (1) {
+    rc = recv(d->fd, d->buf, DIAG_BUFSZ, 0);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    for (nlh = (struct nlmsghdr *)d->buf; NLMSG_OK(nlh, rc); nlh = NLMSG_NEXT(nlh, rc)) {
+      if (nlh->nlmsg_type == NLMSG_DONE)
+        return 0;
+      if (nlh->nlmsg_type == NLMSG_ERROR) {
+        errno = -((struct nlmsgerr *)NLMSG_DATA(nlh))->error;
+        return -1;
+      }
+
+      msg = NLMSG_DATA(nlh);
+      len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+      for (rta = (struct rtattr *)(msg + 1); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == INET_DIAG_INFO)
+          diag_store(d, (uint64_t)msg->id.idiag_cookie[0] | (uint64_t)msg->id.idiag_cookie[1] << 32,
+                     RTA_DATA(rta), RTA_PAYLOAD(rta));
+      }
+    }
+  }
+}
+
+
+
+/* port is in host order. local matches it against the socket's own port,
+ * which is what accepted connections share, otherwise the peer's */
+struct diag * diag_new(
+    uint16_t port,
+    bool local,
+    int nconns,
+    double maxage)
+{
+  struct diag *d;
+  uint32_t size = 16;
+
+  d = calloc(1, sizeof(struct diag));
+  assert(d);
+
+  d->fd = socket(AF_NETLINK, SOCK_DGRAM|SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+  if (d->fd < 0)
+    err(EXIT_FAILURE, "Cannot open sock_diag netlink socket");
+
+  /* No fuller than half so probes stay short */
+  while (size < nconns * 2)
+    size <<= 1;
+
+  d->port = port;
+  d->local = local;
+  d->maxage = maxage;
+  d->stamp = -INFINITY;
+  d->gen = 1;
+  d->mask = size - 1;
+  d->table = calloc(size, sizeof(struct diag_entry));
+  d->buf = malloc(DIAG_BUFSZ);
+  assert(d->table && d->buf);
+
+  return d;
+}
+
+
+
+uint64_t diag_cookie(
+    int fd)
+{
+  uint64_t cookie = 0;
+  socklen_t len = sizeof(cookie);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_COOKIE, &cookie, &len) < 0)
+    return 0;
+  return cookie;
+}
+
+
+
+/* Fill info for the socket with this cookie from the latest dump, taking
+ * a new one first if it is stale. Returns -1 if the socket was not in
+ * it, connections younger than the dump are not */
+int diag_tcp_info(
+    struct diag *d,
+    double now,
+    uint64_t cookie,
+    struct tcp_info *info)
+{
+  uint32_t i, n;
+  struct diag_entry *e;
+
+  if (cookie == 0)
+    return -1;
+
+  if (now - d->stamp >= d->maxage) {
+    d->gen++;
+    d->stamp = now;
+    if (diag_dump(d, AF_INET) < 0 || diag_dump(d, AF_INET6) < 0) {
+      if (!d->warned)
+        warn("sock_diag dump failed, asking each socket instead");
+      d->warned = true;
+      return -1;
+    }
+  }
+
+  i = diag_hash(cookie) & d->mask;
+  for (n=0; n <= d->mask; n++, i = (i + 1) & d->mask) {
+    e = &d->table[i];
+    if (e->gen != d->gen)
+      return -1;
+    if (e->cookie == cookie) {
+      *info = e->info;
+      return 0;
+    }
+  }
+  return -1;
+}
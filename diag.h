@@ -0,0 +1,10 @@
+#ifndef _DIAG_H_
+#define _DIAG_H_
+#include "common.h"
+
+struct diag;
+
+struct diag * diag_new(uint16_t port, bool local, int nconns, double maxage);
+uint64_t diag_cookie(int fd);
+int diag_tcp_info(struct diag *d, double now, uint64_t cookie, struct tcp_info *info);
+#endif
@@ -0,0 +1,509 @@
+#include "common.h"
+#include "dial.h"
+#include "realtime.h"
+#include <pthread.h>
+
+/* A lookup finishes on a thread of the resolver's, which hands the dial
+ * back to its loop on a list the loop is woken to take */
+struct dial_loop {
+  struct ev_loop *loop;
+  ev_async wake;
+  pthread_mutex_t lock;
+  struct dial *done;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  int nloops;
+  struct dial_loop loops[MAX_THREADS];
+} dialers = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* getaddrinfo_a() starts its helper threads from the thread that asks,
+ * and they start the notify threads in turn, all inheriting the asker's
+ * scheduling and CPUs. A worker asking would put lookups on the pacer's
+ * CPU at realtime priority, so lookups are queued for a thread of our
+ * own off the data path to ask instead */
+static struct {
+  pthread_once_t once;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct dial *head;
+  struct dial *tail;
+} resolver = {
+  .once = PTHREAD_ONCE_INIT,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void dial_round(struct dial *d);
+
+
+/* On the resolver's thread */
+static void dial_notify(
+    union sigval sv)
+{
+  struct dial *d = sv.sival_ptr;
+  struct dial_loop *dl = d->dl;
+
+  pthread_mutex_lock(&dl->lock);
+  d->next_done = dl->done;
+  dl->done = d;
+  pthread_mutex_unlock(&dl->lock);
+  ev_async_send(dl->loop, &dl->wake);
+}
+
+
+
+static void dial_close_attempts(
+    struct dial *d)
+{
+  int i;
+
+  for (i=0; i < DIAL_MAX_ATTEMPTS; i++) {
+    if (d->attempts[i].fd < 0)
+      continue;
+    ev_io_stop(d->loop, &d->attempts[i].w);
+    close(d->attempts[i].fd);
+    d->attempts[i].fd = -1;
+  }
+  d->inflight = 0;
+  ev_timer_stop(d->loop, &d->stagger);
+  ev_timer_stop(d->loop, &d->timeout);
+}
+
+
+
+/* Waits out a jittered, exponentially growing delay before the next
+ * round, and looks the host up again for it */
+static void dial_retry(
+    struct dial *d)
+{
+  double delay = MIN(CONNECT_RETRY * (1 << MIN(d->failures, 16)), DIAL_BACKOFF_MAX);
+
+  dial_close_attempts(d);
+  d->stale = true;
+  d->failures++;
+  delay *= .5 + .5 * rand_r(&d->seed) / RAND_MAX;
+  ev_timer_set(&d->backoff, delay, 0.);
+  ev_timer_start(d->loop, &d->backoff);
+}
+
+
+
+static void dial_won(
+    struct dial *d,
+    int fd)
+{
+  dial_close_attempts(d);
+  d->failures = 0;
+  d->active = false;
+  d->cb(d, fd);
+}
+
+
+
+/* Starts the next address, when the one before has had the attempt
+ * delay or has failed. Addresses that fail at once are skipped over */
+static void dial_next(
+    struct dial *d)
+{
+  struct dial_attempt *a = NULL;
+  struct addrinfo *ai;
+  int i, fd;
+
+  ev_timer_stop(d->loop, &d->stagger);
+  for (i=0; i < DIAL_MAX_ATTEMPTS && !a; i++)
+    if (d->attempts[i].fd < 0)
+      a = &d->attempts[i];
+
+  while (a && d->next < d->naddrs) {
+    ai = d->addrs[d->next++];
+    fd = socket(ai->ai_family, ai->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    /* Datagram sockets, and the odd stream, connect at once */
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      dial_won(d, fd);
+      return;
+    }
+    if (errno != EINPROGRESS) {
+      close(fd);
+      continue;
+    }
+
+    a->fd = fd;
+    ev_io_set(&a->w, fd, EV_WRITE);
+    ev_io_start(d->loop, &a->w);
+    d->inflight++;
+    if (d->next < d->naddrs) {
+      ev_timer_set(&d->stagger, DIAL_ATTEMPT_DELAY, 0.);
+      ev_timer_start(d->loop, &d->stagger);
+    }
+    return;
+  }
+
+  if (d->inflight == 0 && d->next >= d->naddrs)
+    dial_retry(d);
+}
+
+
+
+static void dial_attempt_done(
+    EV_P_ ev_io *w,
+    int revents)
+{
+  struct dial_attempt *a = w->data;
+  struct dial *d = a->d;
+  socklen_t len = sizeof(int);
+  int eno = 0;
+  int fd = a->fd;
+
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &eno, &len) < 0)
+    eno = errno;
+  if (eno == EINPROGRESS)
+    return;
+
+  ev_io_stop(EV_A_ w);
+  a->fd = -1;
+  d->inflight--;
+  if (eno == 0) {
+    dial_won(d, fd);
+    return;
+  }
+  close(fd);
+  dial_next(d);
+}
+
+
+
+static void dial_stagger(
+    EV_P_ ev_timer *t,
+    int revents)
+{
+  dial_next(t->data);
+}
+
+
+
+static void dial_timeout(
+    EV_P_ ev_timer *t,
+    int revents)
+{
+  struct dial *d = t->data;
+
+  warnx("Connection to %s:%s timed out", d->host, d->port);
+  dial_retry(d);
+}
+
+
+
+static void dial_backoff(
+    EV_P_ ev_timer *t,
+    int revents)
+{
+  dial_round(t->data);
+}
+
+
+
+/* RFC 8305 order, alternating between the families starting with the
+ * one the resolver preferred */
+static void dial_addresses(
+    struct dial *d,
+    struct addrinfo *ai)
+{
+  struct addrinfo *a, *first = ai, *other = ai;
+  int n = 0;
+
+  for (a=ai; a; a=a->ai_next)
+    n++;
+  if (d->ai)
+    freeaddrinfo(d->ai);
+  d->ai = ai;
+  d->addrs = realloc(d->addrs, sizeof(struct addrinfo *) * MAX(n, 1));
+  assert(d->addrs);
+  d->naddrs = 0;
+
+  while (first || other) {
+    while (first && first->ai_family != ai->ai_family)
+      first = first->ai_next;
+    while (other && other->ai_family == ai->ai_family)
+      other = other->ai_next;
+    if (first) {
+      d->addrs[d->naddrs++] = first;
+      first = first->ai_next;
+    }
+    if (other) {
+      d->addrs[d->naddrs++] = other;
+      other = other->ai_next;
+    }
+  }
+}
+
+
+
+static void dial_race(
+    struct dial *d)
+{
+  d->next = 0;
+  ev_timer_set(&d->timeout, CONNECT_TIMEOUT, 0.);
+  ev_timer_start(d->loop, &d->timeout);
+  dial_next(d);
+}
+
+
+
+static void dial_lookup_done(
+    struct dial *d)
+{
+  int rc = d->lookup_rc ? d->lookup_rc : gai_error(&d->gai);
+
+  d->resolving = false;
+  if (!d->active) {
+    if (rc == 0)
+      freeaddrinfo(d->gai.ar_result);
+    return;
+  }
+
+  if (rc) {
+    warnx("Couldn't resolve %s: %s", d->host, gai_strerror(rc));
+    d->cb(d, -1);
+    if (d->active)
+      dial_retry(d);
+    return;
+  }
+
+  dial_addresses(d, d->gai.ar_result);
+  d->resolved_at = ev_now(d->loop);
+  d->stale = false;
+  dial_race(d);
+}
+
+
+
+static void dial_resolved(
+    EV_P_ ev_async *w,
+    int revents)
+{
+  struct dial_loop *dl = w->data;
+  struct dial *d, *next;
+
+  pthread_mutex_lock(&dl->lock);
+  d = dl->done;
+  dl->done = NULL;
+  pthread_mutex_unlock(&dl->lock);
+
+  for (; d; d = next) {
+    next = d->next_done;
+    dial_lookup_done(d);
+  }
+}
+
+
+
+/* On the resolver's thread. A lookup that cannot even be asked for goes
+ * straight back to its loop as failed */
+static void * dial_resolver(
+    void *data)
+{
+  struct gaicb *list[1];
+  struct sigevent sev;
+  struct dial *d;
+  int rc;
+
+  realtime_background();
+  while (1) {
+    pthread_mutex_lock(&resolver.lock);
+    while (!resolver.head)
+      pthread_cond_wait(&resolver.cond, &resolver.lock);
+    d = resolver.head;
+    resolver.head = d->next_lookup;
+    if (!resolver.head)
+      resolver.tail = NULL;
+    pthread_mutex_unlock(&resolver.lock);
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_notify_function = dial_notify;
+    sev.sigev_value.sival_ptr = d;
+    list[0] = &d->gai;
+    rc = getaddrinfo_a(GAI_NOWAIT, list, 1, &sev);
+    if (rc) {
+      d->lookup_rc = rc;
+      dial_notify(sev.sigev_value);
+    }
+  }
+  return NULL;
+}
+
+
+
+static void dial_resolver_start(
+    void)
+{
+  int rc = pthread_create(&resolver.thread, NULL, dial_resolver, NULL);
+
+  if (rc) {
+    errno = rc;
+    err(EXIT_FAILURE, "pthread_create");
+  }
+}
+
+
+
+static void dial_lookup(
+    struct dial *d)
+{
+  pthread_once(&resolver.once, dial_resolver_start);
+
+  memset(&d->gai, 0, sizeof(d->gai));
+  d->gai.ar_name = d->host;
+  d->gai.ar_service = d->port;
+  d->gai.ar_request = &d->hints;
+  d->lookup_rc = 0;
+  d->next_lookup = NULL;
+  d->resolving = true;
+
+  pthread_mutex_lock(&resolver.lock);
+  if (resolver.tail)
+    resolver.tail->next_lookup = d;
+  else
+    resolver.head = d;
+  resolver.tail = d;
+  pthread_cond_signal(&resolver.cond);
+  pthread_mutex_unlock(&resolver.lock);
+}
+
+
+
+/* Takes the dial off the resolver's queue if it has not been asked for
+ * yet, true if it was there */
+static bool dial_unqueue(
+    struct dial *d)
+{
+  struct dial **p, *prev = NULL;
+  bool found = false;
+
+  pthread_mutex_lock(&resolver.lock);
+  for (p = &resolver.head; *p; prev = *p, p = &(*p)->next_lookup) {
+    if (*p != d)
+      continue;
+    *p = d->next_lookup;
+    if (resolver.tail == d)
+      resolver.tail = prev;
+    found = true;
+    break;
+  }
+  pthread_mutex_unlock(&resolver.lock);
+  return found;
+}
+
+
+
+/* With a lookup still out the round starts when it is back */
+static void dial_round(
+    struct dial *d)
+{
+  if (d->resolving)
+    return;
+  if (d->stale || d->naddrs == 0 || ev_now(d->loop) - d->resolved_at > DIAL_RESOLVE_TTL)
+    dial_lookup(d);
+  else
+    dial_race(d);
+}
+
+
+
+/* One wakeup per loop, shared by every dial on it */
+static struct dial_loop * dial_loop(
+    struct ev_loop *loop)
+{
+  struct dial_loop *dl = NULL;
+  int i;
+
+  pthread_mutex_lock(&dialers.lock);
+  for (i=0; i < dialers.nloops; i++)
+    if (dialers.loops[i].loop == loop)
+      dl = &dialers.loops[i];
+
+  if (!dl) {
+    if (dialers.nloops == MAX_THREADS)
+      errx(EXIT_FAILURE, "Too many loops dialling");
+    dl = &dialers.loops[dialers.nloops++];
+    dl->loop = loop;
+    pthread_mutex_init(&dl->lock, NULL);
+    ev_async_init(&dl->wake, dial_resolved);
+    dl->wake.data = dl;
+    ev_async_start(loop, &dl->wake);
+  }
+  pthread_mutex_unlock(&dialers.lock);
+  return dl;
+}
+
+
+
+/* Before the loop runs */
+void dial_init(
+    struct dial *d,
+    struct ev_loop *loop,
+    const char *host,
+    const char *port,
+    int type,
+    void (*cb)(struct dial *, int),
+    void *data)
+{
+  int i;
+
+  memset(d, 0, sizeof(*d));
+  d->loop = loop;
+  d->host = host;
+  d->port = port;
+  d->type = type;
+  d->cb = cb;
+  d->data = data;
+  d->dl = dial_loop(loop);
+  d->seed = (uintptr_t)d ^ time(NULL);
+
+  d->hints.ai_family = AF_UNSPEC;
+  d->hints.ai_socktype = type;
+
+  for (i=0; i < DIAL_MAX_ATTEMPTS; i++) {
+    d->attempts[i].d = d;
+    d->attempts[i].fd = -1;
+    ev_init(&d->attempts[i].w, dial_attempt_done);
+    d->attempts[i].w.data = &d->attempts[i];
+  }
+  ev_init(&d->stagger, dial_stagger);
+  ev_init(&d->timeout, dial_timeout);
+  ev_init(&d->backoff, dial_backoff);
+  d->stagger.data = d->timeout.data = d->backoff.data = d;
+}
+
+
+
+void dial_start(
+    struct dial *d)
+{
+  d->active = true;
+  dial_round(d);
+}
+
+
+
+/* A lookup that cannot be called back is left to come back to a dial
+ * that is no longer listening */
+void dial_cancel(
+    struct dial *d)
+{
+  if (!d->loop)
+    return;
+  d->active = false;
+  dial_close_attempts(d);
+  ev_timer_stop(d->loop, &d->backoff);
+  if (d->resolving && (dial_unqueue(d) || gai_cancel(&d->gai) == EAI_CANCELED))
+    d->resolving = false;
+}
@@ -0,0 +1,68 @@
+#ifndef _DIAL_H_
+#define _DIAL_H_
+#include "common.h"
+
+/* RFC 8305, how long an attempt has before the next address is raced
+ * against it, and how many race at once */
+#define DIAL_ATTEMPT_DELAY 0.25
+#define DIAL_MAX_ATTEMPTS 4
+/* Addresses are looked up again when this old, or after a failed round */
+#define DIAL_RESOLVE_TTL 60.
+/* Rounds back off exponentially from CONNECT_RETRY up to this */
+#define DIAL_BACKOFF_MAX 10.
+
+struct dial;
+struct dial_loop;
+
+struct dial_attempt {
+  struct dial *d;
+  int fd;
+  ev_io w;
+};
+
+/* Connects to a host over whichever of its addresses answers first,
+ * IPv6 and IPv4 alike, and keeps trying until one does. The lookup runs
+ * on a thread of the resolver's, everything else on the loop */
+struct dial {
+  struct ev_loop *loop;
+  const char *host;
+  const char *port;
+  int type;
+  void (*cb)(struct dial *d, int fd);
+  void *data;
+  bool active;
+
+  /* The lookup, and the addresses it gave in the order to try them */
+  struct dial_loop *dl;
+  struct dial *next_lookup;
+  struct dial *next_done;
+  struct addrinfo hints;
+  struct gaicb gai;
+  int lookup_rc;
+  bool resolving;
+  bool stale;
+  double resolved_at;
+  struct addrinfo *ai;
+  struct addrinfo **addrs;
+  int naddrs;
+
+  /* The round under way */
+  int next;
+  int inflight;
+  struct dial_attempt attempts[DIAL_MAX_ATTEMPTS];
+  ev_timer stagger;
+  ev_timer timeout;
+
+  /* Rounds failed in a row, for the backoff */
+  int failures;
+  unsigned int seed;
+  ev_timer backoff;
+};
+
+/* The callback is handed the connected socket, or -1 when the lookup
+ * failed, after which the dial carries on unless cancelled */
+void dial_init(struct dial *d, struct ev_loop *loop, const char *host, const char *port, int type,
+               void (*cb)(struct dial *d, int fd), void *data);
+void dial_start(struct dial *d);
+void dial_cancel(struct dial *d);
+#endif
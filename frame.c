@@ -0,0 +1,189 @@
+#include "common.h"
+#include "frame.h"
+#include "payload.h"
+#include <endian.h>
+#include <inttypes.h>
+#include <sys/uio.h>
+
+/* Framed payloads. Every write_size bytes of the stream starts with a
+ * header carrying a sequence number and the CLOCK_REALTIME it was sent,
+ * the rest is the shared payload. The receiver gets one-way delay and
+ * jitter from it, which needs the two clocks to agree (NTP or PTP) */
+
+void frame_tx_reset(
+    struct frame_tx *f)
+{
+  memset(f, 0, sizeof(*f));
+}
+
+
+
+/* Send up to len bytes without crossing into the next frame. A frame
+ * left half written is carried on by the next call, it is only stamped
+ * when its first byte goes out */
+ssize_t frame_send(
+    int fd,
+    struct frame_tx *f,
+    size_t framesz,
+    size_t len)
+{
+  struct iovec iov[2];
+  struct msghdr msg;
+  size_t hdrsz = sizeof(f->hdr);
+  size_t body;
+  ssize_t rc;
+  int n = 0;
+
+  if (f->off == 0) {
+    f->hdr.magic = htobe32(FRAME_MAGIC);
+    f->hdr.len = htobe32(framesz);
+    f->hdr.seq = htobe64(f->seq);
+    f->hdr.sent_ns = htobe64(realtime_ns());
+  }
+
+  len = MIN(len, framesz - f->off);
+  if (f->off < hdrsz) {
+    iov[n].iov_base = (uint8_t *)&f->hdr + f->off;
+    iov[n].iov_len = MIN(len, hdrsz - f->off);
+    len -= iov[n].iov_len;
+    n++;
+  }
+  if (len > 0) {
+    body = f->off > hdrsz ? f->off - hdrsz : 0;
+    iov[n].iov_base = (uint8_t *)payload_get() + body;
+    iov[n].iov_len = len;
+    n++;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  if (rc <= 0)
+    return rc;
+
+  f->off += rc;
+  if (f->off == framesz) {
+    f->off = 0;
+    f->seq++;
+  }
+  return rc;
+}
+
+
+
+void frame_delay_reset(
+    struct frame_delay *d,
+    struct hist *delays)
+{
+  memset(d, 0, sizeof(*d));
+  d->delays = delays;
+  d->last_transit = INT64_MIN;
+}
+
+
+
+void frame_delay_arrived(
+    struct frame_delay *d,
+    int64_t sent_ns,
+    int64_t now)
+{
+  int64_t transit = now - sent_ns;
+  int64_t diff;
+
+  if (d->last_transit != INT64_MIN) {
+    diff = transit - d->last_transit;
+    d->jitter += ((diff < 0 ? -diff : diff) - d->jitter) / 16.;
+  }
+  d->last_transit = transit;
+  d->delay_total += transit;
+  /* Clocks out of step can make the delay negative, count it as none */
+  if (d->delays)
+    hist_record_shared(d->delays, transit > 0 ? MIN(transit / 1000, UINT32_MAX) : 0);
+  d->frames++;
+}
+
+
+
+/* Mean delay since the last call, or the last mean if nothing arrived,
+ * and the current jitter */
+void frame_delay_sample(
+    struct frame_delay *d,
+    double *delay_us,
+    double *jitter_us)
+{
+  if (d->frames)
+    d->delay_us = d->delay_total / d->frames / 1000.;
+  *delay_us = d->delay_us;
+  *jitter_us = d->jitter / 1000.;
+  d->frames = 0;
+  d->delay_total = 0.;
+}
+
+
+
+void frame_rx_reset(
+    struct frame_rx *f,
+    struct hist *delays)
+{
+  memset(f, 0, sizeof(*f));
+  frame_delay_reset(&f->delay, delays);
+}
+
+
+
+static void frame_arrived(
+    struct frame_rx *f,
+    int64_t now)
+{
+  uint64_t seq = be64toh(f->hdr.seq);
+
+  /* TCP never loses or reorders, a gap means the sender is broken */
+  if (seq != f->next_seq && f->seq_errors++ == 0)
+    warnx("Frame %" PRIu64 " arrived when %" PRIu64 " was expected", seq, f->next_seq);
+  f->next_seq = seq + 1;
+  frame_delay_arrived(&f->delay, be64toh(f->hdr.sent_ns), now);
+}
+
+
+
+/* Walk the frames in what was just read. Only headers are looked at, the
+ * bodies are stepped over, and one clock read covers the whole buffer */
+void frame_parse(
+    struct frame_rx *f,
+    const uint8_t *buf,
+    size_t len)
+{
+  size_t hdrsz = sizeof(f->hdr);
+  size_t n;
+  int64_t now = 0;
+
+  while (len > 0 && !f->lost_sync) {
+    if (f->off < hdrsz) {
+      n = MIN(len, hdrsz - f->off);
+      memcpy((uint8_t *)&f->hdr + f->off, buf, n);
+      f->off += n;
+      buf += n;
+      len -= n;
+      if (f->off < hdrsz)
+        break;
+
+      f->len = be32toh(f->hdr.len);
+      if (be32toh(f->hdr.magic) != FRAME_MAGIC || f->len < hdrsz || f->len > MAX_WRITE_SZ) {
+        warnx("Received data is not framed, is the other end running with --framed?");
+        f->lost_sync = true;
+        break;
+      }
+      if (!now)
+        now = realtime_ns();
+      frame_arrived(f, now);
+    }
+
+    n = MIN(len, f->len - f->off);
+    f->off += n;
+    buf += n;
+    len -= n;
+    if (f->off == f->len)
+      f->off = 0;
+  }
+}
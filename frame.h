@@ -0,0 +1,57 @@
+#ifndef _FRAME_H_
+#define _FRAME_H_
+#include "common.h"
+#include "hist.h"
+
+#define FRAME_MAGIC 0x54584652
+
+/* Leads every frame, big endian on the wire */
+struct frame_hdr {
+  uint32_t magic;
+  uint32_t len;
+  uint64_t seq;
+  int64_t sent_ns;
+};
+
+struct frame_tx {
+  uint64_t seq;
+  size_t off;
+  struct frame_hdr hdr;
+};
+
+/* One-way delay and jitter from the send stamps of what arrives, TCP
+ * frames and datagrams alike */
+struct frame_delay {
+  /* Every frame's delay in microseconds, if set */
+  struct hist *delays;
+
+  /* RFC 3550 interarrival jitter, in nanoseconds */
+  double jitter;
+  int64_t last_transit;
+
+  /* Since the last frame_delay_sample() */
+  uint64_t frames;
+  double delay_total;
+  double delay_us;
+};
+
+struct frame_rx {
+  size_t off;
+  size_t len;
+  struct frame_hdr hdr;
+  uint64_t next_seq;
+  bool lost_sync;
+  uint64_t seq_errors;
+  struct frame_delay delay;
+};
+
+void frame_tx_reset(struct frame_tx *f);
+ssize_t frame_send(int fd, struct frame_tx *f, size_t framesz, size_t len);
+
+void frame_delay_reset(struct frame_delay *d, struct hist *delays);
+void frame_delay_arrived(struct frame_delay *d, int64_t sent_ns, int64_t now);
+void frame_delay_sample(struct frame_delay *d, double *delay_us, double *jitter_us);
+
+void frame_rx_reset(struct frame_rx *f, struct hist *delays);
+void frame_parse(struct frame_rx *f, const uint8_t *buf, size_t len);
+#endif
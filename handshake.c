@@ -0,0 +1,361 @@
+#include "common.h"
+#include "handshake.h"
+
+/* Every handshake is a socket of its own, closed with a reset as soon as
+ * it is up so thousands a second leave nothing behind in TIME_WAIT */
+
+struct handshake {
+  struct handshaker *h;
+  int fd;
+  int64_t started;
+  ev_io w;
+};
+
+struct handshaker {
+  struct ev_loop *loop;
+  struct sockaddr_storage peer;
+  socklen_t peerlen;
+  bool fastopen;
+  struct hist *hist;
+
+  /* Enough slots for a timeout's worth of handshakes, the free ones on a
+   * stack */
+  int nslots;
+  struct handshake *slots;
+  int *free;
+  int nfree;
+
+  struct handshake_counts counts;
+};
+
+static const char request[HANDSHAKE_REQUEST_SZ];
+
+
+static void handshake_close(
+    struct handshake *hs)
+{
+  struct handshaker *h = hs->h;
+
+  ev_io_stop(h->loop, &hs->w);
+  close(hs->fd);
+  hs->fd = -1;
+  h->free[h->nfree++] = hs - h->slots;
+}
+
+
+
+static void handshake_done(
+    struct handshake *hs,
+    int64_t now)
+{
+  struct handshaker *h = hs->h;
+  struct tcp_info tcpi;
+  socklen_t len = sizeof(tcpi);
+  int64_t took = now - hs->started;
+
+  h->counts.connects++;
+  h->counts.latency_ns += took;
+  if (h->hist)
+    hist_record_shared(h->hist, MIN(took / 1000, UINT32_MAX));
+
+  memset(&tcpi, 0, sizeof(tcpi));
+  if (h->fastopen && getsockopt(hs->fd, IPPROTO_TCP, TCP_INFO, &tcpi, &len) == 0 &&
+      tcpi.tcpi_options & TCPI_OPT_SYN_DATA)
+    h->counts.fastopens++;
+  handshake_close(hs);
+}
+
+
+
+static void handshake_ready(
+    EV_P_ ev_io *w,
+    int revents)
+{
+  struct handshake *hs = w->data;
+  socklen_t len = sizeof(int);
+  int eno = 0;
+
+  if (getsockopt(hs->fd, SOL_SOCKET, SO_ERROR, &eno, &len) < 0)
+    eno = errno;
+  if (eno == EINPROGRESS)
+    return;
+
+  if (eno) {
+    hs->h->counts.failures++;
+    handshake_close(hs);
+    return;
+  }
+  handshake_done(hs, monotonic_ns());
+}
+
+
+
+/* With fast open and a cookie for the peer connect() sends nothing, the
+ * SYN goes with the first write and carries it */
+static int handshake_start(
+    struct handshaker *h,
+    struct handshake *hs)
+{
+  struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+  int rc;
+
+  hs->fd = socket(h->peer.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  if (hs->fd < 0)
+    return -1;
+  setsockopt(hs->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+  if (h->fastopen && setsockopt(hs->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &(int){1}, sizeof(int)) < 0) {
+    warn("Cannot enable TCP_FASTOPEN_CONNECT, opening without it");
+    h->fastopen = false;
+  }
+
+  hs->started = monotonic_ns();
+  rc = connect(hs->fd, (struct sockaddr *)&h->peer, h->peerlen);
+  if (rc == 0 && h->fastopen)
+    rc = send(hs->fd, request, sizeof(request), MSG_NOSIGNAL) < 0 ? -1 : 1;
+  if (rc < 0 && errno != EINPROGRESS)
+    return -1;
+  if (rc == 0) {
+    handshake_done(hs, monotonic_ns());
+    return 0;
+  }
+
+  ev_io_set(&hs->w, hs->fd, EV_WRITE);
+  ev_io_start(h->loop, &hs->w);
+  return 0;
+}
+
+
+
+struct handshaker * handshaker_new(
+    struct ev_loop *loop,
+    const struct sockaddr *peer,
+    socklen_t len,
+    double rate,
+    bool fastopen,
+    struct hist *hist)
+{
+  struct handshaker *h;
+  int i;
+
+  assert(len <= sizeof(h->peer));
+  h = calloc(1, sizeof(struct handshaker));
+  assert(h);
+  h->loop = loop;
+  memcpy(&h->peer, peer, len);
+  h->peerlen = len;
+  h->fastopen = fastopen;
+  h->hist = hist;
+
+  h->nslots = ceil(rate * HANDSHAKE_TIMEOUT) + 16;
+  h->slots = calloc(h->nslots, sizeof(struct handshake));
+  h->free = calloc(h->nslots, sizeof(int));
+  assert(h->slots && h->free);
+  for (i=0; i < h->nslots; i++) {
+    h->slots[i].h = h;
+    h->slots[i].fd = -1;
+    ev_init(&h->slots[i].w, handshake_ready);
+    h->slots[i].w.data = &h->slots[i];
+    h->free[h->nfree++] = h->nslots - 1 - i;
+  }
+  return h;
+}
+
+
+
+void handshaker_free(
+    struct handshaker *h)
+{
+  int i;
+
+  if (!h)
+    return;
+  for (i=0; i < h->nslots; i++)
+    if (h->slots[i].fd > -1)
+      handshake_close(&h->slots[i]);
+  free(h->slots);
+  free(h->free);
+  free(h);
+}
+
+
+
+/* A socket that cannot be had or a connect that fails outright is a
+ * failed handshake like any other */
+uint32_t handshaker_open(
+    struct handshaker *h,
+    uint32_t n)
+{
+  struct handshake *hs;
+
+  for (; n > 0 && h->nfree > 0; n--) {
+    hs = &h->slots[h->free[--h->nfree]];
+    if (handshake_start(h, hs) == 0)
+      continue;
+    h->counts.failures++;
+    if (hs->fd > -1)
+      close(hs->fd);
+    hs->fd = -1;
+    h->free[h->nfree++] = hs - h->slots;
+  }
+  return n;
+}
+
+
+
+void handshaker_sample(
+    struct handshaker *h,
+    struct handshake_counts *counts)
+{
+  int64_t now = monotonic_ns();
+  int64_t timeout = HANDSHAKE_TIMEOUT * BILLION;
+  int i;
+
+  for (i=0; i < h->nslots; i++) {
+    if (h->slots[i].fd < 0 || now - h->slots[i].started < timeout)
+      continue;
+    h->counts.failures++;
+    handshake_close(&h->slots[i]);
+  }
+
+  *counts = h->counts;
+  memset(&h->counts, 0, sizeof(h->counts));
+}
+
+
+
+struct handshake_hold {
+  struct ev_loop *loop;
+  int sfd;
+  ev_io w;
+  ev_timer t;
+
+  /* Oldest first, the ring doubles when it fills */
+  uint32_t mask;
+  uint32_t head;
+  uint32_t tail;
+  int *fds;
+  double *at;
+
+  /* Out of descriptors, accepting waits for some to be released */
+  bool paused;
+  double warned_at;
+};
+
+
+
+static void hold_release(
+    struct handshake_hold *hh,
+    double now)
+{
+  while (hh->head != hh->tail && now - hh->at[hh->head & hh->mask] >= HANDSHAKE_TIMEOUT) {
+    close(hh->fds[hh->head & hh->mask]);
+    hh->head++;
+  }
+}
+
+
+
+static void hold_grow(
+    struct handshake_hold *hh)
+{
+  uint32_t n = (hh->mask + 1) * 2;
+  int *fds = calloc(n, sizeof(int));
+  double *at = calloc(n, sizeof(double));
+  uint32_t i, len = hh->tail - hh->head;
+
+  assert(fds && at);
+  for (i=0; i < len; i++) {
+    fds[i] = hh->fds[(hh->head + i) & hh->mask];
+    at[i] = hh->at[(hh->head + i) & hh->mask];
+  }
+  free(hh->fds);
+  free(hh->at);
+  hh->fds = fds;
+  hh->at = at;
+  hh->mask = n - 1;
+  hh->head = 0;
+  hh->tail = len;
+}
+
+
+
+static void hold_accept(
+    EV_P_ ev_io *w,
+    int revents)
+{
+  struct handshake_hold *hh = w->data;
+  double now = ev_now(EV_A);
+  int fd, i;
+
+  hold_release(hh, now);
+  for (i=0; i < HANDSHAKE_ACCEPT_BATCH; i++) {
+    fd = accept4(hh->sfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0 && errno == ECONNABORTED)
+      continue;
+    /* The connection stays queued and the socket readable, stop
+     * watching it until some of what is held has been released */
+    if (fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+      if (now - hh->warned_at >= HANDSHAKE_WARN_EVERY) {
+        warn("Cannot accept new connections with %u held, pausing", hh->tail - hh->head);
+        hh->warned_at = now;
+      }
+      ev_io_stop(EV_A_ w);
+      hh->paused = true;
+      return;
+    }
+    if (fd < 0) {
+      if (errno != EAGAIN)
+        warn("Cannot accept new connection");
+      return;
+    }
+
+    if (hh->tail - hh->head > hh->mask)
+      hold_grow(hh);
+    hh->fds[hh->tail & hh->mask] = fd;
+    hh->at[hh->tail & hh->mask] = now;
+    hh->tail++;
+  }
+}
+
+
+
+/* Accepting starts again once descriptors have been released, or there
+ * are none of ours left to release */
+static void hold_timer(
+    EV_P_ ev_timer *t,
+    int revents)
+{
+  struct handshake_hold *hh = t->data;
+  uint32_t head = hh->head;
+
+  hold_release(hh, ev_now(EV_A));
+  if (hh->paused && (hh->head != head || hh->head == hh->tail)) {
+    hh->paused = false;
+    ev_io_start(EV_A_ &hh->w);
+  }
+}
+
+
+
+struct handshake_hold * handshake_hold_new(
+    struct ev_loop *loop,
+    int sfd)
+{
+  struct handshake_hold *hh = calloc(1, sizeof(struct handshake_hold));
+
+  assert(hh);
+  hh->loop = loop;
+  hh->sfd = sfd;
+  hh->mask = 1023;
+  hh->warned_at = -INFINITY;
+  hh->fds = calloc(hh->mask + 1, sizeof(int));
+  hh->at = calloc(hh->mask + 1, sizeof(double));
+  assert(hh->fds && hh->at);
+
+  ev_io_init(&hh->w, hold_accept, sfd, EV_READ);
+  ev_timer_init(&hh->t, hold_timer, HANDSHAKE_TIMEOUT / 4, HANDSHAKE_TIMEOUT / 4);
+  hh->w.data = hh->t.data = hh;
+  ev_io_start(loop, &hh->w);
+  ev_timer_start(loop, &hh->t);
+  return hh;
+}
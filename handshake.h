@@ -0,0 +1,43 @@
+#ifndef _HANDSHAKE_H_
+#define _HANDSHAKE_H_
+#include "common.h"
+#include "hist.h"
+
+/* A handshake still going after this long has failed */
+#define HANDSHAKE_TIMEOUT 1.0
+/* What rides in the SYN with fast open */
+#define HANDSHAKE_REQUEST_SZ 64
+/* Connections a listener takes per wakeup */
+#define HANDSHAKE_ACCEPT_BATCH 64
+/* A listener out of descriptors says so no more often than this */
+#define HANDSHAKE_WARN_EVERY 10.
+
+/* What became of the handshakes since the last sample. Fast opens are
+ * the ones whose SYN carried data the peer took */
+struct handshake_counts {
+  uint32_t connects;
+  uint32_t failures;
+  uint32_t fastopens;
+  uint64_t latency_ns;
+};
+
+/* Opens short lived connections to one address, times each from connect()
+ * to established and closes it at once. Everything runs on the loop */
+struct handshaker;
+
+struct handshaker * handshaker_new(struct ev_loop *loop, const struct sockaddr *peer, socklen_t len,
+                                   double rate, bool fastopen, struct hist *hist);
+void handshaker_free(struct handshaker *h);
+/* Starts n handshakes, returning how many there was no room for */
+uint32_t handshaker_open(struct handshaker *h, uint32_t n);
+/* Fails what has timed out and takes the counts, which start again */
+void handshaker_sample(struct handshaker *h, struct handshake_counts *counts);
+
+/* The listener's side. What it accepts is held for a handshake timeout
+ * before it is closed, so the connector, which resets its end as soon as
+ * it is up, always closes first and never has a handshake reset under it
+ * by the listener. Accepts on sfd from then on */
+struct handshake_hold;
+
+struct handshake_hold * handshake_hold_new(struct ev_loop *loop, int sfd);
+#endif
@@ -0,0 +1,138 @@
+#include "common.h"
+#include "hist.h"
+
+static inline int hist_index(
+    int bits,
+    uint32_t v)
+{
+  int e;
+
+  if (v < (1U << bits))
+    return v;
+
+  /* Keep the top bits, the shift picks the power of two */
+  e = 32 - __builtin_clz(v) - bits;
+  return e * (1 << (bits - 1)) + (v >> e);
+}
+
+/* Highest value that lands in bucket i */
+static inline double hist_value(
+    int bits,
+    int i)
+{
+  int half = 1 << (bits - 1);
+  int e;
+
+  if (i < (1 << bits))
+    return i;
+
+  e = i / half - 1;
+  return (double)(((uint64_t)(i - e * half) << e) + ((1ULL << e) - 1));
+}
+
+
+
+struct hist * hist_new(
+    int bits)
+{
+  struct hist *h;
+
+  assert(bits >= 2 && bits <= HIST_SUB_BITS);
+  h = malloc(sizeof(struct hist) + HIST_BUCKETS(bits) * sizeof(uint64_t));
+  assert(h);
+  h->bits = bits;
+  h->size = HIST_BUCKETS(bits);
+  hist_reset(h);
+  return h;
+}
+
+
+
+void hist_reset(
+    struct hist *h)
+{
+  h->count = 0;
+  h->max = 0;
+  memset(h->buckets, 0, HIST_BUCKETS(h->bits) * sizeof(uint64_t));
+}
+
+
+
+/* Called on the hot path, no allocation and no loops */
+void hist_record(
+    struct hist *h,
+    uint32_t value)
+{
+  h->buckets[hist_index(h->bits, value)]++;
+  h->count++;
+  if (value > h->max)
+    h->max = value;
+}
+
+
+
+/* Two atomic adds at most, the max is only contended by a take */
+void hist_record_shared(
+    struct hist *h,
+    uint32_t value)
+{
+  uint32_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+  __atomic_add_fetch(&h->buckets[hist_index(h->bits, value)], 1, __ATOMIC_RELAXED);
+  while (value > max &&
+         !__atomic_compare_exchange_n(&h->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+
+/* Moves everything recorded in src into dst, which is reset first, so
+ * src starts afresh. Each value goes to one take or the next, never
+ * both and never neither */
+void hist_take(
+    struct hist *dst,
+    struct hist *src)
+{
+  uint64_t n;
+  int i;
+
+  assert(HIST_BUCKETS(src->bits) <= dst->size);
+  dst->bits = src->bits;
+  hist_reset(dst);
+  for (i=0; i < HIST_BUCKETS(src->bits); i++) {
+    if (__atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED) == 0)
+      continue;
+    n = __atomic_exchange_n(&src->buckets[i], 0, __ATOMIC_RELAXED);
+    dst->buckets[i] = n;
+    dst->count += n;
+  }
+  dst->max = __atomic_exchange_n(&src->max, 0, __ATOMIC_RELAXED);
+}
+
+
+
+/* Fill out[] with the values at each of the ascending quantiles q[] in
+ * one pass over the buckets. Reported values are clamped to the largest
+ * seen so the top percentile never exceeds max */
+void hist_percentiles(
+    const struct hist *h,
+    const double *q,
+    double *out,
+    int n)
+{
+  uint64_t seen = 0;
+  uint64_t want;
+  int i, j = 0;
+
+  for (i=0; i < HIST_BUCKETS(h->bits) && j < n; i++) {
+    seen += h->buckets[i];
+    while (j < n && h->count) {
+      want = (uint64_t)ceil(q[j] * h->count);
+      if (seen < MAX(want, 1))
+        break;
+      out[j++] = MIN(hist_value(h->bits, i), h->max);
+    }
+  }
+
+  for (; j < n; j++)
+    out[j] = h->count ? h->max : 0.;
+}
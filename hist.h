@@ -0,0 +1,33 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+#include "common.h"
+
+/* Log-linear buckets in the style of HdrHistogram. Values below
+ * 2^bits are counted exactly, above that each power of two is split into
+ * 2^(bits-1) buckets, so a value is never off by more than 1/2^(bits-1)
+ * and every uint32_t fits in a fixed array. HIST_SUB_BITS keeps within
+ * 1/64th (1.6%), HIST_COARSE_BITS within 1/16th with the buckets of the
+ * rollup tiers, for streams too many and too slow to need more */
+#define HIST_SUB_BITS 7
+#define HIST_COARSE_BITS 5
+#define HIST_BUCKETS(bits) ((32 - (bits) + 2) * (1 << ((bits) - 1)))
+
+struct hist {
+  uint64_t count;
+  uint32_t max;
+  int bits;
+  int size;
+  uint64_t buckets[];
+};
+
+struct hist * hist_new(int bits);
+void hist_reset(struct hist *h);
+void hist_record(struct hist *h, uint32_t value);
+/* For a histogram one thread records into while another takes what has
+ * been recorded so far. Only the buckets and max are kept, count comes
+ * with the taking */
+void hist_record_shared(struct hist *h, uint32_t value);
+/* dst takes on src's precision, it must have been made at least as fine */
+void hist_take(struct hist *dst, struct hist *src);
+void hist_percentiles(const struct hist *h, const double *q, double *out, int n);
+#endif
@@ -1,9 +1,12 @@
 #include "common.h"
 #include "config.h"
 #include "rate.h"
+#include "worker.h"
+#include "recorder.h"
+#include "realtime.h"
+#include "stats.h"
 
 bool running = true;
-struct ev_loop * loop;
 
 struct statistics *stats;
 
@@ -81,20 +84,26 @@ int main(
     char **argv) 
 {
   ev_timer t;
+  struct configuration *c;
 
   if (!ev_default_loop(0))
     errx(EXIT_FAILURE, "could not initialise libev, bad $LIBEV_FLAGS in environment?");
 
   config_parse(argc, argv);
-  struct configuration *config = config_get();
-
-  stats_init(config->rate_per_second, rate_update_stats);
-
-  if (config->listener)
-    rate_listener();
-  else {
-    rate_connector();
-  }
+  c = config_get();
+
+  /* Send failures are handled where they happen, sendfile() cannot be
+   * told MSG_NOSIGNAL */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* Before anything is mapped or any thread started, so all of it is
+   * locked and every thread inherits the main thread's settings */
+  realtime_init();
+  if (c->record_path)
+    recorder_init(c->record_path, c->record_size);
+  stats_init();
+  rate_init();
+  worker_start();
 
   ev_run(EV_DEFAULT_ 0);
 
@@ -0,0 +1,71 @@
+#include "common.h"
+#include "payload.h"
+#include <sys/mman.h>
+
+/* One read-only region shared by every stream. It is backed by a memfd
+ * so the same pages can be handed to send(), MSG_ZEROCOPY or sendfile()
+ * without ever being touched again */
+static struct {
+  int fd;
+  size_t size;
+  void *data;
+} payload = { -1, 0, NULL };
+
+
+
+void payload_init(
+    size_t size)
+{
+  long pagesz = sysconf(_SC_PAGESIZE);
+  uint8_t *p;
+  size_t i;
+
+  assert(payload.data == NULL);
+  size = ((size + pagesz - 1) / pagesz) * pagesz;
+
+  payload.fd = memfd_create("tcpxfer-payload", MFD_CLOEXEC);
+  if (payload.fd < 0)
+    err(EXIT_FAILURE, "memfd_create");
+
+  if (ftruncate(payload.fd, size) < 0)
+    err(EXIT_FAILURE, "ftruncate");
+
+  p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, payload.fd, 0);
+  if (p == MAP_FAILED)
+    err(EXIT_FAILURE, "mmap");
+
+  /* Anything but zero pages, which some paths treat specially */
+  for (i=0; i < size; i++)
+    p[i] = i & 0xff;
+
+  if (mprotect(p, size, PROT_READ) < 0)
+    err(EXIT_FAILURE, "mprotect");
+
+  payload.data = p;
+  payload.size = size;
+}
+
+
+
+void * payload_get(
+    void)
+{
+  assert(payload.data);
+  return payload.data;
+}
+
+
+
+int payload_fd(
+    void)
+{
+  return payload.fd;
+}
+
+
+
+size_t payload_size(
+    void)
+{
+  return payload.size;
+}
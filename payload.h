@@ -0,0 +1,9 @@
+#ifndef _PAYLOAD_H_
+#define _PAYLOAD_H_
+#include "common.h"
+
+void payload_init(size_t size);
+void * payload_get(void);
+int payload_fd(void);
+size_t payload_size(void);
+#endif
@@ -0,0 +1,94 @@
+#include "common.h"
+#include "profile.h"
+
+/* Bytes over the first t seconds of a segment */
+static double seg_bytes(
+    const struct profile_seg *s,
+    double t)
+{
+  double high, n, rem;
+
+  switch (s->shape) {
+    case PROFILE_HOLD:
+      return s->rate * t;
+
+    case PROFILE_RAMP:
+      return s->rate * t + (s->rate2 - s->rate) * t * t / (2. * s->secs);
+
+    case PROFILE_SQUARE:
+      high = s->period * s->duty;
+      n = floor(t / s->period);
+      rem = t - n * s->period;
+      return n * (s->rate * high + s->rate2 * (s->period - high)) +
+             (rem < high ? s->rate * rem : s->rate * high + s->rate2 * (rem - high));
+  }
+  return 0.;
+}
+
+
+
+void profile_add(
+    struct profile *p,
+    const struct profile_seg *seg)
+{
+  struct profile_seg *s;
+
+  assert(seg->secs > 0.);
+  p->segs = realloc(p->segs, sizeof(struct profile_seg) * (p->nsegs + 1));
+  assert(p->segs);
+
+  s = &p->segs[p->nsegs++];
+  *s = *seg;
+  s->start = p->secs;
+  s->start_bytes = p->bytes;
+  p->secs += s->secs;
+  p->bytes += seg_bytes(s, s->secs);
+  p->peak = MAX(p->peak, MAX(s->rate, s->rate2));
+}
+
+
+
+void profile_start(
+    struct profile *p,
+    int64_t epoch)
+{
+  p->epoch = epoch;
+}
+
+
+
+/* Everything owed from the epoch up to at, whole passes first and then
+ * into the segment at is in */
+static double profile_total(
+    const struct profile *p,
+    int64_t at)
+{
+  double t = (double)(at - p->epoch) / BILLION;
+  double passes;
+  int lo = 0, hi = p->nsegs - 1, mid;
+
+  if (t <= 0.)
+    return 0.;
+  passes = floor(t / p->secs);
+  t -= passes * p->secs;
+
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (p->segs[mid].start <= t)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return passes * p->bytes + p->segs[lo].start_bytes +
+         seg_bytes(&p->segs[lo], MIN(t - p->segs[lo].start, p->segs[lo].secs));
+}
+
+
+
+double profile_bytes(
+    const struct profile *p,
+    int64_t from,
+    int64_t to)
+{
+  return MAX(profile_total(p, to) - profile_total(p, from), 0.);
+}
@@ -0,0 +1,44 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+#include "common.h"
+
+/* Pacing tick when following a profile without --burst */
+#define PROFILE_TICK 0.0005
+
+enum profile_shape {
+  PROFILE_HOLD,   /* rate throughout */
+  PROFILE_RAMP,   /* rate at the start to rate2 at the end, linearly */
+  PROFILE_SQUARE  /* rate for duty of every period, rate2 for the rest */
+};
+
+struct profile_seg {
+  enum profile_shape shape;
+  double secs;
+  double rate;
+  double rate2;
+  double period;
+  double duty;
+
+  /* Where the segment starts within a pass, in time and bytes */
+  double start;
+  double start_bytes;
+};
+
+/* A traffic shape for one direction. The segments play in order and then
+ * from the first again, timed from the epoch. Rates are bytes per second
+ * in total, each stream paces its share */
+struct profile {
+  int nsegs;
+  struct profile_seg *segs;
+  double secs;
+  double bytes;
+  double peak;
+  int64_t epoch;
+};
+
+void profile_add(struct profile *p, const struct profile_seg *seg);
+void profile_start(struct profile *p, int64_t epoch);
+/* Bytes owed between two CLOCK_MONOTONIC times, exactly, so a pacer
+ * that asks every tick keeps to the shape to within a tick */
+double profile_bytes(const struct profile *p, int64_t from, int64_t to);
+#endif
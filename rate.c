@@ -1,36 +1,174 @@
 #include "common.h"
 #include "rate.h"
 #include "config.h"
+#include "worker.h"
+#include "payload.h"
+#include "uring.h"
+#include "frame.h"
+#include "diag.h"
+#include "hist.h"
+#include "realtime.h"
+#include "udp.h"
+#include "search.h"
+#include "profile.h"
+#include "dial.h"
+#include "handshake.h"
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <netinet/udp.h>
 
-struct ev_loop *loop = NULL;
-double last_epoch = 0;
-uint64_t received_bytes = 0;
-double latency_total = 0.0;
+static int sock_listener(char *port, int type, int backlog);
 
-static int tcp_listener(char *port);
-static int tcp_connect(char *host, char *port);
-
-static void rate_connect(EV_P_ ev_io *w, int revents);
+static void rate_listen(EV_P_ ev_io *w, int revents);
+static void rate_udp_listen(EV_P_ ev_io *w, int revents);
 static void rate_sendrecv(EV_P_ ev_io *w, int revents);
-static void rate_relisten(void);
-static void rate_reconnect(void);
+static void rate_relisten(struct rate_data *r);
+static void rate_reconnect(struct rate_data *r);
+static void rate_udp_datagrams(struct rate_data *r, struct udp_batch *b, int i, int64_t now);
+static void rate_stream_init(struct rate_data *r, struct worker *wk, int id);
 
-static void connect_timeout(EV_P_ ev_timer *t, int revents);
 static void pps_limit(EV_P_ ev_io *tfd, int revents);
+static void rate_handshake_tick(EV_P_ ev_io *tfd, int revents);
 
 
 struct rate_data {
-  int sfd;
+  int id;
   int fd;
   int tfd;
   ev_io w;
-  ev_timer t;
   ev_io tfdw;
+  struct ev_loop *loop;
+  struct worker *wk;
   struct configuration *c;
-  uint64_t runs;
+  struct stats *stats;
+  double owed;
   bool ready;
-} rate;
+
+  /* The peer and the pace for it. Without a burst interval every tick
+   * is worth exactly one write */
+  char *host;
+  char *port;
+  struct dial dial;
+  int64_t rate;
+  double tick;
+  double bytes_per_tick;
+
+  /* Pacing accuracy, the timerfd runs on an absolute schedule so every
+   * wakeup can be held against when it was due. Counters cover the
+   * current sample */
+  int64_t tick_ns;
+  int64_t deadline;
+  struct hist *lateness;
+  uint64_t sent_bytes;
+  uint32_t ticks;
+  uint32_t overruns;
+  uint32_t skipped;
+  uint32_t stalls;
+  uint32_t lateness_max_us;
+
+  /* Transmit mode in use, zerocopy falls back to copy if unsupported */
+  enum tx_mode tx_mode;
+  uint64_t zc_pending;
+  bool zc_copied;
+
+  /* Splice receive, the socket drains through this pipe to /dev/null */
+  int pipefd[2];
+
+  /* Framed payloads */
+  struct frame_tx ftx;
+  struct frame_rx frx;
+
+  /* UDP. A listener slot serves one peer address through a socket of its
+   * own connected to it. A sender judges the path by the reports the
+   * receiver sends back, totals are kept as at the last sample */
+  struct sockaddr_storage peer;
+  socklen_t peerlen;
+  int udp_segs;
+  uint64_t udp_seq;
+  struct udp_rx urx;
+  struct udp_report urep;
+  double urep_at;
+  double urtt_us;
+  struct udp_counts ulast;
+
+  /* io_uring engine. The generation tags every request so completions
+   * from a previous connection are recognised and dropped */
+  bool ur_active;
+  uint8_t ur_gen;
+  int ur_inflight;
+  int64_t ur_interval;
+  int64_t ur_deadline;
+  struct __kernel_timespec ur_ts;
+  struct msghdr ur_msg;
+  struct iovec ur_iov[URING_MAX_BATCH];
+
+  /* Connection rate mode, the stream opens handshakes rather than
+   * keeping a connection. Bytes counts are then counts of connects */
+  struct handshaker *hs;
+
+  /* Whether the stream has ever connected, when the connection went, and
+   * how long it took to come back until the next sample reports it */
+  double lost_at;
+  double reconnect_s;
+  bool connected;
+
+  double last_epoch;
+  /* What the samples count, bytes received, or acked when searching since
+   * it is our sending that is searched, or connects */
+  uint64_t counted_bytes;
+  double latency_total;
+  struct tcp_info last_tcpi;
+  uint64_t cookie;
+
+  /* Published to the aggregate which may sample from another thread */
+  uint64_t acc_bytes;
+  uint64_t acc_sent;
+  uint64_t acc_failed;
+  uint32_t rtt_us;
+  uint32_t delay_us;
+  uint32_t jitter_us;
+};
+
+
+static struct {
+  struct configuration *c;
+  int nstreams;
+  struct rate_data *streams;
+  int devnull;
+
+  /* Total rate to a single peer, a search moves it about */
+  int64_t rate;
+
+  /* Listeners only. Clients being served across every worker, and
+   * streams made so far, the workers add to those dealt out at start
+   * as they need */
+  int clients;
+  int nslots;
+
+  /* Aggregate over every stream, only used with more than one */
+  struct stats *stats;
+  double last_epoch;
+  uint64_t acc_bytes;
+  uint64_t acc_sent;
+  uint64_t acc_failed;
+  double latency_total;
+} rates;
+
+
+/* io_uring user_data carries the stream, the operation and the generation */
+enum {
+  UR_RECV = 1,
+  UR_SEND,
+  UR_TICK,
+};
+#define UR_DATA(r, op) \
+  ((uint64_t)(uintptr_t)(r) | ((uint64_t)(r)->ur_gen << 48) | ((uint64_t)(op) << 56))
+#define UR_STREAM(d) ((struct rate_data *)(uintptr_t)((d) & 0xffffffffffffULL))
+#define UR_GEN(d) (((d) >> 48) & 0xff)
+#define UR_OP(d) ((d) >> 56)
 
 
 
@@ -44,51 +182,110 @@ static void dbl_to_ts(
 }
 
 
+
+/* What the ticks up to the one due at deadline are worth. A profile is
+ * integrated over exactly the time they cover, so however its rate moves
+ * the stream keeps to it within a tick */
+static double rate_owed(
+    struct rate_data *r,
+    int64_t deadline,
+    uint64_t ticks)
+{
+  if (!r->c->profile)
+    return r->bytes_per_tick * ticks;
+  return profile_bytes(r->c->profile, deadline - ticks * r->tick_ns, deadline) / r->c->streams;
+}
+
+
+
+/* The mean rate the profile asked of nstreams streams over the interval
+ * up to now */
+static double rate_profile_target(
+    double interval,
+    int nstreams)
+{
+  int64_t now = monotonic_ns();
+
+  return profile_bytes(rates.c->profile, now - llround(interval * BILLION), now) / nstreams / interval;
+}
+
+
+
+/* A pacer tick that was due at deadline ran now */
+static void rate_tick_late(
+    struct rate_data *r,
+    int64_t now,
+    int64_t deadline)
+{
+  uint32_t us = now > deadline ? MIN((now - deadline) / 1000, UINT32_MAX) : 0;
+
+  if (r->lateness)
+    hist_record_shared(r->lateness, us);
+  r->lateness_max_us = MAX(r->lateness_max_us, us);
+}
+
+
 static void timerfd_stop(
-    void)
+    struct rate_data *r)
 {
-  ev_io_stop(EV_DEFAULT_ &rate.tfdw);
-  close(rate.tfd);
-  rate.tfd = -1;
+  ev_io_stop(r->loop, &r->tfdw);
+  if (r->tfd > -1)
+    close(r->tfd);
+  r->tfd = -1;
 }
 
 static void timerfd_start(
-    void)
+    struct rate_data *r)
 {
   struct itimerspec its;
-  rate.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
-  if (rate.tfd < 0)
+  r->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+  if (r->tfd < 0)
     err(EXIT_FAILURE, "timerfd_create");
 
-  dbl_to_ts(rate.c->per_packet_wait, &its.it_interval);
-  dbl_to_ts(rate.c->per_packet_wait, &its.it_value);
+  r->deadline = monotonic_ns() + r->tick_ns;
+  dbl_to_ts(r->tick, &its.it_interval);
+  its.it_value.tv_sec = r->deadline / BILLION;
+  its.it_value.tv_nsec = r->deadline % BILLION;
 
-  if (timerfd_settime(rate.tfd, 0, &its, NULL) < 0)
+  if (timerfd_settime(r->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
     err(EXIT_FAILURE, "tiemrfd_settime");
 
-  ev_io_stop(EV_DEFAULT_ &rate.tfdw);
-  ev_io_set(&rate.tfdw, rate.tfd, EV_READ);
-  ev_set_cb(&rate.tfdw, pps_limit);
-  ev_io_start(EV_DEFAULT_ &rate.tfdw);
+  ev_io_stop(r->loop, &r->tfdw);
+  ev_io_set(&r->tfdw, r->tfd, EV_READ);
+  ev_set_cb(&r->tfdw, r->c->connect_rate ? rate_handshake_tick : pps_limit);
+  ev_io_start(r->loop, &r->tfdw);
 }
 
-static int tcp_listener(
-    char *port)
+static int sock_listener(
+    char *port,
+    int type,
+    int backlog)
 {
-  struct addrinfo *ai, hints;
+  struct addrinfo *ai, *a, hints;
   int fd, rc;
 
   memset(&hints, 0, sizeof(hints));
   hints.ai_flags = AI_PASSIVE;
   hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
+  hints.ai_socktype = type;
 
   rc = getaddrinfo(NULL, port, &hints, &ai);
   if (rc)
     errx(EXIT_FAILURE, "Unable to listen: %s", gai_strerror(rc));
 
-  fd = socket(ai->ai_family, ai->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC, ai->ai_protocol);
+  /* One IPv6 socket takes both families where the host has IPv6 */
+  for (a=ai; a && a->ai_family != AF_INET6; a=a->ai_next);
+  fd = a ? socket(a->ai_family, a->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC, a->ai_protocol) : -1;
+  if (fd > -1 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int){0}, sizeof(int)) < 0) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0) {
+    for (a=ai; a && a->ai_family == AF_INET6; a=a->ai_next);
+    if (!a)
+      a = ai;
+    fd = socket(a->ai_family, a->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC, a->ai_protocol);
+  }
   if (fd < 0)
     err(EXIT_FAILURE, "socket()");
 
@@ -96,10 +293,15 @@ static int tcp_listener(
   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &rc, sizeof(rc)) < 0)
     err(EXIT_FAILURE, "setsockopt()");
 
-  if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+  /* Every worker binds its own socket, the kernel spreads connections */
+  rc = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &rc, sizeof(rc)) < 0)
+    err(EXIT_FAILURE, "setsockopt()");
+
+  if (bind(fd, a->ai_addr, a->ai_addrlen) < 0)
     err(EXIT_FAILURE, "Unable to listen");
 
-  if (listen(fd, 1) < 0)
+  if (type == SOCK_STREAM && listen(fd, backlog) < 0)
     err(EXIT_FAILURE, "Unable to listen");
 
   freeaddrinfo(ai);
@@ -108,96 +310,444 @@ static int tcp_listener(
 
 
 
-static int tcp_connect(
-    char *host,
-    char *port)
+/* The number of expirations since the last read, which is at least one,
+ * or none if the timerfd had not fired after all */
+static uint64_t timerfd_expired(
+    struct rate_data *r)
 {
-  struct addrinfo *ai = NULL, hints;
-  int fd = -1;
   int rc;
+  uint64_t overs;
+  rc = read(r->tfd, &overs, sizeof(overs));
+  if (rc < 0) {
+    if (errno == EAGAIN)
+      return 0;
+    else
+      err(EXIT_FAILURE, "timerfd()->read()");
+  }
 
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_flags = 0;
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
+  /* Judged against the latest of the expirations */
+  r->deadline += (overs - 1) * r->tick_ns;
+  rate_tick_late(r, monotonic_ns(), r->deadline);
+  r->deadline += r->tick_ns;
+  r->ticks += overs;
+  r->overruns += overs - 1;
+  return overs;
+}
 
-  rc = getaddrinfo(host, port, &hints, &ai);
-  if (rc) {
-    warnx("Coudln't resolve hostname: %s", gai_strerror(rc));
-    goto fail;
-  }
 
-  fd = socket(ai->ai_family, ai->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC, ai->ai_protocol);
-  if (fd < 0)
-    goto fail;
-
-  if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
-    if (errno == EINPROGRESS)
-      rc = EINPROGRESS;
-    else {
-      usleep(250000);
-      goto fail;
+
+static void pps_limit(
+    EV_P_ ev_io *t,
+    int revents)
+{
+  struct rate_data *r = t->data;
+  uint64_t overs = timerfd_expired(r);
+
+  if (overs == 0)
+    return;
+
+  if ((r->w.events & EV_WRITE)) {
+    /* If there is no write pending, but you are looking for writes,
+     * then the send buffer must be full. We dont want to log our overruns
+     * in this situation as it will cause a 'burst' later otherwise
+    */
+    if (!ev_is_pending(&r->w)) {
+      r->skipped += overs;
+      return;
     }
   }
+  else {
+    ev_io_set(&r->w, r->fd, EV_READ|EV_WRITE);
+    ev_io_stop(EV_A_ &r->w);
+    ev_io_start(EV_A_ &r->w);
+  }
 
-  freeaddrinfo(ai);
-  errno = EINPROGRESS;
-  return fd;
-
-fail:
-  if (ai)
-    freeaddrinfo(ai);
-  if (fd > -1)
-    close(fd);
-  return -1;
+  r->owed += rate_owed(r, r->deadline - r->tick_ns, overs);
 }
 
 
 
-static void connect_timeout(
-    EV_P_ ev_timer *t,
+/* Connection rate mode owes handshakes rather than bytes. Those there
+ * is no room for, with a timeout's worth still going, are skipped */
+static void rate_handshake_tick(
+    EV_P_ ev_io *t,
     int revents)
 {
   struct rate_data *r = t->data;
+  uint64_t overs = timerfd_expired(r);
+  uint32_t n, skipped;
 
-  warnx("Connection to host timed out");
-  rate_reconnect();
+  if (overs == 0)
+    return;
+
+  r->owed += rate_owed(r, r->deadline - r->tick_ns, overs);
+  n = MIN(floor(r->owed), UINT32_MAX);
+  r->owed -= n;
+  skipped = handshaker_open(r->hs, n);
+  r->skipped += skipped;
+  r->sent_bytes += n - skipped;
 }
 
 
 
-static void pps_limit(
-    EV_P_ ev_io *t,
+/* Hand pacing to the kernel (TCP internal pacing or the fq qdisc) and
+ * keep the unsent queue shallow so EV_WRITE becomes the pacing clock */
+static void rate_kernel_pacing(
+    struct rate_data *r)
+{
+  uint64_t rate = r->rate;
+  uint32_t rate32 = MIN(rate, UINT32_MAX);
+  int lowat = r->c->notsent_lowat;
+
+  /* Older kernels only take a 32 bit rate */
+  if (setsockopt(r->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) < 0) {
+    if (setsockopt(r->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate32, sizeof(rate32)) < 0)
+      err(EXIT_FAILURE, "Cannot set SO_MAX_PACING_RATE");
+  }
+
+  if (setsockopt(r->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0)
+    err(EXIT_FAILURE, "Cannot set TCP_NOTSENT_LOWAT");
+}
+
+
+
+static void rate_uring_recv(
+    struct rate_data *r)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(r->wk->ring);
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = r->fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->user_data = UR_DATA(r, UR_RECV);
+}
+
+
+
+static void rate_uring_tick(
+    struct rate_data *r)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(r->wk->ring);
+
+  /* Absolute deadlines so the schedule never drifts */
+  r->ur_deadline += r->ur_interval;
+  r->ur_ts.tv_sec = r->ur_deadline / BILLION;
+  r->ur_ts.tv_nsec = r->ur_deadline % BILLION;
+
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uint64_t)(uintptr_t)&r->ur_ts;
+  sqe->len = 1;
+  sqe->timeout_flags = IORING_TIMEOUT_ABS;
+  sqe->user_data = UR_DATA(r, UR_TICK);
+}
+
+
+
+/* Queue what is owed as one gathered send, every iovec pointing at the
+ * payload. MSG_WAITALL has the kernel finish it however long it takes */
+static void rate_uring_send(
+    struct rate_data *r)
+{
+  struct io_uring_sqe *sqe;
+  size_t len;
+  int n = 0;
+
+  while (r->owed >= 1.0 && n < URING_MAX_BATCH) {
+    len = MIN((size_t)r->owed, r->c->write_size);
+    r->ur_iov[n].iov_base = payload_get();
+    r->ur_iov[n].iov_len = len;
+    r->owed -= len;
+    n++;
+  }
+
+  if (n == 0)
+    return;
+
+  memset(&r->ur_msg, 0, sizeof(r->ur_msg));
+  r->ur_msg.msg_iov = r->ur_iov;
+  r->ur_msg.msg_iovlen = n;
+
+  sqe = uring_get_sqe(r->wk->ring);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = r->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&r->ur_msg;
+  sqe->msg_flags = MSG_NOSIGNAL|MSG_WAITALL;
+  sqe->user_data = UR_DATA(r, UR_SEND);
+  r->ur_inflight++;
+}
+
+
+
+static void rate_uring_start(
+    struct rate_data *r)
+{
+  int flags;
+
+  /* io_uring hands back EAGAIN on non-blocking sockets rather than
+   * waiting for them itself */
+  flags = fcntl(r->fd, F_GETFL);
+  if (flags < 0 || fcntl(r->fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+    err(EXIT_FAILURE, "fcntl");
+
+  r->ur_active = true;
+  r->ur_inflight = 0;
+  r->ur_interval = r->tick_ns;
+  r->ur_deadline = monotonic_ns();
+
+  rate_uring_recv(r);
+  rate_uring_tick(r);
+}
+
+
+
+/* Cancel everything in flight for this stream before its fd goes away */
+static void rate_uring_stop(
+    struct rate_data *r)
+{
+  struct io_uring_sqe *sqe;
+
+  if (!r->ur_active)
+    return;
+
+  sqe = uring_get_sqe(r->wk->ring);
+  sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+  sqe->addr = UR_DATA(r, UR_TICK);
+
+  sqe = uring_get_sqe(r->wk->ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = r->fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD|IORING_ASYNC_CANCEL_ALL;
+
+  uring_submit(r->wk->ring);
+  r->ur_active = false;
+  r->ur_inflight = 0;
+  r->ur_gen++;
+}
+
+
+
+static void rate_uring_ticked(
+    struct rate_data *r)
+{
+  int64_t now = monotonic_ns();
+  uint64_t ticks = 1;
+
+  /* Fell behind schedule, count the ticks slept through like timerfd
+   * overruns and pick the schedule up from now */
+  if (now > r->ur_deadline + r->ur_interval) {
+    ticks += (now - r->ur_deadline) / r->ur_interval;
+    r->ur_deadline += (ticks - 1) * r->ur_interval;
+  }
+  rate_tick_late(r, now, r->ur_deadline);
+  r->ticks += ticks;
+  r->overruns += ticks - 1;
+
+  /* A send still waiting means the send buffer is full, same as the
+   * timer pacer dont bank the ticks or it will burst later */
+  if (r->ur_inflight == 0) {
+    r->owed += rate_owed(r, r->ur_deadline, ticks);
+    rate_uring_send(r);
+  }
+  else {
+    r->skipped += ticks;
+  }
+  rate_uring_tick(r);
+}
+
+
+
+static void rate_uring_complete(
+    EV_P_ ev_io *w,
     int revents)
 {
-  struct rate_data *r = t->data;
-  int rc;
-  uint64_t overs;
-  rc = read(rate.tfd, &overs, sizeof(overs));
-  if (rc < 0) {
-    if (errno == EAGAIN)
-      return;
+  struct worker *wk = w->data;
+  struct io_uring_cqe *cqe;
+  struct rate_data *r;
+  uint64_t data;
+  uint32_t flags;
+  int res;
+
+  while ((cqe = uring_peek_cqe(wk->ring))) {
+    data = cqe->user_data;
+    res = cqe->res;
+    flags = cqe->flags;
+    uring_cqe_seen(wk->ring);
+
+    if (flags & IORING_CQE_F_BUFFER)
+      uring_buffer_recycle(wk->ring, flags >> IORING_CQE_BUFFER_SHIFT);
+
+    r = UR_STREAM(data);
+    if (!r || !r->ur_active || UR_GEN(data) != r->ur_gen)
+      continue;
+
+    switch (UR_OP(data)) {
+    case UR_TICK:
+      rate_uring_ticked(r);
+    break;
+
+    case UR_SEND:
+      r->ur_inflight--;
+      if (res > 0)
+        r->sent_bytes += res;
+      if (res < 0 && res != -ECANCELED) {
+        errno = -res;
+        if (r->c->listener) {
+          warn("Send failed");
+          rate_relisten(r);
+        }
+        else {
+          rate_reconnect(r);
+        }
+      }
+    break;
+
+    case UR_RECV:
+      if (res == 0 || (res < 0 && res != -ENOBUFS)) {
+        if (r->c->listener)
+          rate_relisten(r);
+        else
+          rate_reconnect(r);
+      }
+      else if (!(flags & IORING_CQE_F_MORE)) {
+        rate_uring_recv(r);
+      }
+    break;
+    }
+  }
+}
+
+
+
+static void rate_uring_flush(
+    EV_P_ ev_prepare *p,
+    int revents)
+{
+  struct worker *wk = p->data;
+  uring_submit(wk->ring);
+}
+
+
+
+static void rate_udp_established(
+    struct rate_data *r)
+{
+  size_t ws = r->c->write_size;
+
+  udp_rx_reset(&r->urx, stats_delay_hist(r->stats));
+  memset(&r->ulast, 0, sizeof(r->ulast));
+  r->urep_at = -INFINITY;
+  r->urtt_us = 0.;
+  r->udp_seq = 0;
+  r->udp_segs = 1;
+
+  /* The kernel cuts each send into write size datagrams */
+  if (r->c->udp_gso && !r->c->listener) {
+    if (setsockopt(r->fd, SOL_UDP, UDP_SEGMENT, &(int){ws}, sizeof(int)) < 0)
+      warn("Cannot enable UDP_SEGMENT, sending datagrams one at a time");
     else
-      err(EXIT_FAILURE, "timerfd()->read()");
+      r->udp_segs = MAX(1, MIN(UDP_MAX_SEGS, UDP_MAX_PAYLOAD / ws));
   }
+  if (r->c->udp_gso && r->c->listener &&
+      setsockopt(r->fd, SOL_UDP, UDP_GRO, &(int){1}, sizeof(int)) < 0)
+    warn("Cannot enable UDP_GRO, receiving datagrams one at a time");
+}
 
-  if ((r->w.events & EV_WRITE)) {
-    /* If there is no write pending, but you are looking for writes,
-     * then the send buffer must be full. We dont want to log our overruns
-     * in this situation as it will cause a 'burst' later otherwise 
-    */
-    if (!ev_is_pending(&r->w)) {
-      return;
+
+
+/* Connection is up, start moving data and pacing it */
+static void rate_established(
+    struct rate_data *r)
+{
+  int one = 1;
+
+  /* Only the streams that receive by splicing need a pipe, kept for
+   * the life of the slot */
+  if (r->c->rx_mode == RX_SPLICE && r->pipefd[0] < 0) {
+    if (pipe2(r->pipefd, O_CLOEXEC|O_NONBLOCK) < 0)
+      err(EXIT_FAILURE, "Cannot create receive pipe");
+    if (fcntl(r->pipefd[1], F_SETPIPE_SZ, (int)MIN(r->c->read_size, INT_MAX)) < 0)
+      warn("Cannot grow receive pipe to %zu bytes", r->c->read_size);
+  }
+
+  realtime_socket(r->fd);
+  if (r->c->udp)
+    rate_udp_established(r);
+  r->counted_bytes = 0;
+  memset(&r->last_tcpi, 0, sizeof(r->last_tcpi));
+  r->cookie = r->wk->diag ? diag_cookie(r->fd) : 0;
+  r->owed = 0.;
+  r->tx_mode = r->c->tx_mode;
+  r->zc_pending = 0;
+  frame_tx_reset(&r->ftx);
+  frame_rx_reset(&r->frx, stats_delay_hist(r->stats));
+  r->lateness = stats_lateness_hist(r->stats);
+  r->sent_bytes = 0;
+  r->ticks = r->overruns = r->skipped = r->stalls = r->lateness_max_us = 0;
+  if (r->tx_mode == TX_ZEROCOPY) {
+    if (setsockopt(r->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+      warn("Cannot enable SO_ZEROCOPY, falling back to copying sends");
+      r->tx_mode = TX_COPY;
     }
   }
-  else {
-    ev_io_set(&r->w, r->fd, EV_READ|EV_WRITE);
-    ev_io_stop(EV_A_ &r->w);
-    ev_io_start(EV_A_ &r->w);
+  __atomic_store_n(&r->ready, true, __ATOMIC_RELEASE);
+
+  ev_io_stop(r->loop, &r->w);
+  if (r->c->engine == ENGINE_URING) {
+    rate_uring_start(r);
+    return;
   }
 
-  rate.runs += (overs+1);
+  ev_io_set(&r->w, r->fd, EV_READ|EV_WRITE);
+  ev_set_cb(&r->w, rate_sendrecv);
+  ev_io_start(r->loop, &r->w);
+
+  /* A UDP listener only answers with reports */
+  if (r->c->udp && r->c->listener)
+    return;
+  if (r->c->pacing == PACING_KERNEL)
+    rate_kernel_pacing(r);
+  else
+    timerfd_start(r);
+}
+
+
+
+/* A slot for a new client on this worker, or NULL with every client the
+ * listener serves already taken. SO_REUSEPORT hashes clients over the
+ * workers without regard to who has room, so the limit is shared and a
+ * worker that has given out all its slots makes another. A slot is free
+ * once the last connection's loss has been reported */
+static struct rate_data * rate_claim(
+    struct worker *wk)
+{
+  struct rate_data *r;
+  int i, n = __atomic_load_n(&rates.clients, __ATOMIC_RELAXED);
+
+  do {
+    if (n >= rates.c->clients)
+      return NULL;
+  } while (!__atomic_compare_exchange_n(&rates.clients, &n, n + 1, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+
+  for (i=0; i < wk->nstreams; i++)
+    if (wk->streams[i]->fd < 0 && !wk->streams[i]->stats)
+      return wk->streams[i];
+
+  r = calloc(1, sizeof(struct rate_data));
+  assert(r);
+  rate_stream_init(r, wk, __atomic_fetch_add(&rates.nslots, 1, __ATOMIC_RELAXED));
+  worker_add_stream(wk, r);
+  return r;
+}
+
+
+
+static void rate_unclaim(
+    struct rate_data *r)
+{
+  __atomic_sub_fetch(&rates.clients, 1, __ATOMIC_RELAXED);
 }
 
 
@@ -206,133 +756,464 @@ static void rate_listen(
     EV_P_ ev_io *w,
     int revents)
 {
-  struct rate_data *r = w->data;
-  struct sockaddr addr;
+  struct worker *wk = w->data;
+  struct rate_data *r = NULL;
+  struct sockaddr_storage addr;
   socklen_t len = sizeof(addr);
-  char h[64];
+  char h[NI_MAXHOST];
+  char s[NI_MAXSERV];
+  int fd;
   memset(h, 0, sizeof(h));
-  
-  r->fd = accept4(r->sfd, &addr, &len, SOCK_NONBLOCK);
-  if (r->fd < 0) {
-    warn("Cannot accept new connection");
+  memset(s, 0, sizeof(s));
+
+  fd = accept4(wk->sfd, (struct sockaddr *)&addr, &len, SOCK_NONBLOCK|SOCK_CLOEXEC);
+  if (fd < 0) {
+    if (errno != EAGAIN && errno != ECONNABORTED)
+      warn("Cannot accept new connection");
     return;
   }
-  rate.ready = true;
-  received_bytes = 0;
-  if (rate.c->hostname)
-    free(rate.c->hostname);
-  getnameinfo(&addr, len, h, 128, NULL, 0, 0);
-  rate.c->hostname = strdup(h);
 
-  ev_io_stop(EV_A_ w);
+  r = rate_claim(wk);
+  getnameinfo((struct sockaddr *)&addr, len, h, sizeof(h), s, sizeof(s), NI_NUMERICHOST|NI_NUMERICSERV);
+  if (!r) {
+    warnx("Refusing connection from %s:%s, all %d clients are busy", h, s, rates.c->clients);
+    close(fd);
+    return;
+  }
+
+  r->fd = fd;
+  r->last_epoch = ev_now(r->loop);
+  r->stats = stats_new(r->loop, r->rate, rate_update_stats, r);
+  stats_set_tag(r->stats, "%s:%s", h, s);
+
+  rate_established(r);
+}
+
 
-  ev_io_set(w, r->fd, EV_WRITE|EV_READ);
-  ev_set_cb(w, rate_sendrecv);
-  ev_io_start(EV_A_ w);
 
-  timerfd_start();
+/* A socket of the slot's own, bound where the listener is and connected
+ * to the peer, the kernel prefers it to the listener for the peer's
+ * datagrams from then on */
+static int rate_udp_accept(
+    struct worker *wk,
+    struct sockaddr_storage *addr,
+    socklen_t len)
+{
+  struct sockaddr_storage local;
+  socklen_t locallen = sizeof(local);
+  int fd, one = 1;
 
+  if (getsockname(wk->sfd, (struct sockaddr *)&local, &locallen) < 0)
+    return -1;
+  fd = socket(local.ss_family, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if ((local.ss_family == AF_INET6 &&
+       setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int){0}, sizeof(int)) < 0) ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 ||
+      bind(fd, (struct sockaddr *)&local, locallen) < 0 ||
+      connect(fd, (struct sockaddr *)addr, len) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
 }
 
 
 
-static void rate_connect(
+/* The slot serving this peer, taking a free one for a new peer */
+static struct rate_data * rate_udp_peer(
+    struct worker *wk,
+    struct sockaddr_storage *addr,
+    socklen_t len)
+{
+  struct rate_data *r = NULL;
+  char h[NI_MAXHOST];
+  char s[NI_MAXSERV];
+  static bool warned = false;
+  int i;
+
+  for (i=0; i < wk->nstreams; i++) {
+    r = wk->streams[i];
+    if (r->fd > -1 && r->peerlen == len && memcmp(&r->peer, addr, len) == 0)
+      return r;
+  }
+
+  r = rate_claim(wk);
+  memset(h, 0, sizeof(h));
+  memset(s, 0, sizeof(s));
+  getnameinfo((struct sockaddr *)addr, len, h, sizeof(h), s, sizeof(s), NI_NUMERICHOST|NI_NUMERICSERV);
+  if (!r) {
+    if (!__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED))
+      warnx("Dropping datagrams from %s:%s, all %d clients are busy", h, s, rates.c->clients);
+    return NULL;
+  }
+
+  r->fd = rate_udp_accept(wk, addr, len);
+  if (r->fd < 0) {
+    warn("Cannot open a socket for %s:%s", h, s);
+    rate_unclaim(r);
+    return NULL;
+  }
+  memcpy(&r->peer, addr, len);
+  r->peerlen = len;
+  r->last_epoch = ev_now(r->loop);
+  r->stats = stats_new(r->loop, r->rate, rate_update_stats, r);
+  stats_set_tag(r->stats, "%s:%s", h, s);
+
+  rate_established(r);
+  return r;
+}
+
+
+
+/* Datagrams from peers without a slot yet, or that beat their slot's
+ * socket to it */
+static void rate_udp_listen(
     EV_P_ ev_io *w,
     int revents)
 {
-  int rc = sizeof(int);
-  int eno;
-  struct rate_data *r = w->data;
+  struct worker *wk = w->data;
+  struct udp_batch *b = wk->udp;
+  struct rate_data *r = NULL;
+  struct msghdr *msg;
+  int64_t now = realtime_ns();
+  int i, n;
+
+  n = udp_recv(wk->sfd, b, true);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EINTR)
+      warn("Cannot receive datagrams");
+    return;
+  }
 
-  rc = getsockopt(r->fd, SOL_SOCKET, SO_ERROR, &eno, &rc);
-  if (rc < 0) 
-    warn("connect()->getsockopt()");
+  for (i=0; i < n; i++) {
+    msg = &b->rxmsgs[i].msg_hdr;
+    if (!r || r->fd < 0 || r->peerlen != msg->msg_namelen ||
+        memcmp(&r->peer, &b->names[i], msg->msg_namelen) != 0)
+      r = rate_udp_peer(wk, &b->names[i], msg->msg_namelen);
+    if (r)
+      rate_udp_datagrams(r, b, i, now);
+  }
+}
+
+
+
+static void rate_disconnected(
+    struct rate_data *r)
+{
+  if (r->c->listener)
+    rate_relisten(r);
+  else
+    rate_reconnect(r);
+}
+
+
+
+/* Move what was spliced into the pipe on to /dev/null */
+static int rate_splice_drain(
+    struct rate_data *r,
+    ssize_t len)
+{
+  ssize_t rc;
+
+  while (len > 0) {
+    rc = splice(r->pipefd[0], NULL, rates.devnull, NULL, len, SPLICE_F_MOVE);
+    if (rc <= 0)
+      return -1;
+    len -= rc;
+  }
+  return 0;
+}
 
-  if (eno == EINPROGRESS)
+
+
+/* The i'th read of a batch. A receiver counts the datagrams in it, a
+ * sender only ever gets reports back */
+static void rate_udp_datagrams(
+    struct rate_data *r,
+    struct udp_batch *b,
+    int i,
+    int64_t now)
+{
+  uint8_t *buf = b->rxbuf + i * b->rxsz;
+  struct udp_report rep;
+  size_t len, segsz, off;
+  bool first = !r->urx.started;
+
+  len = udp_segment(b, i, &segsz);
+  if (!r->c->listener) {
+    if (!udp_report_parse(buf, MIN(len, b->rxsz), &rep))
+      return;
+    r->urep = rep;
+    r->urep_at = ev_now(r->loop);
+    r->urtt_us = (now - rep.echo_ns - rep.hold_ns) / 1000.;
     return;
-  else if (eno > 0) {
-    errno = eno;
-    usleep(250000);
-    rate_reconnect();
   }
-  else {
-    rate.ready = true;
-    received_bytes = 0;
-    ev_timer_stop(EV_A_ &r->t);
-    ev_io_set(w, rate.fd, EV_READ|EV_WRITE);
-    ev_set_cb(w, rate_sendrecv);
-    ev_io_stop(EV_A_ w);
-    ev_io_start(EV_A_ w);
-    timerfd_start();
+
+  for (off = 0; off < len && segsz > 0; off += segsz)
+    udp_rx_datagram(&r->urx, buf + off, MIN(segsz, len - off), now, ev_now(r->loop));
+
+  /* Answer the first straight away so the sender is not left a whole
+   * sample wondering if anyone is there */
+  if (first && r->urx.started) {
+    udp_report_make(&r->urx, &rep, realtime_ns());
+    send(r->fd, &rep, sizeof(rep), MSG_DONTWAIT|MSG_NOSIGNAL);
   }
 }
 
 
 
-static void rate_recv(
-    void)
+static int rate_udp_recv(
+    struct rate_data *r)
 {
-  int rc;
-  uint8_t buffer[DATA_SZ];
-  uint64_t total = 0;
+  struct udp_batch *b = r->wk->udp;
+  int i, n;
+
+  while (1) {
+    n = udp_recv(r->fd, b, false);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        return 0;
+      /* ICMP errors for what we sent are handed back here, the peer is
+       * not up yet or is unreachable for now, keep on */
+      if (errno == ECONNREFUSED || errno == EHOSTUNREACH || errno == ENETUNREACH)
+        continue;
+      warn("Receive failed");
+      return 0;
+    }
+
+    for (i=0; i < n; i++)
+      rate_udp_datagrams(r, b, i, realtime_ns());
+    if (n < b->nrx)
+      return 0;
+  }
+}
+
+
+
+/* Read and throw away whatever is waiting. Returns -1 if the connection
+ * went away, in which case the stream has already been reset */
+static int rate_recv(
+    struct rate_data *r)
+{
+  ssize_t rc;
+  size_t len = r->c->read_size;
+
+  if (r->c->udp)
+    return rate_udp_recv(r);
 
   while (1) {
-    rc = recv(rate.fd, buffer, DATA_SZ, 0);
+    switch (r->c->rx_mode) {
+    case RX_TRUNC:
+      rc = recv(r->fd, NULL, len, MSG_TRUNC);
+    break;
+
+    case RX_SPLICE:
+      rc = splice(r->fd, NULL, r->pipefd[1], NULL, len, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+      if (rc > 0 && rate_splice_drain(r, rc) < 0)
+        err(EXIT_FAILURE, "Cannot drain the receive pipe");
+    break;
+
+    default:
+      rc = recv(r->fd, r->wk->rxbuf, len, 0);
+      if (rc > 0 && r->c->framed)
+        frame_parse(&r->frx, r->wk->rxbuf, rc);
+    break;
+    }
+
     if (rc < 0) {
-      if (errno == EAGAIN)
-        break;
+      if (errno == EAGAIN || errno == EINTR)
+        return 0;
+      if (errno != ECONNRESET)
+        warn("Receive failed");
+      rate_disconnected(r);
+      return -1;
     }
     else if (rc == 0) {
-      return;
+      rate_disconnected(r);
+      return -1;
+    }
+
+    /* A short read means the queue is empty, skip the EAGAIN round trip */
+    if (rc < len)
+      return 0;
+  }
+}
+
+
+
+/* Reap MSG_ZEROCOPY completions from the error queue. The payload never
+ * changes so there is nothing to release, but the kernel stops accepting
+ * zerocopy sends once enough notifications are left unread */
+static void rate_zerocopy_reap(
+    struct rate_data *r)
+{
+  int rc;
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct sock_extended_err *serr;
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+
+  while (r->zc_pending > 0) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    rc = recvmsg(r->fd, &msg, MSG_ERRQUEUE);
+    if (rc < 0) {
+      if (errno != EAGAIN)
+        warn("Cannot read zerocopy completions");
+      break;
     }
-    else {
-      total += rc;
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      serr = (struct sock_extended_err *)CMSG_DATA(cm);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      /* Completions arrive as a range of send calls */
+      r->zc_pending -= MIN(r->zc_pending, serr->ee_data - serr->ee_info + 1);
+      if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !r->zc_copied) {
+        warnx("Kernel is copying zerocopy sends, the route does not support it");
+        r->zc_copied = true;
+      }
     }
   }
 }
 
 
 
-static void rate_send(
-    void)
+static ssize_t rate_xmit(
+    struct rate_data *r,
+    size_t len)
+{
+  off_t off = 0;
+  ssize_t rc;
+
+  if (r->c->framed)
+    return frame_send(r->fd, &r->ftx, r->c->write_size, len);
+
+  switch (r->tx_mode) {
+  case TX_ZEROCOPY:
+    rc = send(r->fd, payload_get(), len, MSG_NOSIGNAL|MSG_ZEROCOPY);
+    if (rc > 0)
+      r->zc_pending++;
+    /* Out of notification memory, behave as though the buffer is full */
+    else if (rc < 0 && errno == ENOBUFS)
+      errno = EAGAIN;
+    return rc;
+
+  case TX_SENDFILE:
+    return sendfile(r->fd, payload_fd(), &off, len);
+
+  default:
+    return send(r->fd, payload_get(), len, MSG_NOSIGNAL);
+  }
+}
+
+
+
+/* Datagrams are a whole write size each, anything owed short of one
+ * waits for the next tick */
+static void rate_udp_send(
+    struct rate_data *r)
 {
+  size_t ws = r->c->write_size;
   int rc;
-  uint8_t buffer[DATA_SZ]; /* Care so little whats in here */
+
+  while (r->owed >= ws) {
+    rc = udp_send(r->fd, r->wk->udp, &r->udp_seq, ws, MIN(r->owed / ws, UDP_BATCH), r->udp_segs);
+    if (rc < 0) {
+      if (errno == EAGAIN || errno == ENOBUFS) {
+        r->stalls++;
+        if (!(r->w.events & EV_WRITE)) {
+          ev_io_set(&r->w, r->fd, EV_READ|EV_WRITE);
+          ev_io_stop(r->loop, &r->w);
+          ev_io_start(r->loop, &r->w);
+        }
+        return;
+      }
+      /* Nobody listening yet, or an ICMP error for an earlier send. What
+       * is owed is dropped rather than banked into a burst */
+      if (errno != ECONNREFUSED && errno != EHOSTUNREACH && errno != ENETUNREACH)
+        warn("Send failed");
+      r->owed = 0.;
+      break;
+    }
+    r->owed -= (double)rc * ws;
+    r->sent_bytes += (uint64_t)rc * ws;
+  }
+
+  if (r->w.events & EV_WRITE) {
+    ev_io_set(&r->w, r->fd, EV_READ);
+    ev_io_stop(r->loop, &r->w);
+    ev_io_start(r->loop, &r->w);
+  }
+}
+
+
+
+/* Send whatever the pacer says we owe, in as few writes as the write
+ * size allows */
+static void rate_send(
+    struct rate_data *r)
+{
+  ssize_t rc;
+  size_t len;
   uint64_t total = 0;
 
-  while (rate.runs-- > 0) {
-    rc = send(rate.fd, buffer, DATA_SZ, MSG_NOSIGNAL);
+  if (r->c->udp) {
+    rate_udp_send(r);
+    return;
+  }
+
+  /* The socket only polls writable below the low watermark, top it up by
+   * that much and let the kernel pace it out */
+  if (r->c->pacing == PACING_KERNEL)
+    r->owed = r->c->notsent_lowat;
+
+  while (r->owed >= 1.0) {
+    len = MIN((size_t)r->owed, r->c->write_size);
+    rc = rate_xmit(r, len);
     if (rc < 0) {
-      if (errno == EPIPE) {
-        if (rate.c->listener) {
+      if (errno == EPIPE || errno == ECONNRESET) {
+        if (r->c->listener) {
           warn("Send failed");
-          rate_relisten();
+          rate_relisten(r);
         }
         else {
-          rate_reconnect();
+          rate_reconnect(r);
         }
         return;
       }
       else if (errno == EAGAIN) {
-        ev_io_set(&rate.w, rate.fd, EV_READ|EV_WRITE);
-        ev_io_stop(EV_DEFAULT_ &rate.w);
-        ev_io_start(EV_DEFAULT_ &rate.w);
+        r->stalls++;
+        if (!(r->w.events & EV_WRITE)) {
+          ev_io_set(&r->w, r->fd, EV_READ|EV_WRITE);
+          ev_io_stop(r->loop, &r->w);
+          ev_io_start(r->loop, &r->w);
+        }
         goto out;
       }
       else {
         warn("Send failed");
+        goto out;
       }
     }
+    r->owed -= rc;
     total += rc;
   }
 
-  if (rate.w.events & EV_WRITE) {
-    ev_io_set(&rate.w, rate.fd, EV_READ);
-    ev_io_stop(EV_DEFAULT_ &rate.w);
-    ev_io_start(EV_DEFAULT_ &rate.w);
+  if (r->c->pacing == PACING_TIMER && (r->w.events & EV_WRITE)) {
+    ev_io_set(&r->w, r->fd, EV_READ);
+    ev_io_stop(r->loop, &r->w);
+    ev_io_start(r->loop, &r->w);
   }
 
 out:
+  r->sent_bytes += total;
   return;
 }
 
@@ -341,160 +1222,706 @@ static void rate_sendrecv(
     EV_P_ ev_io *w,
     int revents)
 {
-  if (revents & EV_READ) rate_recv();
-  if (revents & EV_WRITE) rate_send();
+  struct rate_data *r = w->data;
+  if (r->zc_pending) rate_zerocopy_reap(r);
+  if (revents & EV_READ && rate_recv(r) < 0) return;
+  if (revents & EV_WRITE) rate_send(r);
 }
 
 
 static void rate_relisten(
-    void)
+    struct rate_data *r)
 {
-  close(rate.fd);
-  rate.fd = -1;
-  rate.ready = false;
-  ev_io_stop(EV_DEFAULT_ &rate.w);
-  ev_io_set(&rate.w, rate.sfd, EV_READ);
-  ev_set_cb(&rate.w, rate_listen);
-  ev_io_start(EV_DEFAULT_ &rate.w);
-  timerfd_stop();
+  rate_uring_stop(r);
+  close(r->fd);
+  r->fd = -1;
+  __atomic_store_n(&r->ready, false, __ATOMIC_RELEASE);
+  ev_io_stop(r->loop, &r->w);
+  timerfd_stop(r);
 }
 
 
 
-static void rate_reconnect(
-    void)
+/* Connection rate mode dials the peer once to find an address that
+ * answers, then opens every handshake to that */
+static void rate_handshake_start(
+    struct rate_data *r,
+    int fd)
 {
-  close(rate.fd);
-  rate.fd = -1;
-  ev_io_stop(EV_DEFAULT_ &rate.w);
-  ev_timer_stop(EV_DEFAULT_ &rate.t);
+  struct sockaddr_storage peer;
+  socklen_t len = sizeof(peer);
 
-  rate.ready = false;
-  rate.fd = tcp_connect(rate.c->hostname, rate.c->port);
-  if (errno == EINPROGRESS) {
-    ev_init(&rate.w, rate_connect);
-    ev_init(&rate.t, connect_timeout);
-    ev_io_set(&rate.w, rate.fd, EV_WRITE);
-    ev_timer_set(&rate.t, CONNECT_TIMEOUT, 0.);
-    ev_timer_start(EV_DEFAULT_ &rate.t);
+  if (getpeername(fd, (struct sockaddr *)&peer, &len) < 0) {
+    close(fd);
+    dial_start(&r->dial);
+    return;
   }
-  else if (errno == 0) {
-    rate.ready = true;
-    received_bytes = 0;
-    ev_init(&rate.w, rate_sendrecv);
-    ev_init(&rate.tfdw, pps_limit);
-    timerfd_start();
-    ev_io_set(&rate.w, rate.fd, EV_READ|EV_WRITE);
+  close(fd);
+
+  r->connected = true;
+  r->hs = handshaker_new(r->loop, (struct sockaddr *)&peer, len, r->rate, r->c->fastopen,
+                         stats_handshake_hist(r->stats));
+  r->lateness = stats_lateness_hist(r->stats);
+  r->owed = 0.;
+  r->sent_bytes = 0;
+  r->ticks = r->overruns = r->skipped = r->stalls = r->lateness_max_us = 0;
+  r->last_epoch = ev_now(r->loop);
+  __atomic_store_n(&r->ready, true, __ATOMIC_RELEASE);
+  timerfd_start(r);
+}
+
+
+
+/* A single peer that cannot be found is a mistake, one of many targets
+ * being down, or the one peer going away later, is what we are here to
+ * report */
+static void rate_dialled(
+    struct dial *d,
+    int fd)
+{
+  struct rate_data *r = d->data;
+
+  if (fd < 0) {
+    if (!r->connected && !r->c->ntargets)
+      exit(EXIT_FAILURE);
+    return;
   }
 
-  ev_io_start(EV_DEFAULT_ &rate.w);
+  if (r->c->connect_rate) {
+    rate_handshake_start(r, fd);
+    return;
+  }
+
+  r->fd = fd;
+  r->connected = true;
+  if (r->lost_at > 0.) {
+    r->reconnect_s = ev_now(r->loop) - r->lost_at;
+    r->lost_at = 0.;
+  }
+  rate_established(r);
+}
+
+
+
+static void rate_reconnect(
+    struct rate_data *r)
+{
+  rate_uring_stop(r);
+  close(r->fd);
+  r->fd = -1;
+  ev_io_stop(r->loop, &r->w);
+  timerfd_stop(r);
+
+  if (r->ready && r->lost_at == 0.)
+    r->lost_at = ev_now(r->loop);
+  __atomic_store_n(&r->ready, false, __ATOMIC_RELEASE);
+  dial_start(&r->dial);
 }
 
 
 void rate_stop(
     void)
 {
-  ev_timer_stop(EV_DEFAULT_ &rate.t);
-  ev_io_stop(EV_DEFAULT_ &rate.w);
-  close(rate.fd);
+  int i, j;
+  struct worker *wk;
+  struct rate_data *r;
+
+  /* A listener's workers may have made streams of their own */
+  for (i=0; i < worker_count(); i++) {
+    wk = worker_get(i);
+    for (j=0; j < wk->nstreams; j++) {
+      r = wk->streams[j];
+      dial_cancel(&r->dial);
+      handshaker_free(r->hs);
+      r->hs = NULL;
+      ev_io_stop(r->loop, &r->w);
+      timerfd_stop(r);
+      if (r->fd > -1)
+        close(r->fd);
+    }
+  }
 }
 
 
 
-void rate_listener(
+static void rate_listener(
     void)
 {
-  rate.ready = false;
-  received_bytes = 0;
-  rate.c = config_get();
-  rate.fd = -1;
-  rate.sfd = tcp_listener(rate.c->port);
-  if (rate.sfd < 0)
-    err(EXIT_FAILURE, "Cannot listen on port");
-  ev_init(&rate.w, rate_listen);
-  ev_init(&rate.tfdw, pps_limit);
-  rate.t.data = &rate;
-  rate.w.data = &rate;
-  rate.tfdw.data = &rate;
-  ev_io_set(&rate.w, rate.sfd, EV_READ);
-  last_epoch = ev_now(EV_DEFAULT);
-  ev_io_start(EV_DEFAULT_ &rate.w);
+  int i;
+  struct worker *wk;
+
+  for (i=0; i < worker_count(); i++) {
+    wk = worker_get(i);
+    wk->sfd = sock_listener(rates.c->port, rates.c->udp ? SOCK_DGRAM : SOCK_STREAM, SOMAXCONN);
+    if (wk->sfd < 0)
+      err(EXIT_FAILURE, "Cannot listen on port");
+    if (rates.c->udp_gso && setsockopt(wk->sfd, SOL_UDP, UDP_GRO, &(int){1}, sizeof(int)) < 0)
+      warn("Cannot enable UDP_GRO, receiving datagrams one at a time");
+    if (rates.c->fastopen &&
+        setsockopt(wk->sfd, IPPROTO_TCP, TCP_FASTOPEN, &(int){SOMAXCONN}, sizeof(int)) < 0)
+      warn("Cannot enable TCP_FASTOPEN, handshakes will not carry data");
+    if (rates.c->connect_rate) {
+      wk->hold = handshake_hold_new(wk->loop, wk->sfd);
+      continue;
+    }
+    ev_io_init(&wk->lw, rates.c->udp ? rate_udp_listen : rate_listen, wk->sfd, EV_READ);
+    wk->lw.data = wk;
+    ev_io_start(wk->loop, &wk->lw);
+  }
 }
 
 
 
-void rate_connector(
+static void rate_connector(
     void)
 {
+  int i;
+
+  for (i=0; i < rates.nstreams; i++)
+    dial_start(&rates.streams[i].dial);
+}
+
+
+
+static void rate_set_pacing(
+    struct rate_data *r,
+    int64_t rate)
+{
+  r->rate = rate;
+  if (r->c->burst > 0.) {
+    r->tick = r->c->burst;
+    r->bytes_per_tick = (double)rate * r->c->burst;
+  }
+  else if (r->c->connect_rate) {
+    r->tick = 1. / rate;
+    r->bytes_per_tick = 1.;
+  }
+  else {
+    r->tick = (double)r->c->write_size / rate;
+    r->bytes_per_tick = r->c->write_size;
+  }
+  r->tick_ns = llround(r->tick * BILLION);
+}
+
+
+
+/* A new rate on a stream that may already be sending. A stream that is
+ * not connected picks it up when it is */
+static void rate_repace(
+    struct rate_data *r,
+    int64_t rate)
+{
+  rate_set_pacing(r, rate);
+  if (r->fd < 0 || !r->ready)
+    return;
+
+  if (r->c->engine == ENGINE_URING)
+    r->ur_interval = r->tick_ns;
+  else if (r->c->pacing == PACING_KERNEL)
+    rate_kernel_pacing(r);
+  else {
+    timerfd_stop(r);
+    timerfd_start(r);
+  }
+}
+
+
+
+void rate_retarget(
+    int64_t rate)
+{
+  __atomic_store_n(&rates.rate, rate, __ATOMIC_RELAXED);
+}
+
+
+
+/* Every target costs a socket and a timerfd, and a pipe when splicing.
+ * Handshakes still going cost a socket each */
+static void rate_raise_nofile(
+    int nstreams,
+    int64_t nhandshakes)
+{
+  struct rlimit rl;
+  rlim_t want = nstreams * 4 + nhandshakes + 64;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+    err(EXIT_FAILURE, "getrlimit");
+  if (rl.rlim_cur >= want)
+    return;
+
+  rl.rlim_cur = MIN(want, rl.rlim_max);
+  if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+    err(EXIT_FAILURE, "setrlimit");
+  if (rl.rlim_cur < want)
+    warnx("Only %lu file descriptors are allowed, %d streams may need %lu",
+          (unsigned long)rl.rlim_cur, nstreams, (unsigned long)want);
+}
+
+
+
+/* Everything a stream needs before it first connects or is handed a
+ * client, on the worker it will run on */
+static void rate_stream_init(
+    struct rate_data *r,
+    struct worker *wk,
+    int id)
+{
+  struct configuration *c = rates.c;
+
+  r->id = id;
+  r->fd = -1;
+  r->tfd = -1;
+  r->c = c;
+  r->wk = wk;
+  if (c->ntargets) {
+    r->host = c->targets[id].host;
+    r->port = c->targets[id].port;
+    rate_set_pacing(r, c->targets[id].rate);
+  }
+  else if (c->profile) {
+    r->host = c->hostname;
+    r->port = c->port;
+    rate_set_pacing(r, MAX(llround(c->profile->peak / c->streams), 1));
+  }
+  else if (c->connect_rate) {
+    r->host = c->hostname;
+    r->port = c->port;
+    rate_set_pacing(r, c->connect_rate / c->streams);
+  }
+  else {
+    r->host = c->hostname;
+    r->port = c->port;
+    rate_set_pacing(r, c->rate_per_second / c->streams);
+  }
+  r->loop = wk->loop;
+  r->ready = false;
+  r->counted_bytes = 0;
+  r->last_epoch = ev_now(r->loop);
 
-  rate.c = config_get();
-  rate.fd = tcp_connect(rate.c->hostname, rate.c->port);
-  if (rate.fd < 0)
-    exit(EXIT_FAILURE);
+  r->pipefd[0] = r->pipefd[1] = -1;
 
-  rate.ready = false;
-  received_bytes = 0;
-  rate.t.data = &rate;
-  rate.w.data = &rate; 
-  rate.tfdw.data = &rate;
-  ev_init(&rate.tfdw, pps_limit);
+  ev_init(&r->w, rate_sendrecv);
+  ev_init(&r->tfdw, pps_limit);
   /* Try to always check the timer before the socket */
-  ev_set_priority(&rate.tfdw, 1);
-  if (errno == EINPROGRESS) {
-    ev_init(&rate.w, rate_connect);
-    ev_init(&rate.t, connect_timeout);
-    ev_io_set(&rate.w, rate.fd, EV_WRITE);
-    ev_timer_set(&rate.t, CONNECT_TIMEOUT, 0.);
-    ev_timer_start(EV_DEFAULT_ &rate.t);
+  ev_set_priority(&r->tfdw, 1);
+  r->w.data = r;
+  r->tfdw.data = r;
+}
+
+
+
+void rate_init(
+    void)
+{
+  int i;
+  unsigned nbufs;
+  long port;
+  char *p;
+  struct rate_data *r;
+  struct worker *wk;
+  struct configuration *c = config_get();
+
+  rates.c = c;
+  rates.rate = c->connect_rate ? c->connect_rate : c->rate_per_second;
+  if (c->profile)
+    profile_start(c->profile, monotonic_ns());
+  /* A listener starts with a slot for every client it may serve at once,
+   * dealt out over the workers like any streams */
+  rates.nstreams = c->listener ? c->clients : c->streams;
+  rates.nslots = rates.nstreams;
+  rates.streams = calloc(sizeof(struct rate_data), rates.nstreams);
+  assert(rates.streams);
+
+  worker_init(c->threads);
+  payload_init(c->write_size);
+  rate_raise_nofile(rates.nstreams, c->connect_rate * HANDSHAKE_TIMEOUT);
+
+  /* Streams on a worker never read at the same time so can share one
+   * buffer. Bound the io_uring buffer ring to the same memory however
+   * large the reads */
+  for (i=0; i < worker_count() && c->rx_mode == RX_COPY; i++) {
+    wk = worker_get(i);
+    wk->rxbuf = malloc(c->read_size);
+    assert(wk->rxbuf);
+  }
+  for (i=0; i < worker_count() && c->udp; i++)
+    worker_get(i)->udp = udp_batch_new(c->udp_gso);
+  for (nbufs = URING_NBUFS; nbufs > 4 && nbufs * c->read_size > URING_BUF_BYTES; nbufs >>= 1);
+
+  /* Every stream on a worker samples at the same moment, a dump is good
+   * for half a sample so they all share it. The dump holds every
+   * connection on the port, not just the worker's, so each table is
+   * sized for all of them */
+  for (i=0; i < worker_count() && c->diag; i++) {
+    port = strtol(c->port, &p, 10);
+    if (*p || port < 1 || port > 65535)
+      errx(EXIT_FAILURE, "--diag needs a numeric port, not %s", c->port);
+    worker_get(i)->diag = diag_new(port, c->listener, rates.nstreams, c->stats_frequency / 2);
+  }
+
+  rates.devnull = -1;
+  if (c->rx_mode == RX_SPLICE) {
+    rates.devnull = open("/dev/null", O_WRONLY|O_CLOEXEC);
+    if (rates.devnull < 0)
+      err(EXIT_FAILURE, "Cannot open /dev/null");
+  }
+
+  if (c->engine == ENGINE_URING) {
+    for (i=0; i < worker_count(); i++) {
+      wk = worker_get(i);
+      wk->ring = uring_new(URING_ENTRIES);
+      uring_setup_buffers(wk->ring, URING_BGID, nbufs, c->read_size);
+      ev_io_init(&wk->uw, rate_uring_complete, uring_fd(wk->ring), EV_READ);
+      ev_prepare_init(&wk->up, rate_uring_flush);
+      wk->uw.data = wk;
+      wk->up.data = wk;
+      ev_io_start(wk->loop, &wk->uw);
+      ev_prepare_start(wk->loop, &wk->up);
+    }
+  }
+
+  for (i=0; i < rates.nstreams; i++) {
+    r = &rates.streams[i];
+    wk = worker_get(i % worker_count());
+    worker_add_stream(wk, r);
+
+    rate_stream_init(r, wk, i);
+
+    /* Listeners only get stats when a client connects */
+    if (c->listener)
+      continue;
+
+    dial_init(&r->dial, r->loop, r->host, r->port, c->udp ? SOCK_DGRAM : SOCK_STREAM, rate_dialled, r);
+    r->stats = stats_new(r->loop, r->rate, rate_update_stats, r);
+    if (c->ntargets)
+      stats_set_tag(r->stats, "%s:%s", r->host, r->port);
+    else if (rates.nstreams > 1)
+      stats_set_tag(r->stats, "%s:%s#%d", c->hostname ? c->hostname : "*", c->port, i);
+    else
+      stats_set_tag(r->stats, "%s:%s", c->hostname ? c->hostname : "*", c->port);
   }
-  else if (errno == 0) {
-    rate.ready = true;
-    received_bytes = 0;
-    ev_init(&rate.w, rate_sendrecv);
-    ev_init(&rate.tfdw, pps_limit);
-    timerfd_start();
-    ev_io_set(&rate.w, rate.fd, EV_READ|EV_WRITE);
+
+  /* Separate targets or clients are judged on their own, summing them
+   * means nothing */
+  if (rates.nstreams > 1 && !c->ntargets && !c->listener) {
+    rates.last_epoch = ev_now(EV_DEFAULT);
+    rates.stats = stats_new(EV_DEFAULT_ c->rate_per_second, rate_aggregate_stats, NULL);
+    stats_set_tag(rates.stats, "%s:%s (%d streams)", c->hostname ? c->hostname : "*",
+                  c->port, rates.nstreams);
   }
-  rate.t.data = &rate;
-  rate.w.data = &rate;
-  last_epoch = ev_now(EV_DEFAULT);
-  ev_io_start(EV_DEFAULT_ &rate.w);
+
+  /* Judged on the aggregate where there is one */
+  if (c->search_floor)
+    search_start(rates.stats ? rates.stats : rates.streams[0].stats, c->search_floor, c->rate_per_second);
+
+  if (c->listener)
+    rate_listener();
+  else
+    rate_connector();
+}
+
+
+
+/* What held the connection back over the sample. The receive window
+ * and send buffer limits are timed by the kernel. Otherwise the kernel
+ * flags its delivery rate samples as app limited when cwnd was not full,
+ * and with cwnd full and data queued behind it the path is the limit */
+static stat_limit_t rate_classify(
+    stat_record_t *s,
+    double interval)
+{
+  double us = interval * MILLION;
+
+  if (s->busy_us == 0 && s->bytes_acked == 0)
+    return LIMIT_UNKNOWN;
+  if (s->rwnd_limited_us * 2 > us)
+    return LIMIT_RWND;
+  if (s->sndbuf_limited_us * 2 > us)
+    return LIMIT_SNDBUF;
+  if (!s->app_limited && s->notsent_bytes > 0)
+    return LIMIT_NETWORK;
+  return LIMIT_APP;
+}
+
+
+
+/* How the pacer did over the sample, then start counting afresh */
+static void rate_pacing_sample(
+    struct rate_data *r,
+    stat_record_t *s,
+    double interval)
+{
+  s->tx_bps = r->sent_bytes / interval;
+  /* A UDP listener sends nothing but reports, it has no target */
+  if (r->c->udp && r->c->listener)
+    s->target_bps = 0.;
+  else
+    s->target_bps = r->c->profile ? rate_profile_target(interval, r->c->streams) : r->rate;
+  s->ticks = r->ticks;
+  s->overruns = r->overruns;
+  s->skipped = r->skipped;
+  s->stalls = r->stalls;
+  s->lateness_max_us = r->lateness_max_us;
+  __atomic_add_fetch(&r->acc_sent, r->sent_bytes, __ATOMIC_RELAXED);
+  r->sent_bytes = 0;
+  r->ticks = r->overruns = r->skipped = r->stalls = r->lateness_max_us = 0;
+}
+
+
+
+/* The receiver counts what arrives and reports it back, the sender
+ * takes the same counts and the round trip time from those reports.
+ * A sender that has heard nothing lately has nothing to measure */
+static int rate_udp_stats(
+    struct rate_data *r,
+    stat_record_t *s,
+    double now)
+{
+  struct udp_counts cur;
+  struct udp_report rep;
+  double interval = now - r->last_epoch;
+
+  if (r->c->listener) {
+    cur = r->urx.counts;
+    frame_delay_sample(&r->urx.delay, &s->delay_us, &s->jitter_us);
+    s->latency_us = s->delay_us;
+    udp_report_make(&r->urx, &rep, realtime_ns());
+    send(r->fd, &rep, sizeof(rep), MSG_DONTWAIT|MSG_NOSIGNAL);
+  }
+  else if (now - r->urep_at > r->c->stats_frequency * 3) {
+    rate_pacing_sample(r, s, interval);
+    r->last_epoch = now;
+    return 0;
+  }
+  else {
+    cur.received = r->urep.received;
+    cur.lost = r->urep.lost;
+    cur.reordered = r->urep.reordered;
+    cur.duplicates = r->urep.duplicates;
+    cur.bytes = r->urep.bytes;
+    s->latency_us = r->urtt_us;
+    s->delay_us = r->urep.delay_ns / 1000.;
+    s->jitter_us = r->urep.jitter_us;
+  }
+
+  r->latency_total += s->latency_us;
+  s->timestamp = now;
+  s->bps = (cur.bytes - r->ulast.bytes) / interval;
+  s->bytes_total = cur.bytes;
+  s->latency_total = r->latency_total;
+  s->datagrams = cur.received - r->ulast.received;
+  /* Loss found late comes off the total, it was counted when seen */
+  s->lost = cur.lost > r->ulast.lost ? cur.lost - r->ulast.lost : 0;
+  s->reordered = cur.reordered - r->ulast.reordered;
+  s->duplicates = cur.duplicates - r->ulast.duplicates;
+  s->limit = LIMIT_UNKNOWN;
+  rate_pacing_sample(r, s, interval);
+
+  __atomic_add_fetch(&r->acc_bytes, cur.bytes - r->ulast.bytes, __ATOMIC_RELAXED);
+  __atomic_store_n(&r->rtt_us, MAX(lround(s->latency_us), 0), __ATOMIC_RELAXED);
+  __atomic_store_n(&r->delay_us, lround(s->delay_us), __ATOMIC_RELAXED);
+  __atomic_store_n(&r->jitter_us, lround(s->jitter_us), __ATOMIC_RELAXED);
+
+  s->reconnect_s = r->reconnect_s;
+  r->reconnect_s = 0.;
+  r->ulast = cur;
+  r->last_epoch = now;
+  return 1;
+}
+
+
+
+/* Connects stand in for bytes and handshake times for round trips, so
+ * the detector fits the totals as it would a transfer's. A sample where
+ * nothing connected has measured nothing, the peer is down */
+static int rate_handshake_stats(
+    struct rate_data *r,
+    stat_record_t *s,
+    double now)
+{
+  struct handshake_counts hc;
+  double interval = now - r->last_epoch;
+
+  if (!r->ready)
+    return 0;
+
+  handshaker_sample(r->hs, &hc);
+  rate_pacing_sample(r, s, interval);
+  r->last_epoch = now;
+  __atomic_add_fetch(&r->acc_failed, hc.failures, __ATOMIC_RELAXED);
+  if (hc.connects == 0)
+    return 0;
+
+  s->latency_us = hc.latency_ns / 1000. / hc.connects;
+  r->latency_total += s->latency_us;
+  r->counted_bytes += hc.connects;
+  s->timestamp = now;
+  s->bps = hc.connects / interval;
+  s->bytes_total = r->counted_bytes;
+  s->latency_total = r->latency_total;
+  s->connects = hc.connects;
+  s->connect_failures = hc.failures;
+  s->fastopens = hc.fastopens;
+  s->limit = LIMIT_UNKNOWN;
+
+  __atomic_add_fetch(&r->acc_bytes, hc.connects, __ATOMIC_RELAXED);
+  __atomic_store_n(&r->rtt_us, lround(s->latency_us), __ATOMIC_RELAXED);
+  return 1;
 }
 
 
 
 int rate_update_stats(
-    stat_record_t *s)
+    stat_record_t *s,
+    void *data)
 {
-  double now = ev_now(EV_DEFAULT);
+  struct rate_data *r = data;
+  double now;
   uint64_t bps;
-  uint64_t total;
   struct tcp_info tcpi;
+  struct tcp_info *last = &r->last_tcpi;
   int tcpisz = sizeof(tcpi);
+  int64_t rate;
+  uint64_t bytes;
 
-  now = ev_now(EV_DEFAULT_UC);
+  now = ev_now(r->loop);
+
+  /* A search moves the rate from the stats thread */
+  if (r->c->search_floor) {
+    rate = MAX(__atomic_load_n(&rates.rate, __ATOMIC_RELAXED) / r->c->streams, 1);
+    if (rate != r->rate)
+      rate_repace(r, rate);
+  }
 
-  if (rate.fd < 0 || !rate.ready) {
+  /* Older kernels fill in less, leave what they don't know as zero */
+  memset(&tcpi, 0, sizeof(tcpi));
+
+  /* Datagrams have no goodbye, a peer gone quiet has gone */
+  if (r->c->udp && r->c->listener && r->fd > -1 && now - r->urx.arrived > CONNECT_TIMEOUT)
+    rate_relisten(r);
+
+  if (r->fd < 0 && r->c->listener) {
+    /* The client has gone, hand back its window and free the slot */
+    r->stats = NULL;
+    rate_unclaim(r);
+    return -1;
+  }
+  else if (r->c->connect_rate) {
+    return rate_handshake_stats(r, s, now);
+  }
+  else if (r->fd < 0 || !r->ready) {
     return 0;
   }
-  else if (rate.ready) {
-    if (getsockopt(rate.fd, IPPROTO_TCP, TCP_INFO, &tcpi, &tcpisz) < 0) {
-      if (errno == EBADF) 
+  else if (r->c->udp) {
+    return rate_udp_stats(r, s, now);
+  }
+  else if (!r->wk->diag || diag_tcp_info(r->wk->diag, now, r->cookie, &tcpi) < 0) {
+    if (getsockopt(r->fd, IPPROTO_TCP, TCP_INFO, &tcpi, &tcpisz) < 0) {
+      if (errno == EBADF)
         return 0;
       else
         err(EXIT_FAILURE, "getsockopt");
     }
   }
 
-  bps = (tcpi.tcpi_bytes_received - received_bytes) / (now - last_epoch);
-  latency_total += tcpi.tcpi_rtt;
+  bytes = r->c->search_floor ? tcpi.tcpi_bytes_acked : tcpi.tcpi_bytes_received;
+  bps = (bytes - r->counted_bytes) / (now - r->last_epoch);
+  r->latency_total += tcpi.tcpi_rtt;
   s->timestamp = now;
   s->bps = bps;
-  s->bytes_total = tcpi.tcpi_bytes_received;
+  s->bytes_total = bytes;
   s->latency_us = tcpi.tcpi_rtt;
-  s->latency_total = latency_total;
+  s->latency_total = r->latency_total;
+
+  s->retransmits = tcpi.tcpi_total_retrans - last->tcpi_total_retrans;
+  s->cwnd = tcpi.tcpi_snd_cwnd;
+  s->ssthresh = tcpi.tcpi_snd_ssthresh;
+  s->notsent_bytes = tcpi.tcpi_notsent_bytes;
+  s->delivery_rate = tcpi.tcpi_delivery_rate;
+  s->pacing_rate = tcpi.tcpi_pacing_rate;
+  s->bytes_acked = tcpi.tcpi_bytes_acked - last->tcpi_bytes_acked;
+  s->busy_us = tcpi.tcpi_busy_time - last->tcpi_busy_time;
+  s->rwnd_limited_us = tcpi.tcpi_rwnd_limited - last->tcpi_rwnd_limited;
+  s->sndbuf_limited_us = tcpi.tcpi_sndbuf_limited - last->tcpi_sndbuf_limited;
+  s->app_limited = tcpi.tcpi_delivery_rate_app_limited;
+  s->limit = rate_classify(s, now - r->last_epoch);
+  *last = tcpi;
+
+  rate_pacing_sample(r, s, now - r->last_epoch);
+
+  if (r->c->framed) {
+    frame_delay_sample(&r->frx.delay, &s->delay_us, &s->jitter_us);
+    __atomic_store_n(&r->delay_us, lround(s->delay_us), __ATOMIC_RELAXED);
+    __atomic_store_n(&r->jitter_us, lround(s->jitter_us), __ATOMIC_RELAXED);
+  }
+
+  __atomic_add_fetch(&r->acc_bytes, bytes - r->counted_bytes, __ATOMIC_RELAXED);
+  __atomic_store_n(&r->rtt_us, tcpi.tcpi_rtt, __ATOMIC_RELAXED);
+
+  s->reconnect_s = r->reconnect_s;
+  r->reconnect_s = 0.;
+  r->counted_bytes = bytes;
+  r->last_epoch = now;
+  return 1;
+}
+
+
+
+/* Sums what every stream last published, runs on the default loop */
+int rate_aggregate_stats(
+    stat_record_t *s,
+    void *data)
+{
+  double now = ev_now(EV_DEFAULT);
+  uint64_t total = 0, sent = 0, failed = 0;
+  double rtt = 0.;
+  double delay = 0., jitter = 0.;
+  int i, nready = 0;
+  struct rate_data *r;
+
+  for (i=0; i < rates.nstreams; i++) {
+    r = &rates.streams[i];
+    total += __atomic_load_n(&r->acc_bytes, __ATOMIC_RELAXED);
+    sent += __atomic_load_n(&r->acc_sent, __ATOMIC_RELAXED);
+    failed += __atomic_load_n(&r->acc_failed, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&r->ready, __ATOMIC_ACQUIRE)) {
+      rtt += __atomic_load_n(&r->rtt_us, __ATOMIC_RELAXED);
+      delay += __atomic_load_n(&r->delay_us, __ATOMIC_RELAXED);
+      jitter += __atomic_load_n(&r->jitter_us, __ATOMIC_RELAXED);
+      nready++;
+    }
+  }
+
+  if (nready == 0) {
+    rates.acc_bytes = total;
+    rates.acc_sent = sent;
+    rates.acc_failed = failed;
+    rates.last_epoch = now;
+    return 0;
+  }
+
+  rtt /= nready;
+  rates.latency_total += rtt;
+  s->timestamp = now;
+  s->bps = (total - rates.acc_bytes) / (now - rates.last_epoch);
+  s->bytes_total = total;
+  s->latency_us = rtt;
+  s->latency_total = rates.latency_total;
+  s->delay_us = delay / nready;
+  s->jitter_us = jitter / nready;
+  s->tx_bps = (sent - rates.acc_sent) / (now - rates.last_epoch);
+  if (rates.c->profile)
+    s->target_bps = rate_profile_target(now - rates.last_epoch, 1);
+  else
+    s->target_bps = __atomic_load_n(&rates.rate, __ATOMIC_RELAXED);
+  if (rates.c->connect_rate) {
+    s->connects = total - rates.acc_bytes;
+    s->connect_failures = failed - rates.acc_failed;
+  }
 
-  received_bytes = tcpi.tcpi_bytes_received;
-  last_epoch = now;
+  rates.acc_bytes = total;
+  rates.acc_sent = sent;
+  rates.acc_failed = failed;
+  rates.last_epoch = now;
   return 1;
 }
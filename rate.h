@@ -2,9 +2,14 @@
 #define _RATE_H_
 #include "stats.h"
 
-void rate_listener(void);
-void rate_connector(void);
+struct rate_data;
+
+void rate_init(void);
 void rate_stop(void);
-int rate_update_stats(stat_record_t *s);
+int rate_update_stats(stat_record_t *s, void *data);
+int rate_aggregate_stats(stat_record_t *s, void *data);
+/* Sets the total rate to a single peer from any thread, every stream
+ * takes up its share at its next sample */
+void rate_retarget(int64_t rate);
 
 #endif
@@ -0,0 +1,170 @@
+#include "common.h"
+#include "recfile.h"
+#include <getopt.h>
+#include <inttypes.h>
+
+/* Exports a range of a tcpxfer recording as CSV. The ring is written in
+ * time order, give or take streams on different threads, so the start of
+ * the range is found by bisection and the rest read straight through */
+
+#define READ_SLACK 1.0
+
+static const char *state_str[] = { "", "disconnected", "connected" };
+static const char *limit_str[] = { "", "application", "network", "rwnd", "sndbuf" };
+
+static inline void print_usage(
+    void)
+{
+  printf("Usage: tcpxfer-read [OPTIONS] FILE\n");
+}
+
+static inline void print_help(
+    void)
+{
+  printf(
+"Export the samples in a tcpxfer recording as CSV.\n\n"
+"OPTIONS\n"
+"    --help                -h           Print this help\n"
+"    --from                -f TIME      Only samples from TIME on\n"
+"    --to                  -t TIME      Only samples up to TIME\n"
+"    --stream              -s TAG       Only samples of streams whose tag contains TAG\n"
+"    --streams             -l           List the streams in the recording instead\n"
+"\n"
+"TIME is seconds since the epoch or a local \"YYYY-MM-DD HH:MM:SS\".\n"
+"\n");
+}
+
+static char *strstamp(
+    double stamp,
+    char *buf,
+    size_t len)
+{
+  struct tm tm;
+  time_t t = floor(stamp);
+  long ms = lround((stamp - t) * 1000);
+  char str[32];
+
+  if (ms == 1000) {
+    t++;
+    ms = 0;
+  }
+  localtime_r(&t, &tm);
+  strftime(str, sizeof(str), "%Y-%m-%d %H:%M:%S", &tm);
+  snprintf(buf, len, "%s.%03ld", str, ms);
+  return buf;
+}
+
+int main(
+    int argc,
+    char **argv)
+{
+  int c, optidx;
+  struct recfile f;
+  const struct rec_entry *e;
+  uint64_t head, oldest, lo, hi, mid, idx;
+  double from = -INFINITY, to = INFINITY;
+  char *match = NULL;
+  bool list = false;
+  char stamp[64];
+  bool *wanted;
+  uint32_t i;
+
+  static struct option long_options[] = {
+    { "help",    no_argument,       NULL, 'h' },
+    { "from",    required_argument, NULL, 'f' },
+    { "to",      required_argument, NULL, 't' },
+    { "stream",  required_argument, NULL, 's' },
+    { "streams", no_argument,       NULL, 'l' },
+    {  0,        0,                 0,     0  },
+  };
+
+  while ((c = getopt_long(argc, argv, "hf:t:s:l", long_options, &optidx)) != -1) {
+    switch (c) {
+    case 'f':
+      from = recfile_parse_time(optarg);
+    break;
+
+    case 't':
+      to = recfile_parse_time(optarg);
+    break;
+
+    case 's':
+      match = optarg;
+    break;
+
+    case 'l':
+      list = true;
+    break;
+
+    default:
+      print_usage();
+      print_help();
+      exit(1);
+    break;
+    }
+  }
+
+  if (argv[optind] == NULL) {
+    print_usage();
+    exit(1);
+  }
+
+  recfile_open(argv[optind], &f);
+
+  if (list) {
+    for (i=0; i < f.ntags; i++)
+      printf("%.*s\n", REC_TAG_SZ, f.tags + i * REC_TAG_SZ);
+    exit(0);
+  }
+
+  wanted = calloc(REC_TAGS + 1, sizeof(bool));
+  assert(wanted);
+  for (i=0; i < f.ntags; i++)
+    wanted[i] = !match || strstr(f.tags + i * REC_TAG_SZ, match);
+
+  head = __atomic_load_n(&f.hdr->head, __ATOMIC_ACQUIRE);
+  oldest = head > f.hdr->capacity ? head - f.hdr->capacity : 0;
+
+  /* First sample at or after the start, allowing for a little disorder */
+  lo = oldest;
+  hi = head;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    e = recfile_entry(&f, mid);
+    if (e && e->timestamp < from - READ_SLACK)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  printf("epoch,time,stream,state,limit,bps,latency_us,delay_us,jitter_us,bytes_total,retransmits,"
+         "cwnd,ssthresh,notsent_bytes,delivery_rate,pacing_rate,bytes_acked,busy_us,"
+         "rwnd_limited_us,sndbuf_limited_us,tx_bps,target_bps,ticks,overruns,skipped,stalls,"
+         "lateness_max_us,datagrams,lost,reordered,duplicates,reconnect_ms,connects,connect_failures,fastopens\n");
+
+  for (idx = lo; idx < head; idx++) {
+    e = recfile_entry(&f, idx);
+    if (!e)
+      continue;
+    if (e->timestamp > to + READ_SLACK)
+      break;
+    if (e->timestamp < from || e->timestamp > to)
+      continue;
+    if (e->tag == REC_TAG_NONE ? match != NULL : e->tag >= f.ntags || !wanted[e->tag])
+      continue;
+
+    printf("%.3f,%s,%.*s,%s,%s,%.0f,%.0f,%.0f,%.0f,%" PRIu64 ",%u,%u,%u,%u,%" PRIu64 ",%" PRIu64 ",%"
+           PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.0f,%.0f,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u\n",
+           e->timestamp, strstamp(e->timestamp, stamp, sizeof(stamp)),
+           REC_TAG_SZ, e->tag < f.ntags ? f.tags + e->tag * REC_TAG_SZ : "",
+           e->state < 3 ? state_str[e->state] : "", e->limit < 5 ? limit_str[e->limit] : "",
+           e->bps, e->latency_us, e->delay_us, e->jitter_us, e->bytes_total,
+           e->retransmits, e->cwnd, e->ssthresh, e->notsent_bytes, e->delivery_rate,
+           e->pacing_rate, e->bytes_acked, e->busy_us, e->rwnd_limited_us, e->sndbuf_limited_us,
+           e->tx_bps, e->target_bps, e->ticks, e->overruns, e->skipped, e->stalls, e->lateness_max_us,
+           e->datagrams, e->lost, e->reordered, e->duplicates, e->reconnect_ms,
+           e->connects, e->connect_failures, e->fastopens);
+  }
+
+  return 0;
+}
@@ -0,0 +1,195 @@
+#include "common.h"
+#include "realtime.h"
+#include "config.h"
+#include "hist.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+/* Keeping the host out of the measurement. Every thread is pinned,
+ * scheduled SCHED_FIFO and given the least timer slack the kernel
+ * allows, memory is locked so a page fault never lands in the pacer, and
+ * sockets busy poll rather than wait on the interrupt. None of it is
+ * fatal, a box that refuses is reported and the run carries on */
+
+static bool warned_busy_poll = false;
+
+
+
+/* The shortest pacing tick any stream runs at */
+static double realtime_tick(
+    struct configuration *c)
+{
+  int64_t rate = c->rate_per_second / c->streams;
+  int i;
+
+  if (c->burst > 0.)
+    return c->burst;
+  for (i=0; i < c->ntargets; i++)
+    rate = MAX(rate, c->targets[i].rate);
+  return (double)c->write_size / rate;
+}
+
+
+
+/* Wake on a timerfd for a while and see how late the wakeups are, with
+ * the settings the worker threads will get */
+static void realtime_selfcheck(
+    struct configuration *c)
+{
+  static const double q[] = { .5, .99, .999, 1. };
+  struct itimerspec its;
+  struct hist *h;
+  int64_t interval = RT_CHECK_INTERVAL * BILLION;
+  int64_t deadline, now;
+  uint64_t overs, overruns = 0;
+  double p[4], tick;
+  int fd, i;
+
+  h = hist_new(HIST_SUB_BITS);
+
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (fd < 0)
+    err(EXIT_FAILURE, "timerfd_create");
+
+  deadline = monotonic_ns() + interval;
+  its.it_value.tv_sec = deadline / BILLION;
+  its.it_value.tv_nsec = deadline % BILLION;
+  its.it_interval.tv_sec = 0;
+  its.it_interval.tv_nsec = interval;
+  if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+    err(EXIT_FAILURE, "timerfd_settime");
+
+  for (i=0; i < RT_CHECK_WAKEUPS; i++) {
+    if (read(fd, &overs, sizeof(overs)) != sizeof(overs))
+      err(EXIT_FAILURE, "timerfd()->read()");
+    now = monotonic_ns();
+    deadline += (overs - 1) * interval;
+    hist_record(h, MIN(now - deadline, UINT32_MAX));
+    deadline += interval;
+    overruns += overs - 1;
+  }
+  close(fd);
+
+  hist_percentiles(h, q, p, 4);
+  printf("Timer jitter over %d wakeups: p50/p99/p99.9/max %.1f/%.1f/%.1f/%.1fus, %" PRIu64 " overruns\n",
+         RT_CHECK_WAKEUPS, p[0]/1000, p[1]/1000, p[2]/1000, p[3]/1000, overruns);
+  fflush(stdout);
+
+  tick = realtime_tick(c);
+  if (p[1] > tick * BILLION / 2)
+    warnx("Timer jitter is over half the %.1fus pacing tick, throughput dips may be this host",
+          tick * MILLION);
+  free(h);
+}
+
+
+
+/* Process wide settings, then the main thread's, then the self-check.
+ * Must run before any worker threads start */
+void realtime_init(
+    void)
+{
+  struct configuration *c = config_get();
+
+  if (c->realtime && mlockall(MCL_CURRENT|MCL_FUTURE) < 0)
+    warn("Cannot lock memory, page faults may stall the pacer (raise RLIMIT_MEMLOCK)");
+
+  realtime_thread(0);
+  if (c->realtime)
+    realtime_selfcheck(c);
+}
+
+
+
+/* Applies to the calling thread, worker id runs on the id'th CPU given */
+void realtime_thread(
+    int id)
+{
+  struct configuration *c = config_get();
+  struct sched_param sp;
+  cpu_set_t set;
+  int cpu, rc;
+
+  if (c->ncpus) {
+    cpu = c->cpus[id % c->ncpus];
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc) {
+      errno = rc;
+      warn("Cannot pin thread %d to CPU %d", id, cpu);
+    }
+  }
+
+  if (!c->realtime)
+    return;
+
+  /* Zero would mean the default, one nanosecond is the least there is */
+  if (prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0) < 0)
+    warn("Cannot set the timer slack of thread %d", id);
+
+  memset(&sp, 0, sizeof(sp));
+  sp.sched_priority = c->rt_priority;
+  rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+  if (rc) {
+    errno = rc;
+    warn("Cannot run thread %d SCHED_FIFO at priority %d (needs CAP_SYS_NICE or RLIMIT_RTPRIO)",
+         id, c->rt_priority);
+  }
+}
+
+
+
+/* For threads off the data path, which would otherwise inherit the main
+ * thread's settings. Ordinary scheduling, and any CPU but those the
+ * workers are pinned to where that leaves any */
+void realtime_background(
+    void)
+{
+  struct configuration *c = config_get();
+  struct sched_param sp;
+  cpu_set_t set;
+  int i, rc, n = MIN(CPU_SETSIZE, sysconf(_SC_NPROCESSORS_CONF));
+
+  if (c->ncpus) {
+    CPU_ZERO(&set);
+    for (i=0; i < n; i++)
+      CPU_SET(i, &set);
+    for (i=0; i < c->ncpus; i++)
+      CPU_CLR(c->cpus[i], &set);
+    if (CPU_COUNT(&set) == 0)
+      for (i=0; i < c->ncpus; i++)
+        CPU_SET(c->cpus[i], &set);
+    rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc) {
+      errno = rc;
+      warn("Cannot move a background thread off the workers' CPUs");
+    }
+  }
+
+  if (!c->realtime)
+    return;
+  memset(&sp, 0, sizeof(sp));
+  rc = pthread_setschedparam(pthread_self(), SCHED_OTHER, &sp);
+  if (rc) {
+    errno = rc;
+    warn("Cannot drop a background thread to ordinary scheduling");
+  }
+}
+
+
+
+void realtime_socket(
+    int fd)
+{
+  int usecs = config_get()->busy_poll;
+
+  if (usecs == 0)
+    return;
+  if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0 &&
+      !__atomic_exchange_n(&warned_busy_poll, true, __ATOMIC_RELAXED))
+    warn("Cannot busy poll sockets for %dus (needs CAP_NET_ADMIN above net.core.busy_read)", usecs);
+}
@@ -0,0 +1,13 @@
+#ifndef _REALTIME_H_
+#define _REALTIME_H_
+#include "common.h"
+
+/* The self-check wakes on a timerfd this often for this long */
+#define RT_CHECK_INTERVAL 0.0001
+#define RT_CHECK_WAKEUPS 5000
+
+void realtime_init(void);
+void realtime_thread(int id);
+void realtime_background(void);
+void realtime_socket(int fd);
+#endif
@@ -0,0 +1,64 @@
+#include "common.h"
+#include "recfile.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/* What tcpxfer-read and tcpxfer-replay share to read a recording back.
+ * The file stays mapped until the tool exits */
+
+void recfile_open(
+    const char *path,
+    struct recfile *f)
+{
+  struct stat sb;
+  void *p;
+  int fd;
+
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    err(EXIT_FAILURE, "Cannot open %s", path);
+  if (fstat(fd, &sb) < 0)
+    err(EXIT_FAILURE, "Cannot stat %s", path);
+  if (sb.st_size < REC_RING_OFFSET)
+    errx(EXIT_FAILURE, "%s is not a tcpxfer recording", path);
+
+  p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err(EXIT_FAILURE, "Cannot map %s", path);
+  close(fd);
+
+  f->hdr = p;
+  if (memcmp(f->hdr->magic, REC_MAGIC, sizeof(REC_MAGIC)) || f->hdr->version != REC_VERSION ||
+      f->hdr->rec_size != sizeof(struct rec_entry) || f->hdr->tag_size != REC_TAG_SZ ||
+      f->hdr->capacity == 0 ||
+      REC_RING_OFFSET + f->hdr->capacity * sizeof(struct rec_entry) > sb.st_size)
+    errx(EXIT_FAILURE, "%s is not a tcpxfer recording this version can read", path);
+
+  f->tags = (const char *)p + REC_TAGS_OFFSET;
+  f->ring = (const struct rec_entry *)((const char *)p + REC_RING_OFFSET);
+  f->ntags = MIN(__atomic_load_n(&f->hdr->ntags, __ATOMIC_ACQUIRE), REC_TAGS);
+}
+
+
+
+double recfile_parse_time(
+    const char *str)
+{
+  struct tm tm;
+  char *p;
+  double t;
+
+  errno = 0;
+  t = strtod(str, &p);
+  if (*p == 0 && errno == 0)
+    return t;
+
+  memset(&tm, 0, sizeof(tm));
+  p = strptime(str, "%Y-%m-%d %H:%M:%S", &tm);
+  if (!p)
+    p = strptime(str, "%Y-%m-%dT%H:%M:%S", &tm);
+  if (!p || *p)
+    errx(EXIT_FAILURE, "Time must be epoch seconds or YYYY-MM-DD HH:MM:SS, not %s", str);
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
@@ -0,0 +1,25 @@
+#ifndef _RECFILE_H_
+#define _RECFILE_H_
+#include "common.h"
+#include "recorder.h"
+
+/* A recording opened read only by the tools that read one back */
+struct recfile {
+  const struct rec_header *hdr;
+  const char *tags;
+  const struct rec_entry *ring;
+  uint32_t ntags;
+};
+
+void recfile_open(const char *path, struct recfile *f);
+double recfile_parse_time(const char *str);
+
+/* A slot is only good if it holds the sample that belongs at this index */
+static inline const struct rec_entry * recfile_entry(
+    const struct recfile *f,
+    uint64_t idx)
+{
+  const struct rec_entry *e = &f->ring[idx % f->hdr->capacity];
+  return __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) == idx + 1 ? e : NULL;
+}
+#endif
@@ -0,0 +1,178 @@
+#include "common.h"
+#include "recorder.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* Every sample of every stream, kept in a memory mapped ring file of
+ * bounded size. Appending is a slot claimed with an atomic add and a
+ * copy, the kernel writes the pages back in its own time. A recording
+ * with the same layout is carried on from where it stopped */
+
+static struct {
+  struct rec_header *hdr;
+  char *tags;
+  struct rec_entry *ring;
+  pthread_mutex_t lock;
+} rec = { NULL, NULL, NULL, PTHREAD_MUTEX_INITIALIZER };
+
+
+
+void recorder_init(
+    const char *path,
+    size_t size)
+{
+  struct rec_header *hdr;
+  struct stat sb;
+  uint64_t capacity;
+  void *p;
+  int fd;
+
+  assert(sizeof(struct rec_entry) == 192);
+  assert(sizeof(struct rec_header) <= REC_HDR_SZ);
+
+  capacity = (size - REC_RING_OFFSET) / sizeof(struct rec_entry);
+  size = REC_RING_OFFSET + capacity * sizeof(struct rec_entry);
+
+  fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+  if (fd < 0)
+    err(EXIT_FAILURE, "Cannot open recording %s", path);
+  if (fstat(fd, &sb) < 0)
+    err(EXIT_FAILURE, "Cannot stat recording %s", path);
+
+  if (sb.st_size != size && ftruncate(fd, size) < 0)
+    err(EXIT_FAILURE, "Cannot size recording %s", path);
+
+  p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err(EXIT_FAILURE, "Cannot map recording %s", path);
+  close(fd);
+
+  hdr = p;
+  if (sb.st_size != size || memcmp(hdr->magic, REC_MAGIC, sizeof(REC_MAGIC)) ||
+      hdr->version != REC_VERSION || hdr->rec_size != sizeof(struct rec_entry) ||
+      hdr->capacity != capacity || hdr->tag_size != REC_TAG_SZ) {
+    if (sb.st_size > 0)
+      warnx("%s is not a recording of this size, starting it afresh", path);
+    memset(p, 0, REC_RING_OFFSET);
+    memcpy(hdr->magic, REC_MAGIC, sizeof(REC_MAGIC));
+    hdr->version = REC_VERSION;
+    hdr->rec_size = sizeof(struct rec_entry);
+    hdr->capacity = capacity;
+    hdr->tag_size = REC_TAG_SZ;
+    hdr->head = 0;
+    hdr->ntags = 0;
+  }
+
+  rec.hdr = hdr;
+  rec.tags = (char *)p + REC_TAGS_OFFSET;
+  rec.ring = (struct rec_entry *)((char *)p + REC_RING_OFFSET);
+}
+
+
+
+bool recorder_enabled(
+    void)
+{
+  return rec.hdr != NULL;
+}
+
+
+
+/* The id of a stream's tag, the same tag always gets the same id so a
+ * stream keeps its id across reconnects and restarts */
+uint16_t recorder_tag(
+    const char *tag)
+{
+  uint32_t i, n;
+  uint16_t id = REC_TAG_NONE;
+  static bool warned = false;
+
+  pthread_mutex_lock(&rec.lock);
+  n = rec.hdr->ntags;
+  for (i=0; i < n; i++) {
+    if (strncmp(rec.tags + i * REC_TAG_SZ, tag, REC_TAG_SZ - 1) == 0) {
+      id = i;
+      goto out;
+    }
+  }
+
+  if (n >= REC_TAGS) {
+    if (!warned)
+      warnx("The recording has no room for more than %d streams, new ones are untagged", REC_TAGS);
+    warned = true;
+    goto out;
+  }
+
+  strncpy(rec.tags + n * REC_TAG_SZ, tag, REC_TAG_SZ - 1);
+  __atomic_store_n(&rec.hdr->ntags, n + 1, __ATOMIC_RELEASE);
+  id = n;
+
+out:
+  pthread_mutex_unlock(&rec.lock);
+  return id;
+}
+
+
+
+/* r is NULL for a sample where nothing could be measured, only the time
+ * and the state are kept */
+void recorder_append(
+    uint16_t tag,
+    double now,
+    stat_state_t state,
+    const stat_record_t *r)
+{
+  uint64_t seq = __atomic_fetch_add(&rec.hdr->head, 1, __ATOMIC_RELAXED);
+  struct rec_entry *e = &rec.ring[seq % rec.hdr->capacity];
+
+  /* Mark the slot as being written before touching it */
+  __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  if (!r) {
+    memset((char *)e + sizeof(e->seq), 0, sizeof(*e) - sizeof(e->seq));
+    e->timestamp = now;
+    e->tag = tag;
+    e->state = state;
+    goto out;
+  }
+
+  e->timestamp = r->timestamp;
+  e->tag = tag;
+  e->state = state;
+  e->limit = r->limit;
+  e->retransmits = r->retransmits;
+  e->bps = r->bps;
+  e->latency_us = r->latency_us;
+  e->delay_us = r->delay_us;
+  e->jitter_us = r->jitter_us;
+  e->bytes_total = r->bytes_total;
+  e->cwnd = r->cwnd;
+  e->ssthresh = r->ssthresh;
+  e->notsent_bytes = r->notsent_bytes;
+  e->lateness_max_us = r->lateness_max_us;
+  e->delivery_rate = r->delivery_rate;
+  e->pacing_rate = r->pacing_rate;
+  e->bytes_acked = r->bytes_acked;
+  e->busy_us = r->busy_us;
+  e->rwnd_limited_us = r->rwnd_limited_us;
+  e->sndbuf_limited_us = r->sndbuf_limited_us;
+  e->tx_bps = r->tx_bps;
+  e->target_bps = r->target_bps;
+  e->ticks = r->ticks;
+  e->overruns = r->overruns;
+  e->skipped = r->skipped;
+  e->stalls = r->stalls;
+  e->datagrams = r->datagrams;
+  e->lost = r->lost;
+  e->reordered = r->reordered;
+  e->duplicates = r->duplicates;
+  e->connects = r->connects;
+  e->connect_failures = r->connect_failures;
+  e->fastopens = r->fastopens;
+  e->reconnect_ms = MIN(lround(r->reconnect_s * 1000), UINT32_MAX);
+
+out:
+  __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+}
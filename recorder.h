@@ -0,0 +1,79 @@
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+#include "common.h"
+#include "stats.h"
+
+/* The recording is a header page, a table of stream tags and then a
+ * ring of fixed size records, all in host byte order. Writers claim a
+ * slot by bumping head and publish it by writing its seq last, so a
+ * reader can tell a slot that is being rewritten from a finished one */
+#define REC_MAGIC "TXFRREC"
+#define REC_VERSION 5
+#define REC_HDR_SZ 4096
+#define REC_TAGS 4096
+#define REC_TAG_SZ 64
+#define REC_TAG_NONE UINT16_MAX
+#define REC_DEFAULT_SZ (64 * 1048576)
+#define REC_MIN_SZ (1048576)
+
+struct rec_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t rec_size;
+  uint64_t capacity;
+  uint64_t head;
+  uint32_t ntags;
+  uint32_t tag_size;
+};
+
+struct rec_entry {
+  uint64_t seq;
+  double timestamp;
+  uint16_t tag;
+  uint8_t state;
+  uint8_t limit;
+  uint32_t retransmits;
+
+  double bps;
+  double latency_us;
+  double delay_us;
+  double jitter_us;
+  uint64_t bytes_total;
+
+  uint32_t cwnd;
+  uint32_t ssthresh;
+  uint32_t notsent_bytes;
+  uint32_t lateness_max_us;
+  uint64_t delivery_rate;
+  uint64_t pacing_rate;
+  uint64_t bytes_acked;
+  uint64_t busy_us;
+  uint64_t rwnd_limited_us;
+  uint64_t sndbuf_limited_us;
+
+  double tx_bps;
+  double target_bps;
+  uint32_t ticks;
+  uint32_t overruns;
+  uint32_t skipped;
+  uint32_t stalls;
+
+  uint32_t datagrams;
+  uint32_t lost;
+  uint32_t reordered;
+  uint32_t duplicates;
+
+  uint32_t reconnect_ms;
+  uint32_t connects;
+  uint32_t connect_failures;
+  uint32_t fastopens;
+};
+
+#define REC_TAGS_OFFSET REC_HDR_SZ
+#define REC_RING_OFFSET (REC_TAGS_OFFSET + REC_TAGS * REC_TAG_SZ)
+
+void recorder_init(const char *path, size_t size);
+bool recorder_enabled(void);
+uint16_t recorder_tag(const char *tag);
+void recorder_append(uint16_t tag, double now, stat_state_t state, const stat_record_t *r);
+#endif
@@ -0,0 +1,547 @@
+#include "common.h"
+#include "detector.h"
+#include "recfile.h"
+#include <getopt.h>
+#include <inttypes.h>
+
+/* Runs the congestion detector over a trace as fast as it will go and
+ * scores it. The trace is either a tcpxfer recording or made up here,
+ * a steady stream with impairments at known times. Given when the link
+ * was really impaired, every alert is checked against it: how long each
+ * impairment took to be noticed, which were missed and how often the
+ * detector alerted on a clear link. An impairment stays in the window for
+ * a window's length after it ends, so alerting then is not held against
+ * the detector, nor is anything before the first window has filled */
+
+#define MAX_EVENTS 65536
+
+struct event {
+  double start;
+  double end;
+};
+
+struct trace {
+  char tag[REC_TAG_SZ + 1];
+  size_t n;
+  size_t size;
+  stat_record_t *recs;
+  /* False where the sample measured nothing */
+  bool *measured;
+};
+
+struct score {
+  uint64_t samples;
+  uint64_t scored;
+  uint64_t clear;
+  uint64_t false_samples;
+  uint64_t false_alarms;
+  uint64_t alerting;
+  uint64_t detected;
+  uint64_t missed;
+  double delay_sum;
+  double delay_max;
+  double *delays;
+  double secs;
+};
+
+static struct event *events;
+static int nevents;
+
+static inline void print_usage(
+    void)
+{
+  printf("Usage: tcpxfer-replay [OPTIONS] [FILE]\n");
+}
+
+static inline void print_help(
+    void)
+{
+  printf(
+"Replay a tcpxfer recording, or a made up trace, through the congestion\n"
+"detector and score how it did.\n\n"
+"OPTIONS\n"
+"    --help                -h           Print this help\n"
+"    --sample              -i SECS      Interval between samples (%.1f)\n"
+"    --window              -w SECS      Length of the detector's window (%ld)\n"
+"    --stream              -s TAG       Only streams whose tag contains TAG\n"
+"    --events              -e FILE      When the link was really impaired, one \"START,END\" per line\n"
+"\n"
+"Without FILE a trace is made up instead:\n"
+"    --duration            -d SECS      Length of the trace (3600)\n"
+"    --rate                -r BPS       Throughput in bytes per second (1048576)\n"
+"    --latency             -L USECS     Latency (1000)\n"
+"    --noise               -N SHARE     Spread of each sample about the mean (0.02)\n"
+"    --impair              -I EVERY:LEN[:FACTOR]\n"
+"                                       Every EVERY seconds throughput drops to FACTOR\n"
+"                                       (0.1) of the rate for LEN seconds, and latency\n"
+"                                       rises by as much (600:30)\n"
+"    --seed                -S N         Seed for the noise (1)\n"
+"\n"
+"TIME is seconds since the epoch or a local \"YYYY-MM-DD HH:MM:SS\".\n"
+"\n", STATS_FREQUENCY, STATS_SECS);
+}
+
+static double parse_double(
+    const char *str,
+    const char *what,
+    double min,
+    double max)
+{
+  char *p;
+  double v;
+
+  errno = 0;
+  v = strtod(str, &p);
+  if (*p || errno || p == str || v < min || v > max)
+    errx(EXIT_FAILURE, "%s must be between %g and %g but was %s", what, min, max, str);
+  return v;
+}
+
+static void add_event(
+    double start,
+    double end)
+{
+  if (nevents == MAX_EVENTS)
+    errx(EXIT_FAILURE, "No more than %d impairments can be scored", MAX_EVENTS);
+  if (end <= start)
+    errx(EXIT_FAILURE, "An impairment must end after it starts");
+  events[nevents].start = start;
+  events[nevents].end = end;
+  nevents++;
+}
+
+static void load_events(
+    const char *path)
+{
+  FILE *f;
+  char line[256];
+  char *comma, *p;
+  int lineno = 0;
+
+  f = fopen(path, "r");
+  if (!f)
+    err(EXIT_FAILURE, "Cannot open %s", path);
+
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    line[strcspn(line, "#\r\n")] = 0;
+    for (p = line; *p == ' ' || *p == '\t'; p++);
+    if (!*p)
+      continue;
+    comma = strchr(p, ',');
+    if (!comma)
+      errx(EXIT_FAILURE, "%s:%d: expected START,END", path, lineno);
+    *comma = 0;
+    add_event(recfile_parse_time(p), recfile_parse_time(comma + 1));
+  }
+  fclose(f);
+}
+
+
+
+static struct trace * trace_new(
+    const char *tag)
+{
+  struct trace *t;
+
+  t = calloc(1, sizeof(struct trace));
+  assert(t);
+  snprintf(t->tag, sizeof(t->tag), "%s", tag);
+  return t;
+}
+
+static void trace_add(
+    struct trace *t,
+    const stat_record_t *r,
+    bool measured)
+{
+  if (t->n == t->size) {
+    t->size = t->size ? t->size * 2 : 4096;
+    t->recs = realloc(t->recs, t->size * sizeof(stat_record_t));
+    t->measured = realloc(t->measured, t->size * sizeof(bool));
+    assert(t->recs && t->measured);
+  }
+  t->recs[t->n] = *r;
+  t->measured[t->n] = measured;
+  t->n++;
+}
+
+
+
+/* Standard normal, from a generator of our own so a seed gives the same
+ * trace everywhere */
+static double gauss(
+    uint64_t *state)
+{
+  double u1, u2;
+
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  u1 = ((*state >> 11) + 1.) / 9007199254740993.;
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  u2 = (*state >> 11) / 9007199254740992.;
+  return sqrt(-2. * log(u1)) * cos(2. * M_PI * u2);
+}
+
+static struct trace * synthesise(
+    double duration,
+    double interval,
+    double rate,
+    double latency,
+    double noise,
+    double every,
+    double len,
+    double factor,
+    uint64_t seed)
+{
+  struct trace *t = trace_new("synthetic");
+  stat_record_t r;
+  double start = 1000000000., now, at, f;
+  uint64_t i, n = llround(duration / interval);
+
+  for (at = every; at + len <= duration; at += every)
+    add_event(start + at, start + at + len);
+
+  memset(&r, 0, sizeof(r));
+  for (i=1; i <= n; i++) {
+    now = start + i * interval;
+    at = fmod(now - start, every);
+    f = now - start >= every && at > 0. && at <= len ? factor : 1.;
+
+    r.timestamp = now;
+    r.bps = MAX(0., rate * f * (1. + noise * gauss(&seed)));
+    r.latency_us = latency / f * (1. + noise * fabs(gauss(&seed)));
+    r.bytes_total += r.bps * interval;
+    r.latency_total += r.latency_us;
+    r.limit = f < 1. ? LIMIT_NETWORK : LIMIT_APP;
+    trace_add(t, &r, true);
+  }
+  return t;
+}
+
+
+
+/* Every stream in the recording, or those matching, in recorded order */
+static struct trace ** load_recording(
+    const char *path,
+    const char *match,
+    int *ntraces)
+{
+  struct recfile f;
+  const struct rec_entry *e;
+  struct trace **traces;
+  stat_record_t r;
+  double *latency_total;
+  uint64_t head, idx;
+  uint32_t i;
+
+  recfile_open(path, &f);
+
+  traces = calloc(f.ntags + 1, sizeof(struct trace *));
+  latency_total = calloc(f.ntags + 1, sizeof(double));
+  assert(traces && latency_total);
+  for (i=0; i < f.ntags; i++) {
+    char tag[REC_TAG_SZ + 1];
+    snprintf(tag, sizeof(tag), "%.*s", REC_TAG_SZ, f.tags + i * REC_TAG_SZ);
+    if (!match || strstr(tag, match))
+      traces[i] = trace_new(tag);
+  }
+
+  head = __atomic_load_n(&f.hdr->head, __ATOMIC_ACQUIRE);
+  for (idx = head > f.hdr->capacity ? head - f.hdr->capacity : 0; idx < head; idx++) {
+    e = recfile_entry(&f, idx);
+    if (!e)
+      continue;
+    if (e->tag >= f.ntags || !traces[e->tag])
+      continue;
+
+    /* Samples that measured nothing are recorded empty */
+    if (e->bytes_total == 0 && e->latency_us == 0.) {
+      memset(&r, 0, sizeof(r));
+      r.timestamp = e->timestamp;
+      trace_add(traces[e->tag], &r, false);
+      continue;
+    }
+
+    /* The latency total is only ever the running sum */
+    memset(&r, 0, sizeof(r));
+    latency_total[e->tag] += e->latency_us;
+    r.timestamp = e->timestamp;
+    r.bps = e->bps;
+    r.latency_us = e->latency_us;
+    r.latency_total = latency_total[e->tag];
+    r.bytes_total = e->bytes_total;
+    r.delay_us = e->delay_us;
+    r.jitter_us = e->jitter_us;
+    r.retransmits = e->retransmits;
+    r.limit = e->limit < LIMIT_MAX ? e->limit : LIMIT_UNKNOWN;
+    r.tx_bps = e->tx_bps;
+    r.target_bps = e->target_bps;
+    r.datagrams = e->datagrams;
+    r.lost = e->lost;
+    r.reordered = e->reordered;
+    r.duplicates = e->duplicates;
+    r.reconnect_s = e->reconnect_ms / 1000.;
+    r.connects = e->connects;
+    r.connect_failures = e->connect_failures;
+    r.fastopens = e->fastopens;
+    trace_add(traces[e->tag], &r, true);
+  }
+
+  *ntraces = f.ntags;
+  free(latency_total);
+  return traces;
+}
+
+
+
+/* The impairment a sample falls in, counting the window after it ends,
+ * or -1 */
+static int event_at(
+    double ts,
+    double window)
+{
+  int i;
+
+  for (i=0; i < nevents; i++)
+    if (ts >= events[i].start && ts < events[i].end + window)
+      return i;
+  return -1;
+}
+
+static void replay(
+    struct trace *t,
+    int nrecs,
+    double window,
+    struct score *sc)
+{
+  struct detector d;
+  struct timespec t0, t1;
+  bool *alerting, *seen, was = false;
+  double ts;
+  size_t i;
+  int ev;
+
+  alerting = malloc(t->n * sizeof(bool));
+  seen = calloc(nevents + 1, sizeof(bool));
+  assert(alerting && seen);
+
+  /* Only the detector is timed, the scoring comes after */
+  detector_init(&d, nrecs);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i=0; i < t->n; i++) {
+    detector_feed(&d, t->measured[i] ? &t->recs[i] : NULL);
+    alerting[i] = d.alerting && detector_settled(&d);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  detector_destroy(&d);
+  sc->secs += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  sc->samples += t->n;
+
+  for (i=nrecs; i < t->n; i++) {
+    ts = t->recs[i].timestamp;
+    sc->scored++;
+    sc->alerting += alerting[i];
+    if (!nevents)
+      continue;
+
+    ev = event_at(ts, window);
+    if (ev < 0) {
+      sc->clear++;
+      sc->false_samples += alerting[i];
+      sc->false_alarms += alerting[i] && !was;
+    }
+    else if (alerting[i] && !seen[ev]) {
+      seen[ev] = true;
+      sc->delays[sc->detected++] = MAX(0., ts - events[ev].start);
+    }
+    was = alerting[i];
+  }
+
+  /* Impairments inside the trace, past the warm up, that never alerted */
+  if (t->n > (size_t)nrecs) {
+    for (ev=0; ev < nevents; ev++)
+      if (!seen[ev] && events[ev].start >= t->recs[nrecs].timestamp &&
+          events[ev].end <= t->recs[t->n - 1].timestamp)
+        sc->missed++;
+  }
+
+  free(alerting);
+  free(seen);
+}
+
+
+
+static int cmp_double(
+    const void *a,
+    const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void print_score(
+    const char *what,
+    struct score *sc)
+{
+  double sum = 0.;
+  uint64_t i;
+
+  printf("%s: %" PRIu64 " samples in %.3fs, %.0f samples/s | alerting %.2f%% of %" PRIu64 " judged\n",
+         what, sc->samples, sc->secs, sc->secs > 0. ? sc->samples / sc->secs : 0.,
+         sc->scored ? 100. * sc->alerting / sc->scored : 0., sc->scored);
+  if (!nevents)
+    return;
+
+  printf("  Impairments: %" PRIu64 " detected, %" PRIu64 " missed", sc->detected, sc->missed);
+  if (sc->detected) {
+    qsort(sc->delays, sc->detected, sizeof(double), cmp_double);
+    for (i=0; i < sc->detected; i++)
+      sum += sc->delays[i];
+    printf(" | detection delay mean/p50/p90/max %.2f/%.2f/%.2f/%.2fs",
+           sum / sc->detected, sc->delays[sc->detected / 2],
+           sc->delays[MIN(sc->detected - 1, (uint64_t)(sc->detected * .9))],
+           sc->delays[sc->detected - 1]);
+  }
+  printf("\n  False positives: %.3f%% of %" PRIu64 " clear samples, %" PRIu64 " false alarms\n",
+         sc->clear ? 100. * sc->false_samples / sc->clear : 0., sc->clear, sc->false_alarms);
+}
+
+
+
+int main(
+    int argc,
+    char **argv)
+{
+  int c, optidx, i, ntraces, nrecs, n = 0;
+  struct trace **traces;
+  struct score total, sc;
+  double interval = STATS_FREQUENCY, window = STATS_SECS;
+  double duration = 3600., rate = DEFAULT_RATE_PER_SEC, latency = 1000., noise = .02;
+  double every = 600., len = 30., factor = .1;
+  uint64_t seed = 1;
+  const char *match = NULL, *events_path = NULL;
+
+  static struct option long_options[] = {
+    { "help",     no_argument,       NULL, 'h' },
+    { "sample",   required_argument, NULL, 'i' },
+    { "window",   required_argument, NULL, 'w' },
+    { "stream",   required_argument, NULL, 's' },
+    { "events",   required_argument, NULL, 'e' },
+    { "duration", required_argument, NULL, 'd' },
+    { "rate",     required_argument, NULL, 'r' },
+    { "latency",  required_argument, NULL, 'L' },
+    { "noise",    required_argument, NULL, 'N' },
+    { "impair",   required_argument, NULL, 'I' },
+    { "seed",     required_argument, NULL, 'S' },
+    {  0,         0,                 0,     0  },
+  };
+
+  while ((c = getopt_long(argc, argv, "hi:w:s:e:d:r:L:N:I:S:", long_options, &optidx)) != -1) {
+    switch (c) {
+    case 'i':
+      interval = parse_double(optarg, "Sample interval", 0.001, 60.);
+    break;
+
+    case 'w':
+      window = parse_double(optarg, "Window", 1., 86400.);
+    break;
+
+    case 's':
+      match = optarg;
+    break;
+
+    case 'e':
+      events_path = optarg;
+    break;
+
+    case 'd':
+      duration = parse_double(optarg, "Duration", 1., 365. * 86400.);
+    break;
+
+    case 'r':
+      rate = parse_double(optarg, "Rate", 1., 1e12);
+    break;
+
+    case 'L':
+      latency = parse_double(optarg, "Latency", 1., 1e9);
+    break;
+
+    case 'N':
+      noise = parse_double(optarg, "Noise", 0., 1.);
+    break;
+
+    case 'I':
+      if (sscanf(optarg, "%lf:%lf:%lf", &every, &len, &factor) < 2 ||
+          every <= 0. || len <= 0. || len >= every || factor <= 0. || factor > 1.)
+        errx(EXIT_FAILURE, "Impairments must be EVERY:LEN[:FACTOR], LEN under EVERY and FACTOR "
+                           "above 0 and at most 1, not %s", optarg);
+    break;
+
+    case 'S':
+      seed = parse_double(optarg, "Seed", 0., 1e18);
+    break;
+
+    default:
+      print_usage();
+      print_help();
+      exit(1);
+    break;
+    }
+  }
+
+  nrecs = lround(window / interval);
+  if (nrecs < STATS_MIN_RECORDS)
+    errx(EXIT_FAILURE, "The window must hold at least %d samples, %.1fs of %.3fs samples is %d",
+         STATS_MIN_RECORDS, window, interval, nrecs);
+
+  events = calloc(MAX_EVENTS, sizeof(struct event));
+  assert(events);
+  if (events_path)
+    load_events(events_path);
+
+  if (argv[optind]) {
+    traces = load_recording(argv[optind], match, &ntraces);
+  }
+  else {
+    if (events_path)
+      errx(EXIT_FAILURE, "A made up trace brings its own impairments, --events is for recordings");
+    traces = calloc(1, sizeof(struct trace *));
+    assert(traces);
+    traces[0] = synthesise(duration, interval, rate, latency, noise, every, len, factor, seed);
+    ntraces = 1;
+  }
+
+  memset(&total, 0, sizeof(total));
+  /* Each impairment is detected once per stream at most */
+  total.delays = calloc((size_t)nevents * MAX(ntraces, 1) + 1, sizeof(double));
+  assert(total.delays);
+  for (i=0; i < ntraces; i++) {
+    if (!traces[i] || traces[i]->n == 0)
+      continue;
+    memset(&sc, 0, sizeof(sc));
+    sc.delays = calloc(nevents + 1, sizeof(double));
+    assert(sc.delays);
+    replay(traces[i], nrecs, window, &sc);
+    print_score(traces[i]->tag, &sc);
+
+    total.samples += sc.samples;
+    total.scored += sc.scored;
+    total.clear += sc.clear;
+    total.false_samples += sc.false_samples;
+    total.false_alarms += sc.false_alarms;
+    total.alerting += sc.alerting;
+    total.missed += sc.missed;
+    total.secs += sc.secs;
+    memcpy(total.delays + total.detected, sc.delays, sc.detected * sizeof(double));
+    total.detected += sc.detected;
+    free(sc.delays);
+    n++;
+  }
+
+  if (n == 0)
+    errx(EXIT_FAILURE, "No samples to replay");
+  if (n > 1)
+    print_score("All streams", &total);
+  return 0;
+}
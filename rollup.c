@@ -0,0 +1,331 @@
+#include "common.h"
+#include "rollup.h"
+#include "config.h"
+#include "hist.h"
+
+/* Long horizon history at a fixed cost per stream. Every sample that
+ * leaves the window goes into an open summary for each tier, a second,
+ * a minute and an hour, and into one covering the whole run. A summary
+ * is closed into its tier's ring when a sample lands past its span, so
+ * availability and time in breach can be read back over the last
+ * minute, hour, day or week without keeping the samples themselves */
+
+/* Latency percentiles per summary, in the coarse buckets of hist.h
+ * (within 1/16th) but with 32 bit counts so the open summaries stay
+ * small */
+#define RU_SUB_BITS HIST_COARSE_BITS
+#define RU_HALF (1 << (RU_SUB_BITS - 1))
+#define RU_BUCKETS ((32 - RU_SUB_BITS + 2) * RU_HALF)
+
+struct rollup_hist {
+  uint32_t buckets[RU_BUCKETS];
+};
+
+struct rollup_acc {
+  double start;
+  uint32_t samples;
+  uint32_t up;
+  uint32_t breach;
+  double bps_min, bps_sum, bps_max;
+  double latency_min, latency_sum, latency_max;
+  struct rollup_hist *hist;
+};
+
+struct rollup_tier {
+  const char *name;
+  double span;
+  int depth;
+  uint64_t head;
+  struct rollup_summary *ring;
+  struct rollup_acc acc;
+};
+
+struct rollup {
+  double last;
+  struct rollup_tier tiers[ROLLUP_TIERS];
+  struct rollup_acc total;
+};
+
+static const struct {
+  const char *name;
+  double span;
+  int depth;
+  bool percentiles;
+} tier_defs[ROLLUP_TIERS] = {
+  { "Second", 1.,    ROLLUP_SECOND_DEPTH, false },
+  { "Minute", 60.,   ROLLUP_MINUTE_DEPTH, true },
+  { "Hour",   3600., ROLLUP_HOUR_DEPTH,   true },
+};
+
+/* The spans reported, each read from the finest tier that covers it */
+static const struct {
+  const char *name;
+  double span;
+  int tier;
+} spans[] = {
+  { "minute", 60.,     0 },
+  { "hour",   3600.,   1 },
+  { "day",    86400.,  2 },
+  { "week",   604800., 2 },
+};
+#define NSPANS (sizeof(spans) / sizeof(spans[0]))
+
+
+
+static inline int ru_index(
+    uint32_t v)
+{
+  int e;
+
+  if (v < (1U << RU_SUB_BITS))
+    return v;
+  e = 32 - __builtin_clz(v) - RU_SUB_BITS;
+  return e * RU_HALF + (v >> e);
+}
+
+static inline double ru_value(
+    int i)
+{
+  int e;
+
+  if (i < (1 << RU_SUB_BITS))
+    return i;
+  e = i / RU_HALF - 1;
+  return (double)(((uint64_t)(i - e * RU_HALF) << e) + ((1ULL << e) - 1));
+}
+
+
+
+static void acc_reset(
+    struct rollup_acc *a,
+    double start)
+{
+  a->start = start;
+  a->samples = a->up = a->breach = 0;
+  a->bps_min = a->latency_min = INFINITY;
+  a->bps_max = a->latency_max = 0.;
+  a->bps_sum = a->latency_sum = 0.;
+  if (a->hist)
+    memset(a->hist, 0, sizeof(*a->hist));
+}
+
+
+
+/* A sample that measured nothing counts against availability and as time
+ * in breach, as does one taken while alerting */
+static void acc_add(
+    struct rollup_acc *a,
+    const stat_record_t *r)
+{
+  a->samples++;
+  if (!r->measured || r->alerting)
+    a->breach++;
+  if (!r->measured)
+    return;
+
+  a->up++;
+  a->bps_min = MIN(a->bps_min, r->bps);
+  a->bps_max = MAX(a->bps_max, r->bps);
+  a->bps_sum += r->bps;
+  a->latency_min = MIN(a->latency_min, r->latency_us);
+  a->latency_max = MAX(a->latency_max, r->latency_us);
+  a->latency_sum += r->latency_us;
+  if (a->hist)
+    a->hist->buckets[ru_index(MIN(lround(r->latency_us), UINT32_MAX))]++;
+}
+
+
+
+static void acc_summarise(
+    const struct rollup_acc *a,
+    struct rollup_summary *s)
+{
+  static const double q[] = { .5, .9, .99 };
+  float *out[] = { &s->latency_p50, &s->latency_p90, &s->latency_p99 };
+  uint64_t seen = 0;
+  int i, j = 0;
+
+  memset(s, 0, sizeof(*s));
+  s->start = a->start;
+  s->samples = a->samples;
+  s->up = a->up;
+  s->breach = a->breach;
+  if (a->up == 0)
+    return;
+
+  s->bps_min = a->bps_min;
+  s->bps_mean = a->bps_sum / a->up;
+  s->bps_max = a->bps_max;
+  s->latency_min = a->latency_min;
+  s->latency_mean = a->latency_sum / a->up;
+  s->latency_max = a->latency_max;
+  if (!a->hist)
+    return;
+
+  for (i=0; i < RU_BUCKETS && j < 3; i++) {
+    seen += a->hist->buckets[i];
+    while (j < 3 && seen >= MAX((uint64_t)ceil(q[j] * a->up), 1))
+      *out[j++] = MIN(ru_value(i), a->latency_max);
+  }
+}
+
+
+
+struct rollup * rollup_new(
+    void)
+{
+  struct rollup *ru;
+  int i;
+
+  ru = calloc(1, sizeof(struct rollup));
+  assert(ru);
+
+  for (i=0; i < ROLLUP_TIERS; i++) {
+    ru->tiers[i].name = tier_defs[i].name;
+    ru->tiers[i].span = tier_defs[i].span;
+    ru->tiers[i].depth = tier_defs[i].depth;
+    ru->tiers[i].ring = calloc(tier_defs[i].depth, sizeof(struct rollup_summary));
+    assert(ru->tiers[i].ring);
+    if (tier_defs[i].percentiles) {
+      ru->tiers[i].acc.hist = malloc(sizeof(struct rollup_hist));
+      assert(ru->tiers[i].acc.hist);
+    }
+    acc_reset(&ru->tiers[i].acc, NAN);
+  }
+
+  ru->total.hist = malloc(sizeof(struct rollup_hist));
+  assert(ru->total.hist);
+  acc_reset(&ru->total, NAN);
+  return ru;
+}
+
+
+
+void rollup_free(
+    struct rollup *ru)
+{
+  int i;
+
+  for (i=0; i < ROLLUP_TIERS; i++) {
+    free(ru->tiers[i].ring);
+    free(ru->tiers[i].acc.hist);
+  }
+  free(ru->total.hist);
+  free(ru);
+}
+
+
+
+void rollup_add(
+    struct rollup *ru,
+    const stat_record_t *r)
+{
+  struct rollup_tier *t;
+  double start;
+  int i;
+
+  for (i=0; i < ROLLUP_TIERS; i++) {
+    t = &ru->tiers[i];
+    start = floor(r->timestamp / t->span) * t->span;
+    if (start != t->acc.start) {
+      if (t->acc.samples)
+        acc_summarise(&t->acc, &t->ring[t->head++ % t->depth]);
+      acc_reset(&t->acc, start);
+    }
+    acc_add(&t->acc, r);
+  }
+
+  if (ru->total.samples == 0)
+    ru->total.start = r->timestamp;
+  acc_add(&ru->total, r);
+  ru->last = r->timestamp;
+}
+
+
+
+/* Samples, up and in breach over everything since the given time, the
+ * closed summaries of a tier plus the one still open */
+static void tier_since(
+    const struct rollup_tier *t,
+    double since,
+    uint64_t *samples,
+    uint64_t *up,
+    uint64_t *breach)
+{
+  const struct rollup_summary *s;
+  uint64_t i, n = MIN(t->head, (uint64_t)t->depth);
+
+  *samples = t->acc.samples;
+  *up = t->acc.up;
+  *breach = t->acc.breach;
+  for (i=1; i <= n; i++) {
+    s = &t->ring[(t->head - i) % t->depth];
+    if (s->start < since)
+      break;
+    *samples += s->samples;
+    *up += s->up;
+    *breach += s->breach;
+  }
+}
+
+
+
+static void print_summary(
+    const char *name,
+    const struct rollup_summary *s)
+{
+  struct tm tm;
+  time_t start = s->start;
+  char str[32];
+
+  localtime_r(&start, &tm);
+  strftime(str, sizeof(str), "%Y-%m-%d %H:%M", &tm);
+  /* Connection rate mode counts connects where bytes would be */
+  if (config_get()->connect_rate)
+    printf("%s from %s: available %.2f%% | connects/s min/mean/max %.1f/%.1f/%.1f | "
+           "handshake p50/p90/p99/max %.3f/%.3f/%.3f/%.3fms\n",
+           name, str, 100. * s->up / s->samples, s->bps_min, s->bps_mean, s->bps_max,
+           s->latency_p50/1000, s->latency_p90/1000, s->latency_p99/1000, s->latency_max/1000);
+  else
+    printf("%s from %s: available %.2f%% | throughput min/mean/max %.3f/%.3f/%.3fkbps | "
+           "latency p50/p90/p99/max %.3f/%.3f/%.3f/%.3fms\n",
+           name, str, 100. * s->up / s->samples,
+           s->bps_min/1024, s->bps_mean/1024, s->bps_max/1024,
+           s->latency_p50/1000, s->latency_p90/1000, s->latency_p99/1000, s->latency_max/1000);
+}
+
+
+
+/* Availability and time in breach over each span the run has lasted, then
+ * the last full minute and hour. The caller holds stdout */
+void rollup_print(
+    struct rollup *ru)
+{
+  struct rollup_summary s;
+  uint64_t samples, up, breach;
+  double elapsed = ru->last - ru->total.start;
+  const struct rollup_tier *t;
+  int i;
+
+  if (ru->total.samples == 0)
+    return;
+
+  printf("Availability (in breach):");
+  for (i=0; i < NSPANS; i++) {
+    if (elapsed < spans[i].span)
+      break;
+    tier_since(&ru->tiers[spans[i].tier], ru->last - spans[i].span, &samples, &up, &breach);
+    printf(" %s %.2f%% (%.2f%%) |", spans[i].name, 100. * up / samples, 100. * breach / samples);
+  }
+  printf(" run %.2f%% (%.2f%%)\n", 100. * ru->total.up / ru->total.samples,
+         100. * ru->total.breach / ru->total.samples);
+
+  for (i=1; i < ROLLUP_TIERS; i++) {
+    t = &ru->tiers[i];
+    if (t->head)
+      print_summary(t->name, &t->ring[(t->head - 1) % t->depth]);
+  }
+  acc_summarise(&ru->total, &s);
+  if (s.up)
+    print_summary("Run", &s);
+}
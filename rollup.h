@@ -0,0 +1,37 @@
+#ifndef _ROLLUP_H_
+#define _ROLLUP_H_
+#include "common.h"
+#include "stats.h"
+
+/* Each tier closes a summary every span seconds, aligned to the wall
+ * clock, and keeps the last depth of them. Samples leaving the window
+ * are the ones rolled up so nothing is counted twice */
+#define ROLLUP_TIERS 3
+#define ROLLUP_SECOND_DEPTH 60
+#define ROLLUP_MINUTE_DEPTH 60
+#define ROLLUP_HOUR_DEPTH 168
+
+struct rollup_summary {
+  double start;
+  uint32_t samples;
+  uint32_t up;
+  uint32_t breach;
+  float bps_min;
+  float bps_mean;
+  float bps_max;
+  float latency_min;
+  float latency_mean;
+  float latency_max;
+  /* Left at zero by tiers too fine to keep percentiles */
+  float latency_p50;
+  float latency_p90;
+  float latency_p99;
+};
+
+struct rollup;
+
+struct rollup * rollup_new(void);
+void rollup_free(struct rollup *ru);
+void rollup_add(struct rollup *ru, const stat_record_t *r);
+void rollup_print(struct rollup *ru);
+#endif
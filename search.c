@@ -0,0 +1,152 @@
+#include "common.h"
+#include "config.h"
+#include "search.h"
+#include "detector.h"
+#include "rate.h"
+
+/* The capacity lies between the highest rate that passed, or the floor,
+ * and the lowest that failed, or the ceiling. Everything after start runs
+ * on the stats thread */
+static struct {
+  int64_t lo;
+  int64_t hi;
+  int64_t best;
+  int64_t ceiling;
+  int64_t trial;
+  bool floor_tried;
+  int steps;
+  int samples;
+} search;
+
+
+
+static void search_try(
+    int64_t rate)
+{
+  search.trial = rate;
+  search.samples = 0;
+  search.steps++;
+  rate_retarget(rate);
+}
+
+
+
+/* Done when the ceiling passed, or the gap is down to the precision and
+ * the floor has been shown to pass or fail */
+static void search_next(
+    void)
+{
+  if (search.best == search.ceiling)
+    goto done;
+  if (search.hi - search.lo > search.hi * SEARCH_PRECISION) {
+    search_try((search.lo + search.hi) / 2);
+    return;
+  }
+  if (!search.best && !search.floor_tried) {
+    search.floor_tried = true;
+    search_try(search.lo);
+    return;
+  }
+
+done:
+  flockfile(stdout);
+  if (search.best == search.ceiling)
+    printf("Search done after %d steps, the link carries at least the ceiling of %.3fkbps\n",
+           search.steps, search.best/1024.);
+  else if (search.best)
+    printf("Search done after %d steps, the link carries %.3fkbps within the watermarks, %.3fkbps is too much\n",
+           search.steps, search.best/1024., search.hi/1024.);
+  else
+    printf("Search done after %d steps, the link cannot carry even the floor of %.3fkbps\n",
+           search.steps, search.lo/1024.);
+  fflush(stdout);
+  funlockfile(stdout);
+  exit(search.best ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+
+
+/* A step passes with both fitnesses and the loss within the watermarks
+ * and the rate actually sent, a sender held back by the link is how TCP
+ * shows a rate it cannot carry */
+static void search_judge(
+    const struct detector *d)
+{
+  double tx = 0., target = 0.;
+  bool pass;
+  int i;
+
+  for (i=0; i < d->nrecs; i++) {
+    tx += d->records[i].tx_bps;
+    target += d->records[i].target_bps;
+  }
+  pass = d->throughput_fitness >= WATERMARK_THROUGHPUT_LO &&
+         d->latency_fitness >= WATERMARK_LATENCY_LO &&
+         d->loss <= WATERMARK_LOSS &&
+         target > 0. && tx >= target * WATERMARK_THROUGHPUT_LO;
+
+  flockfile(stdout);
+  printf("Search step %d: %.3fkbps %s | throughput %.2f latency %.2f | loss %.2f%% | sent %.1f%%\n",
+         search.steps, search.trial/1024., pass ? "passed" : "failed",
+         d->throughput_fitness, d->latency_fitness, 100. * d->loss,
+         target > 0. ? 100. * tx / target : 0.);
+  fflush(stdout);
+  funlockfile(stdout);
+
+  if (pass) {
+    search.best = search.trial;
+    search.lo = search.trial;
+  }
+  else {
+    search.hi = search.trial;
+  }
+  search_next();
+}
+
+
+
+/* Waits out two whole windows measured at the trial rate. A connection
+ * lost part way fails the step */
+static void search_sample(
+    const struct detector *d,
+    const stat_record_t *r,
+    void *data)
+{
+  if (!r->measured) {
+    if (search.samples > 0) {
+      flockfile(stdout);
+      printf("Search step %d: %.3fkbps failed, the connection was lost\n",
+             search.steps, search.trial/1024.);
+      fflush(stdout);
+      funlockfile(stdout);
+      search.hi = search.trial;
+      search_next();
+    }
+    return;
+  }
+
+  if (++search.samples < d->nrecs * 2)
+    return;
+  search_judge(d);
+}
+
+
+
+void search_start(
+    struct stats *st,
+    int64_t floor,
+    int64_t ceiling)
+{
+  struct configuration *c = config_get();
+
+  assert(floor > 0 && floor < ceiling);
+  search.lo = floor;
+  search.hi = ceiling;
+  search.ceiling = ceiling;
+  search.best = 0;
+
+  printf("Searching for the capacity between %.3fkbps and %.3fkbps, %.0fs a step\n",
+         floor/1024., ceiling/1024., c->stats_records * 2 * c->stats_frequency);
+  stats_watch(st, search_sample, NULL);
+  search_try(ceiling);
+}
@@ -0,0 +1,14 @@
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+#include "common.h"
+#include "stats.h"
+
+/* Stop once the capacity is known to within this share */
+#define SEARCH_PRECISION .05
+
+/* Bisects between floor and ceiling for the highest total rate that
+ * keeps the link within the watermarks, then reports it and exits. Each
+ * step runs for a window of st to settle, queues built up by the step
+ * before take a while to drain, and is judged on the window after */
+void search_start(struct stats *st, int64_t floor, int64_t ceiling);
+#endif
@@ -0,0 +1,76 @@
+#include "common.h"
+#include "spsc.h"
+
+/* The producer publishes a slot by moving tail on after filling it, the
+ * consumer hands it back by moving head on after it is done with it, so
+ * the release on one side and acquire on the other is all it takes */
+
+/* Capacity is rounded up to a power of two */
+struct spsc * spsc_new(
+    uint32_t capacity,
+    size_t size)
+{
+  struct spsc *q;
+  uint32_t n = 1;
+
+  assert(capacity > 0 && capacity <= (1U << 31));
+  while (n < capacity)
+    n <<= 1;
+
+  if (posix_memalign((void **)&q, SPSC_CACHELINE, sizeof(struct spsc)))
+    errx(EXIT_FAILURE, "Cannot allocate a ring");
+  memset(q, 0, sizeof(*q));
+  q->mask = n - 1;
+  q->size = size;
+  q->slots = calloc(n, size);
+  assert(q->slots);
+  return q;
+}
+
+
+
+/* Free slots, producer only. Always reads the consumer's index so a ring
+ * that has been drained shows it, however little space is wanted */
+uint32_t spsc_space(
+    struct spsc *q)
+{
+  q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+  return q->mask + 1 - (q->tail - q->head_cache);
+}
+
+
+
+/* Producer only. False if the ring is full */
+bool spsc_push(
+    struct spsc *q,
+    const void *item)
+{
+  if (q->tail - q->head_cache > q->mask && spsc_space(q) == 0)
+    return false;
+  memcpy(q->slots + (q->tail & q->mask) * q->size, item, q->size);
+  __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+
+
+/* Consumer only. The oldest slot, left in place until spsc_pop(), or
+ * NULL if there is none */
+void * spsc_peek(
+    struct spsc *q)
+{
+  if (q->head == q->tail_cache) {
+    q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if (q->head == q->tail_cache)
+      return NULL;
+  }
+  return q->slots + (q->head & q->mask) * q->size;
+}
+
+
+
+void spsc_pop(
+    struct spsc *q)
+{
+  __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+}
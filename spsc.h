@@ -0,0 +1,30 @@
+#ifndef _SPSC_H_
+#define _SPSC_H_
+#include "common.h"
+
+#define SPSC_CACHELINE 64
+
+/* A ring of fixed size slots between exactly one producer thread and
+ * one consumer thread, without locks. Each side owns one index and keeps
+ * a copy of the other's, so the shared cache lines are only read when
+ * the ring looks full or empty, or the producer asks how much is free */
+struct spsc {
+  uint32_t mask;
+  size_t size;
+  uint8_t *slots;
+
+  /* Producer's */
+  uint64_t tail __attribute__((aligned(SPSC_CACHELINE)));
+  uint64_t head_cache;
+
+  /* Consumer's */
+  uint64_t head __attribute__((aligned(SPSC_CACHELINE)));
+  uint64_t tail_cache;
+};
+
+struct spsc * spsc_new(uint32_t capacity, size_t size);
+uint32_t spsc_space(struct spsc *q);
+bool spsc_push(struct spsc *q, const void *item);
+void * spsc_peek(struct spsc *q);
+void spsc_pop(struct spsc *q);
+#endif
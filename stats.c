@@ -1,59 +1,122 @@
 #include "common.h"
 #include "config.h"
 #include "stats.h"
+#include "detector.h"
+#include "hist.h"
+#include "recorder.h"
+#include "rollup.h"
+#include "realtime.h"
+#include "spsc.h"
+#include <stdarg.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
 #include <gsl/gsl_statistics.h>
 
 #define SAMPLE_SZ 15
-#define WATERMARK_LATENCY_LO    .95
-#define WATERMARK_LATENCY_HI    .99
-#define WATERMARK_THROUGHPUT_LO .95
-#define WATERMARK_THROUGHPUT_HI .99
+/* Ring slots per stream a loop carries, and to spare */
+#define STATS_RING_PER_STREAM 2
+#define STATS_RING_SLACK 64
 
+static const char *limit_str[LIMIT_MAX] = {
+  [LIMIT_UNKNOWN] = "unknown",
+  [LIMIT_APP]     = "application",
+  [LIMIT_NETWORK] = "network",
+  [LIMIT_RWND]    = "receive window",
+  [LIMIT_SNDBUF]  = "send buffer",
+};
 
-#define UNCHANGED       0x0
-#define LATENCY_OK      0x1
-#define LATENCY_CRIT    0x2
-#define THROUGHPUT_OK   0x4
-#define THROUGHPUT_CRIT 0x8
+static char * link_latency_str(struct stats *st);
+static char * link_throughput_str(struct stats *st);
 
-char stampstr[64];
 
-static char * link_latency_str(void);
-static char * link_throughput_str(void);
+struct stats {
+  ev_timer timer;
+  struct ev_loop *loop;
+  char tag[128];
+
+  struct detector det;
+
+  /* Alerting reminders, in samples */
+  int remind_lines;
+  int remind_stats;
+
+  uint16_t rectag;
+  int (*stats_record_cb)(stat_record_t *, void *);
+  void *data;
+  double rate;
 
+  /* Every observation since the last summary. Delays and lateness are
+   * recorded on the stream's loop and taken for each summary */
+  struct hist *latency_hist;
+  struct hist *delay_hist;
+  struct hist *lateness_hist;
+  struct hist *handshake_hist;
 
+  /* Everything that has left the window */
+  struct rollup *rollup;
+
+  void (*watch_cb)(const struct detector *, const stat_record_t *, void *);
+  void *watch_data;
+
+  struct stats_producer *producer;
+};
+
+/* A sample on its way from the loop that took it to the stats thread */
+struct stats_msg {
+  struct stats *st;
+  int rc;
+  double now;
+  stat_record_t rec;
+};
+
+/* Every loop taking samples has its own ring into the stats thread. Live
+ * counts the streams sampling on the loop and is only touched from its
+ * thread, or before that thread has started */
+struct stats_producer {
+  struct ev_loop *loop;
+  struct spsc *ring;
+  int live;
+};
+
+/* Sampling stays with each stream's loop as it needs the stream, the
+ * window, alerting, recording and printing are done on a thread of their
+ * own so a busy loop and a blocked stdout cannot hold each other up */
 static struct {
-  ev_timer timer;
-  bool disconnected;
+  pthread_t thread;
+  struct ev_loop *loop;
+  ev_async wake;
 
-  int nrecs;
-  int nextrec;
-  stat_record_t *records;
+  pthread_mutex_t lock;
+  int nproducers;
+  struct stats_producer producers[MAX_THREADS + 1];
 
-  int (*stats_record_cb)(stat_record_t *);
-  double rate;
-  double throughput_fitness;
-  double latency_fitness;
+  uint64_t dropped;
+  bool warned;
+
+  /* Summaries of histograms still being recorded into */
+  struct hist *scratch;
+} sampler = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
-  double throughput_mean;
-  double latency_mean;
-  int state;
-  bool alerting;
-} records;
+static const double percentiles[] = { .5, .9, .99, .999, 1. };
+#define NPERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
 
 
 static char *strstamp(
-    double stamp)
+    double stamp,
+    char *stampstr)
 {
   double rem, nil;
   char str[64];
 
-  long st = lround(stamp);
-  struct tm *time;
+  time_t st = lround(stamp);
+  struct tm time;
   rem = modf(stamp, &nil);
   rem *= 1000;
-  time = localtime(&st);
-  strftime(str, 63, "%Y-%m-%d %H:%M:%S", time);
+  localtime_r(&st, &time);
+  strftime(str, 63, "%Y-%m-%d %H:%M:%S", &time);
   snprintf(stampstr, 63, "%s.%03.0f", str, rem);
   return stampstr;
 }
@@ -61,33 +124,54 @@ static char *strstamp(
 
 
 static void print_lines(
+    struct stats *st,
     int lines,
     int nsamples)
 {
   int i, j;
   stat_record_t *r;
   int rnum;
-  char hostport[26];
-  struct configuration *c = config_get();
+  char stampstr[64];
   double *timebin = alloca(sizeof(double) * nsamples);
   double *latebin = alloca(sizeof(double) * nsamples);
   double *bpsbin = alloca(sizeof(double) * nsamples);
+  double *delaybin = alloca(sizeof(double) * nsamples);
+  double *jitterbin = alloca(sizeof(double) * nsamples);
+  bool framed = config_get()->framed || config_get()->udp;
+  bool handshakes = config_get()->connect_rate > 0;
 
   stat_record_t *meanrecs = alloca(sizeof(stat_record_t) * lines);
   stat_record_t *t;
+  int limits[LIMIT_MAX];
+  int l;
 
-  rnum = (records.nextrec-(lines * nsamples)) % records.nrecs;
-  snprintf(hostport, 25, "%s:%s", c->hostname, c->port);
+  memset(meanrecs, 0, sizeof(stat_record_t) * lines);
+  rnum = ((st->det.nextrec-(lines * nsamples)) % st->det.nrecs + st->det.nrecs) % st->det.nrecs;
 
   for (i=0; i < lines; i++) {
     /* For each line */
     t = &meanrecs[i];
+    memset(limits, 0, sizeof(limits));
     /* Timestamps */
     for (j=0; j < nsamples; j++) {
-      r = &records.records[rnum++];
+      r = &st->det.records[rnum];
+      rnum = (rnum+1) % st->det.nrecs;
       timebin[j] = r->timestamp;
       latebin[j] = r->latency_us;
       bpsbin[j] = r->bps;
+      delaybin[j] = r->delay_us;
+      jitterbin[j] = r->jitter_us;
+      t->retransmits += r->retransmits;
+      t->datagrams += r->datagrams;
+      t->lost += r->lost;
+      t->reordered += r->reordered;
+      t->duplicates += r->duplicates;
+      t->connects += r->connects;
+      t->connect_failures += r->connect_failures;
+      t->fastopens += r->fastopens;
+      t->tx_bps += r->tx_bps / nsamples;
+      t->target_bps += r->target_bps / nsamples;
+      limits[r->limit]++;
       if (r->state != LINK_UNCHANGED) /* Obtains the 'max' state */
         t->state = r->state;
     }
@@ -95,81 +179,249 @@ static void print_lines(
     t->timestamp = gsl_stats_max(timebin, 1, nsamples);
     t->latency_us = gsl_stats_mean(latebin, 1, nsamples);
     t->bps = gsl_stats_mean(bpsbin, 1, nsamples);
+    t->delay_us = gsl_stats_mean(delaybin, 1, nsamples);
+    t->jitter_us = gsl_stats_mean(jitterbin, 1, nsamples);
+    /* Whichever limit held for most of the line */
+    for (l=LIMIT_APP; l < LIMIT_MAX; l++)
+      if (limits[l] > limits[t->limit])
+        t->limit = l;
   }
 
-  /* Print the output now of each record */
+  /* Print the output now of each record, streams on other threads
+   * share stdout so keep our lines together */
+  flockfile(stdout);
   for (i=0; i < lines; i++) {
     t = &meanrecs[i];
     if (t->timestamp < 100 || isnan(t->timestamp))
       continue;
 
-    printf("%s %s %.3fkbps %.3fms", strstamp(t->timestamp),
-                             hostport,
-                             t->bps/1024,
-                             t->latency_us/1000);
-    if (records.disconnected && t->state == LINK_CONNECTED)
+    /* Handshakes take the place of bytes in connection rate mode */
+    if (handshakes)
+      printf("%s %s %.1f connects/s %.3fms", strstamp(t->timestamp, stampstr), st->tag,
+             t->bps, t->latency_us/1000);
+    else
+      printf("%s %s %.3fkbps %.3fms", strstamp(t->timestamp, stampstr),
+                               st->tag,
+                               t->bps/1024,
+                               t->latency_us/1000);
+    if (framed)
+      printf(" delay %.3fms jitter %.3fms", t->delay_us/1000, t->jitter_us/1000);
+    if (t->limit != LIMIT_UNKNOWN)
+      printf(" %s-limited", limit_str[t->limit]);
+    if (t->retransmits)
+      printf(" %u retransmits", t->retransmits);
+    if (t->lost)
+      printf(" loss %.2f%%", 100. * t->lost / (t->datagrams + t->lost));
+    if (t->reordered)
+      printf(" %u reordered", t->reordered);
+    if (t->duplicates)
+      printf(" %u duplicates", t->duplicates);
+    if (t->connect_failures)
+      printf(" %u failed (%.2f%%)", t->connect_failures,
+             100. * t->connect_failures / (t->connects + t->connect_failures));
+    if (t->fastopens)
+      printf(" %u fast open", t->fastopens);
+    if (t->target_bps > 0. && t->tx_bps < t->target_bps * WATERMARK_THROUGHPUT_LO)
+      printf(" sending %.0f%% of target", 100. * t->tx_bps / t->target_bps);
+    if (st->det.disconnected && t->state == LINK_CONNECTED)
       printf(" Connection established.");
-    else if (!records.disconnected && t->state == LINK_DISCONNECTED)
+    else if (!st->det.disconnected && t->state == LINK_DISCONNECTED)
       printf(" Connection has been lost.");
     printf("\n");
   }
   fflush(stdout);
+  funlockfile(stdout);
+}
+
 
+static void print_percentiles(
+    const char *what,
+    struct hist *h,
+    const char *unit)
+{
+  double p[NPERCENTILES];
+
+  if (h->count == 0)
+    return;
+  hist_percentiles(h, percentiles, p, NPERCENTILES);
+  printf("%s p50/p90/p99/p99.9/max: %.3f/%.3f/%.3f/%.3f/%.3fms (%" PRIu64 " %s)\n",
+         what, p[0]/1000, p[1]/1000, p[2]/1000, p[3]/1000, p[4]/1000, h->count, unit);
 }
 
 
-static void print_stats(
-    void)
+/* Share of the window spent under each limit, samples that could not be
+ * classified are left out */
+static void print_limits(
+    struct stats *st)
 {
-  printf("\nAverage Throughput: %.3fkbps\nAverage Latency:  %.3fms\nConnection Quality: %.1f%%\n"
-         "Status: %s (%.2f) | %s (%.2f). Alert mode: %s\n"
-         "\n",
-    records.throughput_mean/1024, records.latency_mean/1000,
-    (records.latency_fitness + records.throughput_fitness) * 50.0,
-    link_latency_str(), records.latency_fitness,
-    link_throughput_str(), records.throughput_fitness,
-    records.alerting ? "ON" : "OFF");
-  fflush(stdout);
+  int limits[LIMIT_MAX] = {0};
+  int i, n;
+
+  for (i=0; i < st->det.nrecs; i++)
+    limits[st->det.records[i].limit]++;
+  n = st->det.nrecs - limits[LIMIT_UNKNOWN];
+  if (n == 0)
+    return;
+
+  printf("Limited by: network %.0f%% | receive window %.0f%% | send buffer %.0f%% | application %.0f%%\n",
+         100. * limits[LIMIT_NETWORK] / n, 100. * limits[LIMIT_RWND] / n,
+         100. * limits[LIMIT_SNDBUF] / n, 100. * limits[LIMIT_APP] / n);
 }
 
 
-static int link_state(
-    void)
+/* What became of the datagrams over the window */
+static void print_loss(
+    struct stats *st)
+{
+  uint64_t datagrams = 0, lost = 0, reordered = 0, duplicates = 0;
+  int i;
+
+  for (i=0; i < st->det.nrecs; i++) {
+    datagrams += st->det.records[i].datagrams;
+    lost += st->det.records[i].lost;
+    reordered += st->det.records[i].reordered;
+    duplicates += st->det.records[i].duplicates;
+  }
+  if (datagrams + lost == 0)
+    return;
+
+  printf("Datagrams: %" PRIu64 " received | %" PRIu64 " lost (%.3f%%) | %" PRIu64 " reordered | %"
+         PRIu64 " duplicates\n", datagrams, lost, 100. * lost / (datagrams + lost), reordered, duplicates);
+}
+
+
+/* Whether we generated the load we were asked to over the window. A
+ * sender that fell behind its own target explains low throughput before
+ * the link does */
+static void print_pacing(
+    struct stats *st)
+{
+  uint64_t ticks = 0, overruns = 0, skipped = 0, stalls = 0;
+  double tx = 0., target = 0.;
+  int i, n = 0;
+  stat_record_t *r;
+
+  for (i=0; i < st->det.nrecs; i++) {
+    r = &st->det.records[i];
+    if (r->target_bps <= 0.)
+      continue;
+    n++;
+    tx += r->tx_bps;
+    target += r->target_bps;
+    ticks += r->ticks;
+    overruns += r->overruns;
+    skipped += r->skipped;
+    stalls += r->stalls;
+  }
+  if (n == 0)
+    return;
+
+  if (config_get()->connect_rate)
+    printf("Pacing: opened %.1f of %.1f connects/s (%.1f%%) | %" PRIu64 " ticks, %" PRIu64 " overruns | %"
+           PRIu64 " handshakes with no room\n",
+           tx/n, target/n, 100. * tx / target, ticks, overruns, skipped);
+  else
+    printf("Pacing: sent %.3fkbps of %.3fkbps (%.1f%%) | %" PRIu64 " ticks, %" PRIu64 " overruns, %"
+           PRIu64 " skipped | %" PRIu64 " send stalls\n",
+           tx/n/1024, target/n/1024, 100. * tx / target,
+           ticks, overruns, skipped, stalls);
+  /* The sample the connection came up in is part empty, wait for more */
+  if (n >= STATS_MIN_RECORDS && tx < target * WATERMARK_THROUGHPUT_LO)
+    printf("Sender fell behind its target, low throughput is ours and not the link's\n");
+}
+
+
+/* What came of the handshakes over the window */
+static void print_handshakes(
+    struct stats *st)
+{
+  uint64_t connects = 0, failures = 0, fastopens = 0;
+  int i;
+
+  for (i=0; i < st->det.nrecs; i++) {
+    connects += st->det.records[i].connects;
+    failures += st->det.records[i].connect_failures;
+    fastopens += st->det.records[i].fastopens;
+  }
+  if (connects + failures == 0)
+    return;
+
+  printf("Handshakes: %" PRIu64 " established | %" PRIu64 " failed (%.3f%%) | %" PRIu64 " fast open\n",
+         connects, failures, 100. * failures / (connects + failures), fastopens);
+}
+
+
+/* How often the connection came back over the window, and how long it
+ * was gone */
+static void print_reconnects(
+    struct stats *st)
 {
-  int state=0;
-  int state_old = records.state;
-
-  double rcl = records.latency_fitness;
-  double tp = records.throughput_fitness;
-
-  if (isnan(rcl))
-    state |= LATENCY_CRIT;
-  else if (rcl < WATERMARK_LATENCY_LO)
-    state |= LATENCY_CRIT;
-  else 
-    state |= LATENCY_OK;
-
-  if (isnan(tp))
-    state |= THROUGHPUT_CRIT;
-  else if (tp < WATERMARK_THROUGHPUT_LO)
-    state |= THROUGHPUT_CRIT;
-  else 
-    state |= THROUGHPUT_OK;
-
-  if (state & (LATENCY_OK|THROUGHPUT_OK) == (LATENCY_OK|THROUGHPUT_OK))
-    records.alerting = false;
-  if (state & (LATENCY_CRIT|THROUGHPUT_CRIT))
-    records.alerting = true;
-
-  records.state = state;
-  return state == state_old ? 0 : state;
+  double total = 0., longest = 0.;
+  int i, n = 0;
+
+  for (i=0; i < st->det.nrecs; i++) {
+    if (st->det.records[i].reconnect_s <= 0.)
+      continue;
+    n++;
+    total += st->det.records[i].reconnect_s;
+    longest = MAX(longest, st->det.records[i].reconnect_s);
+  }
+  if (n == 0)
+    return;
+
+  printf("Reconnects: %d | back after %.3fs mean, %.3fs max\n", n, total / n, longest);
+}
+
+
+/* The percentiles cover everything seen since the previous summary, the
+ * histograms start afresh after each one */
+static void print_stats(
+    struct stats *st)
+{
+  flockfile(stdout);
+  printf("\nSummary for %s\n", st->tag);
+  if (config_get()->connect_rate)
+    printf("Average Connect Rate: %.1f/s\nAverage Handshake:  %.3fms\n",
+           st->det.throughput_mean, st->det.latency_mean/1000);
+  else
+    printf("Average Throughput: %.3fkbps\nAverage Latency:  %.3fms\n",
+           st->det.throughput_mean/1024, st->det.latency_mean/1000);
+  printf("Connection Quality: %.1f%%\nStatus: %s (%.2f) | %s (%.2f). Alert mode: %s\n",
+    (st->det.latency_fitness + st->det.throughput_fitness) * 50.0,
+    link_latency_str(st), st->det.latency_fitness,
+    link_throughput_str(st), st->det.throughput_fitness,
+    st->det.alerting ? "ON" : "OFF");
+  print_limits(st);
+  print_loss(st);
+  print_pacing(st);
+  print_handshakes(st);
+  print_reconnects(st);
+  print_percentiles("Latency", st->latency_hist, "samples");
+  if (st->delay_hist) {
+    hist_take(sampler.scratch, st->delay_hist);
+    print_percentiles("Delay", sampler.scratch, "frames");
+  }
+  if (st->lateness_hist) {
+    hist_take(sampler.scratch, st->lateness_hist);
+    print_percentiles("Send lateness", sampler.scratch, "wakeups");
+  }
+  if (st->handshake_hist) {
+    hist_take(sampler.scratch, st->handshake_hist);
+    print_percentiles("Handshake", sampler.scratch, "connects");
+  }
+  rollup_print(st->rollup);
+  printf("\n");
+  fflush(stdout);
+  funlockfile(stdout);
+
+  hist_reset(st->latency_hist);
 }
 
 
 static char * link_latency_str(
-    void)
+    struct stats *st)
 {
-  int state = records.state;
+  int state = st->det.state;
   if (state & LATENCY_CRIT)
     return "Latency quality is critical";
   else if (state & LATENCY_OK)
@@ -179,9 +431,9 @@ static char * link_latency_str(
 }
 
 static char * link_throughput_str(
-    void)
+    struct stats *st)
 {
-  int state = records.state;
+  int state = st->det.state;
   if (state & THROUGHPUT_CRIT)
     return "Throughput quality is critical";
   else if (state & THROUGHPUT_OK)
@@ -191,127 +443,313 @@ static char * link_throughput_str(
 }
 
 
-static bool link_was_disconnected(
-    void)
+/* On the stats thread, the stream's loop has already stopped the timer */
+static void stats_free(
+    struct stats *st)
 {
-  int i;
-  for (i=0; i < records.nrecs; i++) {
-    if (records.records[i].state == LINK_DISCONNECTED) {
-      return true;
+  free(st->latency_hist);
+  free(st->delay_hist);
+  free(st->lateness_hist);
+  free(st->handshake_hist);
+  rollup_free(st->rollup);
+  detector_destroy(&st->det);
+  free(st);
+}
+
+
+/* The second half of a sample, on the stats thread */
+static void stats_sample(
+    struct stats_msg *m)
+{
+  int epoch, events;
+  struct stats *st = m->st;
+  char stampstr[64];
+
+  /* Allocate the next record in the log */
+  stat_record_t *r;
+  r = detector_next(&st->det);
+  if (r->_epoch > 1)
+    rollup_add(st->rollup, r);
+
+  if (m->rc > 0) {
+    epoch = r->_epoch;
+    *r = m->rec;
+    r->_epoch = epoch;
+  }
+  events = detector_mark(&st->det, r, m->rc);
+  if (m->rc < 0) {
+    /* Date the record and take it into the ring so the loss makes the
+     * last line */
+    r->timestamp = m->now;
+    if (recorder_enabled())
+      recorder_append(st->rectag, r->timestamp, LINK_DISCONNECTED, NULL);
+    st->det.nextrec++;
+    if (events & DETECT_LOST) {
+      print_lines(st, 5, 5);
+      print_stats(st);
+    }
+    stats_free(st);
+    return;
+  }
+
+  if (m->rc > 0)
+    hist_record(st->latency_hist, lround(r->latency_us));
+  if (events & DETECT_LOST) {
+    print_lines(st, 5, 5);
+    print_stats(st);
+  }
+  else if (events & DETECT_RESTORED) {
+    print_lines(st, 1, 5);
+    if (r->reconnect_s > 0.)
+      printf("%s %s Reconnected after %.3fs\n", strstamp(r->timestamp, stampstr), st->tag, r->reconnect_s);
+  }
+
+  if (recorder_enabled())
+    recorder_append(st->rectag, m->now, r->state, m->rc > 0 ? r : NULL);
+
+  /* Perform a quality check */
+  if (detector_commit(&st->det, r)) {
+    print_lines(st, 5, 5);
+    print_stats(st);
+  }
+  if (detector_settled(&st->det)) {
+    /* If state hasn't changed but we're now alerting */
+    if (st->det.alerting && (st->det.nextrec % st->remind_lines == 0)) /* five seconds */ {
+      print_lines(st, 5, 5);
+    }
+    if (st->det.alerting && (st->det.nextrec % st->remind_stats) == 0) /* Thirty seconds */ {
+      print_stats(st);
     }
   }
-  return false;
+
+  if (st->watch_cb)
+    st->watch_cb(&st->det, r, st->watch_data);
 }
 
-static void stats_fitness(
-    void)
+
+
+static void stats_drain(
+    EV_P_ ev_async *w,
+    int revents)
 {
-  int recno, i;
-  stat_record_t *r;
-  double *throug_vec = alloca(sizeof(double) * records.nrecs);
-  double *latenc_vec = alloca(sizeof(double) * records.nrecs);
-  double *timest_vec = alloca(sizeof(double) * records.nrecs);
-  double *thrtot_vec = alloca(sizeof(double) * records.nrecs);
-  double *lattot_vec = alloca(sizeof(double) * records.nrecs);
-
-  /* Extract the stats as plain vectors */  
-  for (i=0; i < records.nrecs; i++) {
-    recno = (records.nextrec+i) % records.nrecs;
-    r = &records.records[recno];
-    timest_vec[i] = r->timestamp;
-    thrtot_vec[i] = r->bytes_total;
-    lattot_vec[i] = r->latency_total;
-    throug_vec[i] = r->bps;
-    latenc_vec[i] = r->latency_us;
+  int i, n = __atomic_load_n(&sampler.nproducers, __ATOMIC_ACQUIRE);
+  struct stats_msg *m;
+  struct spsc *q;
+  uint64_t dropped;
+
+  for (i=0; i < n; i++) {
+    q = sampler.producers[i].ring;
+    while ((m = spsc_peek(q))) {
+      stats_sample(m);
+      spsc_pop(q);
+    }
+  }
+
+  dropped = __atomic_load_n(&sampler.dropped, __ATOMIC_RELAXED);
+  if (dropped && !sampler.warned) {
+    sampler.warned = true;
+    warnx("The stats thread is falling behind, %" PRIu64 " samples dropped so far", dropped);
   }
-  records.throughput_fitness = 
-    gsl_stats_correlation(timest_vec, 1, thrtot_vec, 1, records.nrecs);
-  records.latency_fitness = 
-    gsl_stats_correlation(timest_vec, 1, lattot_vec, 1, records.nrecs);
-  records.latency_mean = gsl_stats_mean(latenc_vec, 1, records.nrecs);
-  records.throughput_mean = gsl_stats_mean(throug_vec, 1, records.nrecs);
-  return;
 }
 
 
+
+/* The first half of a sample, on the loop the stream runs on. Only the
+ * measuring happens here, everything that might block is left to the
+ * stats thread */
 static void timer_fired(
     EV_P_ ev_timer *t,
     int revents)
 {
-
-  int rc;
-
-  /* Allocate the next record in the log */
-  stat_record_t *r;
-  r = &records.records[records.nextrec % records.nrecs];
-  r->_epoch++;
-
-  /* The record did not update */
-  rc = records.stats_record_cb(r);
-  if (rc == 0) {
-    if (!records.disconnected) {
-      r->state = LINK_DISCONNECTED;
-      print_lines(5, 5);
-      print_stats();
-    }
-    else {
-      r->state = LINK_UNCHANGED;
-    }
-    records.disconnected = true;
+  struct stats *st = t->data;
+  struct stats_producer *p = st->producer;
+  struct stats_msg m;
+
+  m.st = st;
+  memset(&m.rec, 0, sizeof(m.rec));
+  m.rc = st->stats_record_cb(&m.rec, st->data);
+  m.now = ev_now(EV_A);
+
+  /* The stream is gone, the stats thread frees what is left of it. A
+   * slot is kept free for every stream's last word so it always fits */
+  if (m.rc < 0) {
+    ev_timer_stop(EV_A_ t);
+    p->live--;
+    while (!spsc_push(p->ring, &m))
+      sched_yield();
+  }
+  else if (spsc_space(p->ring) <= p->live) {
+    __atomic_add_fetch(&sampler.dropped, 1, __ATOMIC_RELAXED);
+    return;
   }
   else {
-    if (records.disconnected) {
-      r->state = LINK_CONNECTED;
-      print_lines(1, 5);
-      records.disconnected = false;
-    }
-    else {
-      r->state = LINK_UNCHANGED;
-    }
+    spsc_push(p->ring, &m);
   }
+  ev_async_send(sampler.loop, &sampler.wake);
+}
 
-  records.nextrec++;
-  stats_fitness();
 
-  /* Perform a quality check */
-  if (!link_was_disconnected()) {
-    /* If state has changed from previous */
-    if (link_state()) {
-      print_lines(5, 5);
-      print_stats();
-    }
-    /* If state hasn't changed but we're now alerting */
-    if (records.alerting && (records.nextrec % 25 == 0)) /* five seconds */ {
-      print_lines(5, 5);
-    }
-    if (records.alerting && (records.nextrec % 150) == 0) /* Thirty seconds */ {
-      print_stats();
-    }
+
+/* Ring sized for every stream a loop might get, the slots are dealt
+ * round robin and the first loop may carry an aggregate as well */
+static struct stats_producer * stats_producer(
+    struct ev_loop *loop)
+{
+  struct configuration *c = config_get();
+  struct stats_producer *p = NULL;
+  int i, n, per;
+
+  pthread_mutex_lock(&sampler.lock);
+  for (i=0; i < sampler.nproducers; i++)
+    if (sampler.producers[i].loop == loop)
+      p = &sampler.producers[i];
+
+  if (!p) {
+    if (sampler.nproducers == MAX_THREADS + 1)
+      errx(EXIT_FAILURE, "Too many loops taking samples");
+    /* Clients go to whichever loop the kernel picks, any one loop may
+     * end up with every one of them */
+    n = c->ntargets ? c->ntargets : c->streams;
+    per = c->listener ? c->clients + 1 : (n + c->threads - 1) / c->threads + 1;
+    p = &sampler.producers[sampler.nproducers];
+    p->loop = loop;
+    p->ring = spsc_new(per * STATS_RING_PER_STREAM + STATS_RING_SLACK, sizeof(struct stats_msg));
+    __atomic_store_n(&sampler.nproducers, sampler.nproducers + 1, __ATOMIC_RELEASE);
   }
+  pthread_mutex_unlock(&sampler.lock);
+  return p;
+}
+
+
 
-  return;
+static void * stats_main(
+    void *data)
+{
+  realtime_background();
+  ev_run(sampler.loop, 0);
+  return NULL;
 }
 
 
+
+/* Starts the stats thread, before any stats are made */
 void stats_init(
+    void)
+{
+  int rc;
+
+  sampler.loop = ev_loop_new(EVFLAG_AUTO);
+  if (!sampler.loop)
+    errx(EXIT_FAILURE, "could not initialise libev loop for the stats thread");
+  sampler.scratch = hist_new(HIST_SUB_BITS);
+  ev_async_init(&sampler.wake, stats_drain);
+  ev_async_start(sampler.loop, &sampler.wake);
+
+  rc = pthread_create(&sampler.thread, NULL, stats_main, NULL);
+  if (rc) {
+    errno = rc;
+    err(EXIT_FAILURE, "pthread_create");
+  }
+}
+
+
+
+struct stats * stats_new(
+    EV_P_
     int64_t rate,
-    int (*stat_cb)(stat_record_t *))
+    int (*stat_cb)(stat_record_t *, void *),
+    void *data)
 {
+  struct stats *st;
+  struct configuration *c = config_get();
+  int bits;
   assert(rate > 0);
   assert(stat_cb);
 
-  ev_timer_init(&records.timer, timer_fired, STATS_FREQUENCY, STATS_FREQUENCY);
+  st = calloc(1, sizeof(struct stats));
+  assert(st);
+
+  ev_timer_init(&st->timer, timer_fired, c->stats_frequency, c->stats_frequency);
+  st->timer.data = st;
+  st->loop = EV_A;
+
+  detector_init(&st->det, c->stats_records);
+  st->rate = (double)rate;
+  st->stats_record_cb = stat_cb;
+  st->rectag = REC_TAG_NONE;
+  st->data = data;
+  st->remind_lines = MAX(1, lround(5.0 / c->stats_frequency));
+  st->remind_stats = MAX(1, lround(30.0 / c->stats_frequency));
+  st->rollup = rollup_new();
+  /* Targets are many and slow, a probe a few times a second has no use
+   * for the finer buckets but would pay for them thousands of times */
+  bits = c->ntargets ? HIST_COARSE_BITS : HIST_SUB_BITS;
+  st->latency_hist = hist_new(bits);
+  /* Only framed streams measure delay, don't carry it on every target */
+  if (c->framed || c->udp)
+    st->delay_hist = hist_new(bits);
+  /* Only a userspace pacer keeps a schedule to be late for */
+  if (c->pacing == PACING_TIMER)
+    st->lateness_hist = hist_new(bits);
+  if (c->connect_rate)
+    st->handshake_hist = hist_new(bits);
+
+  st->producer = stats_producer(EV_A);
+  st->producer->live++;
+  ev_timer_start(EV_A_ &st->timer);
+  return st;
+}
+
+
+
+void stats_set_tag(
+    struct stats *st,
+    const char *fmt,
+    ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(st->tag, sizeof(st->tag), fmt, ap);
+  va_end(ap);
+  if (recorder_enabled())
+    st->rectag = recorder_tag(st->tag);
+}
+
+
+
+void stats_watch(
+    struct stats *st,
+    void (*cb)(const struct detector *, const stat_record_t *, void *),
+    void *data)
+{
+  st->watch_cb = cb;
+  st->watch_data = data;
+}
+
 
-  records.state = 0;
-  records.latency_fitness = 0.;
-  records.throughput_fitness = 0.;
-  records.disconnected = true;
-  records.rate = (double)rate;
-  records.nrecs = NRECORDS;
-  records.nextrec = 0;
-  records.stats_record_cb = stat_cb;
-  records.records = calloc(sizeof(stat_record_t), NRECORDS);
-  assert(records.records);
 
-  ev_timer_start(EV_DEFAULT_ &records.timer);
+/* For recording one-way delays as frames arrive, must only be used from
+ * the loop the stats run on */
+struct hist * stats_delay_hist(
+    struct stats *st)
+{
+  return st->delay_hist;
+}
+
+
+
+/* For recording how late each pacer tick ran, same rules as above */
+struct hist * stats_lateness_hist(
+    struct stats *st)
+{
+  return st->lateness_hist;
+}
+
+
+
+/* For recording how long each handshake took, same rules again */
+struct hist * stats_handshake_hist(
+    struct stats *st)
+{
+  return st->handshake_hist;
 }
@@ -1,9 +1,12 @@
 #ifndef _STATS_H_
 #define _STATS_H_
+#include "common.h"
 
+/* Defaults, both can be changed at runtime */
 #define STATS_FREQUENCY 0.2F
 #define STATS_SECS 15L
-#define NRECORDS (int) (STATS_SECS / STATS_FREQUENCY)
+/* Enough samples for the five line summaries */
+#define STATS_MIN_RECORDS 25
 
 typedef enum state {
   LINK_UNCHANGED,
@@ -11,6 +14,17 @@ typedef enum state {
   LINK_CONNECTED
 } stat_state_t;
 
+/* What held the sender back over a sample, from the TCP_INFO chrono
+ * counters */
+typedef enum limit {
+  LIMIT_UNKNOWN,
+  LIMIT_APP,     /* Nothing to send, the pacer is in control */
+  LIMIT_NETWORK, /* Data waiting on cwnd, the path is the bottleneck */
+  LIMIT_RWND,    /* Peer's receive window */
+  LIMIT_SNDBUF,  /* Our own send buffer */
+  LIMIT_MAX
+} stat_limit_t;
+
 typedef struct stat_record {
   double timestamp;
   double bps;
@@ -18,9 +32,77 @@ typedef struct stat_record {
   double latency_total;
   double bytes_total;
 
+  /* Framed payloads only, one-way */
+  double delay_us;
+  double jitter_us;
+
+  /* From TCP_INFO, counters and times cover the sample only */
+  uint32_t retransmits;
+  uint32_t cwnd;
+  uint32_t ssthresh;
+  uint32_t notsent_bytes;
+  uint64_t delivery_rate;
+  uint64_t pacing_rate;
+  uint64_t bytes_acked;
+  uint64_t busy_us;
+  uint64_t rwnd_limited_us;
+  uint64_t sndbuf_limited_us;
+  bool app_limited;
+  stat_limit_t limit;
+
+  /* How well we kept to our own schedule over the sample. Ticks are
+   * pacer wakeups, overruns the ones slept through and skipped the ones
+   * dropped with the send buffer full, stalls are sends that hit EAGAIN */
+  double tx_bps;
+  double target_bps;
+  uint32_t ticks;
+  uint32_t overruns;
+  uint32_t skipped;
+  uint32_t stalls;
+  uint32_t lateness_max_us;
+
+  /* UDP only, datagrams over the sample. Lost ones that turn up late
+   * come off lost and count as reordered */
+  uint32_t datagrams;
+  uint32_t lost;
+  uint32_t reordered;
+  uint32_t duplicates;
+
+  /* Connection rate mode, handshakes over the sample. Fast opens are the
+   * ones whose SYN carried data */
+  uint32_t connects;
+  uint32_t connect_failures;
+  uint32_t fastopens;
+
+  /* How long the connection was down for, on the first sample after it
+   * came back */
+  double reconnect_s;
+
+  /* Whether anything was measured, and if the stream was alerting */
+  bool measured;
+  bool alerting;
+
   int _epoch;
   stat_state_t state;
 } stat_record_t;
 
-void stats_init(int64_t rbps, int (*cb)(stat_record_t *s));
+struct stats;
+struct hist;
+struct detector;
+
+/* The callback fills in the record and returns 1, or 0 if there was
+ * nothing to measure. Returning -1 says the stream is gone for good, the
+ * loss is reported and the stats freed, so it must not be used again.
+ * The callback runs on the loop given, everything else happens on the
+ * stats thread, which stats_init() starts */
+void stats_init(void);
+struct stats * stats_new(EV_P_ int64_t rbps, int (*cb)(stat_record_t *s, void *data), void *data);
+void stats_set_tag(struct stats *st, const char *fmt, ...);
+/* Has cb see every sample on the stats thread once it is in the window.
+ * Must be set before the loop takes its first sample */
+void stats_watch(struct stats *st, void (*cb)(const struct detector *d, const stat_record_t *r, void *data),
+                 void *data);
+struct hist * stats_delay_hist(struct stats *st);
+struct hist * stats_lateness_hist(struct stats *st);
+struct hist * stats_handshake_hist(struct stats *st);
 #endif 
@@ -0,0 +1,283 @@
+#include "common.h"
+#include "udp.h"
+#include "payload.h"
+#include <endian.h>
+#include <netinet/udp.h>
+
+/* Datagram transport. Every datagram is one frame, led by a sequence
+ * number and the CLOCK_REALTIME it was sent, the rest is the shared
+ * payload. Sends and receives go a batch at a time, optionally as GSO
+ * trains and GRO coalesced reads. The receiver keeps a bitmap of the
+ * sequence numbers seen recently, so a gap counts as loss until the
+ * missing datagram turns up late, when it becomes a reorder, and one
+ * that turns up twice is a duplicate */
+
+struct udp_batch * udp_batch_new(
+    bool gro)
+{
+  struct udp_batch *b;
+
+  b = calloc(1, sizeof(struct udp_batch));
+  assert(b);
+
+  /* Without GRO the body is never looked at, MSG_TRUNC still gives the
+   * full length */
+  b->nrx = gro ? UDP_GRO_BATCH : UDP_BATCH;
+  b->rxsz = gro ? UDP_MAX_PAYLOAD : UDP_PEEK_SZ;
+  b->rxbuf = malloc(b->nrx * b->rxsz);
+  assert(b->rxbuf);
+  return b;
+}
+
+
+
+/* Send count frames numbered on from *seq, segs of them to a datagram
+ * when the socket does GSO. Returns how many went, moving *seq past
+ * them, or -1 if none did */
+int udp_send(
+    int fd,
+    struct udp_batch *b,
+    uint64_t *seq,
+    size_t framesz,
+    int count,
+    int segs)
+{
+  size_t hdrsz = sizeof(struct frame_hdr);
+  int64_t now = realtime_ns();
+  int i, j, k = 0, m = 0, rc;
+  int sent = 0;
+
+  count = MIN(count, UDP_BATCH);
+  for (i=0; i < count; i++) {
+    b->hdrs[i].magic = htobe32(FRAME_MAGIC);
+    b->hdrs[i].len = htobe32(framesz);
+    b->hdrs[i].seq = htobe64(*seq + i);
+    b->hdrs[i].sent_ns = htobe64(now);
+  }
+
+  for (i=0; i < count; m++) {
+    memset(&b->msgs[m], 0, sizeof(b->msgs[m]));
+    b->msgs[m].msg_hdr.msg_iov = &b->iov[k];
+    for (j=0; j < segs && i < count; j++, i++) {
+      b->iov[k].iov_base = &b->hdrs[i];
+      b->iov[k++].iov_len = hdrsz;
+      if (framesz > hdrsz) {
+        b->iov[k].iov_base = payload_get();
+        b->iov[k++].iov_len = framesz - hdrsz;
+      }
+    }
+    b->msgs[m].msg_hdr.msg_iovlen = &b->iov[k] - b->msgs[m].msg_hdr.msg_iov;
+  }
+
+  rc = sendmmsg(fd, b->msgs, m, MSG_NOSIGNAL);
+  if (rc < 0)
+    return -1;
+
+  /* Every message but the last is full */
+  for (i=0; i < rc; i++)
+    sent += MIN(segs, count - i * segs);
+  *seq += sent;
+  return sent;
+}
+
+
+
+/* Read a batch, with the senders' addresses if names is set. Returns the
+ * number read or -1 */
+int udp_recv(
+    int fd,
+    struct udp_batch *b,
+    bool names)
+{
+  int i;
+
+  for (i=0; i < b->nrx; i++) {
+    b->rxiov[i].iov_base = b->rxbuf + i * b->rxsz;
+    b->rxiov[i].iov_len = b->rxsz;
+    memset(&b->rxmsgs[i], 0, sizeof(b->rxmsgs[i]));
+    b->rxmsgs[i].msg_hdr.msg_iov = &b->rxiov[i];
+    b->rxmsgs[i].msg_hdr.msg_iovlen = 1;
+    b->rxmsgs[i].msg_hdr.msg_control = b->control[i];
+    b->rxmsgs[i].msg_hdr.msg_controllen = sizeof(b->control[i]);
+    if (names) {
+      b->rxmsgs[i].msg_hdr.msg_name = &b->names[i];
+      b->rxmsgs[i].msg_hdr.msg_namelen = sizeof(b->names[i]);
+    }
+  }
+
+  return recvmmsg(fd, b->rxmsgs, b->nrx, MSG_TRUNC, NULL);
+}
+
+
+
+/* Length of the i'th read and the size of the datagrams coalesced into
+ * it, which is the whole of it without GRO */
+size_t udp_segment(
+    struct udp_batch *b,
+    int i,
+    size_t *segsz)
+{
+  struct msghdr *msg = &b->rxmsgs[i].msg_hdr;
+  struct cmsghdr *cm;
+  size_t len = b->rxmsgs[i].msg_len;
+
+  *segsz = len;
+  for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+    if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+      *segsz = *(int *)CMSG_DATA(cm);
+  }
+  return len;
+}
+
+
+
+void udp_rx_reset(
+    struct udp_rx *u,
+    struct hist *delays)
+{
+  memset(u, 0, sizeof(*u));
+  frame_delay_reset(&u->delay, delays);
+}
+
+
+
+static inline bool seen_test_set(
+    struct udp_rx *u,
+    uint64_t seq)
+{
+  uint64_t bit = 1ULL << (seq % 64);
+  uint64_t *w = &u->seen[(seq / 64) % (UDP_REORDER_WINDOW / 64)];
+  bool was = *w & bit;
+
+  *w |= bit;
+  return was;
+}
+
+static inline void seen_clear(
+    struct udp_rx *u,
+    uint64_t seq)
+{
+  u->seen[(seq / 64) % (UDP_REORDER_WINDOW / 64)] &= ~(1ULL << (seq % 64));
+}
+
+
+
+static void udp_rx_seq(
+    struct udp_rx *u,
+    uint64_t seq,
+    size_t len)
+{
+  uint64_t s;
+  struct udp_counts *c = &u->counts;
+
+  if (!u->started) {
+    u->started = true;
+    u->next_seq = seq;
+  }
+
+  if (seq >= u->next_seq) {
+    /* Everything skipped over is lost until it shows up */
+    c->lost += seq - u->next_seq;
+    if (seq - u->next_seq >= UDP_REORDER_WINDOW)
+      memset(u->seen, 0, sizeof(u->seen));
+    else
+      for (s = u->next_seq; s < seq; s++)
+        seen_clear(u, s);
+    seen_clear(u, seq);
+    u->next_seq = seq + 1;
+  }
+  else if (u->next_seq - seq > UDP_REORDER_WINDOW) {
+    /* Too old to tell, it was counted lost so call it late */
+    c->reordered++;
+    c->lost -= MIN(c->lost, 1);
+    c->received++;
+    c->bytes += len;
+    return;
+  }
+  else if (seen_test_set(u, seq)) {
+    c->duplicates++;
+    return;
+  }
+  else {
+    c->reordered++;
+    c->lost -= MIN(c->lost, 1);
+    c->received++;
+    c->bytes += len;
+    return;
+  }
+
+  seen_test_set(u, seq);
+  c->received++;
+  c->bytes += len;
+}
+
+
+
+/* One datagram as read, buf holding at least its header */
+void udp_rx_datagram(
+    struct udp_rx *u,
+    const uint8_t *buf,
+    size_t len,
+    int64_t now,
+    double arrived)
+{
+  struct frame_hdr hdr;
+
+  if (len < sizeof(hdr))
+    return;
+  memcpy(&hdr, buf, sizeof(hdr));
+  if (be32toh(hdr.magic) != FRAME_MAGIC)
+    return;
+
+  udp_rx_seq(u, be64toh(hdr.seq), len);
+
+  u->echo_ns = be64toh(hdr.sent_ns);
+  u->arrived_ns = now;
+  u->arrived = arrived;
+
+  frame_delay_arrived(&u->delay, u->echo_ns, now);
+}
+
+
+
+void udp_report_make(
+    struct udp_rx *u,
+    struct udp_report *rep,
+    int64_t now)
+{
+  rep->magic = htobe32(UDP_REPORT_MAGIC);
+  rep->jitter_us = htobe32(MIN(lround(u->delay.jitter / 1000.), UINT32_MAX));
+  rep->echo_ns = htobe64(u->echo_ns);
+  rep->hold_ns = htobe64(now - u->arrived_ns);
+  rep->delay_ns = htobe64(llround(u->delay.delay_us * 1000.));
+  rep->received = htobe64(u->counts.received);
+  rep->lost = htobe64(u->counts.lost);
+  rep->reordered = htobe64(u->counts.reordered);
+  rep->duplicates = htobe64(u->counts.duplicates);
+  rep->bytes = htobe64(u->counts.bytes);
+}
+
+
+
+bool udp_report_parse(
+    const uint8_t *buf,
+    size_t len,
+    struct udp_report *rep)
+{
+  if (len < sizeof(*rep))
+    return false;
+  memcpy(rep, buf, sizeof(*rep));
+  if (be32toh(rep->magic) != UDP_REPORT_MAGIC)
+    return false;
+
+  rep->jitter_us = be32toh(rep->jitter_us);
+  rep->echo_ns = be64toh(rep->echo_ns);
+  rep->hold_ns = be64toh(rep->hold_ns);
+  rep->delay_ns = be64toh(rep->delay_ns);
+  rep->received = be64toh(rep->received);
+  rep->lost = be64toh(rep->lost);
+  rep->reordered = be64toh(rep->reordered);
+  rep->duplicates = be64toh(rep->duplicates);
+  rep->bytes = be64toh(rep->bytes);
+  return true;
+}
@@ -0,0 +1,86 @@
+#ifndef _UDP_H_
+#define _UDP_H_
+#include "common.h"
+#include "frame.h"
+#include "hist.h"
+#include <sys/uio.h>
+
+/* Datagrams per sendmmsg() and recvmmsg(), fewer when every one may be a
+ * GRO train of up to 64KiB */
+#define UDP_BATCH 64
+#define UDP_GRO_BATCH 8
+#define UDP_MAX_PAYLOAD 65507
+#define UDP_MAX_SEGS 64
+/* How far back a late datagram can be told from a duplicate */
+#define UDP_REORDER_WINDOW 4096
+#define UDP_REPORT_MAGIC 0x54585250
+/* Only the header of a datagram is read unless GRO is on */
+#define UDP_PEEK_SZ 128
+
+/* Every datagram is a frame, its header the same as a TCP frame's */
+
+/* Sent back by the receiver every sample, big endian. The newest
+ * datagram's send time comes back with how long it was held so the
+ * sender can take a round trip time off its own clock */
+struct udp_report {
+  uint32_t magic;
+  uint32_t jitter_us;
+  int64_t echo_ns;
+  int64_t hold_ns;
+  int64_t delay_ns;
+  uint64_t received;
+  uint64_t lost;
+  uint64_t reordered;
+  uint64_t duplicates;
+  uint64_t bytes;
+};
+
+/* Running totals, for both what a receiver counted and what the last
+ * report from it said */
+struct udp_counts {
+  uint64_t received;
+  uint64_t lost;
+  uint64_t reordered;
+  uint64_t duplicates;
+  uint64_t bytes;
+};
+
+struct udp_rx {
+  bool started;
+  uint64_t next_seq;
+  uint64_t seen[UDP_REORDER_WINDOW / 64];
+  struct udp_counts counts;
+
+  /* The newest datagram, for echoing back */
+  int64_t echo_ns;
+  int64_t arrived_ns;
+  double arrived;
+
+  struct frame_delay delay;
+};
+
+/* Scratch for one batch, shared by every stream on a worker */
+struct udp_batch {
+  struct frame_hdr hdrs[UDP_BATCH];
+  struct iovec iov[UDP_BATCH * 2];
+  struct mmsghdr msgs[UDP_BATCH];
+
+  int nrx;
+  size_t rxsz;
+  uint8_t *rxbuf;
+  struct iovec rxiov[UDP_BATCH];
+  struct mmsghdr rxmsgs[UDP_BATCH];
+  struct sockaddr_storage names[UDP_BATCH];
+  char control[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+};
+
+struct udp_batch * udp_batch_new(bool gro);
+int udp_send(int fd, struct udp_batch *b, uint64_t *seq, size_t framesz, int count, int segs);
+int udp_recv(int fd, struct udp_batch *b, bool names);
+size_t udp_segment(struct udp_batch *b, int i, size_t *segsz);
+
+void udp_rx_reset(struct udp_rx *u, struct hist *delays);
+void udp_rx_datagram(struct udp_rx *u, const uint8_t *buf, size_t len, int64_t now, double arrived);
+void udp_report_make(struct udp_rx *u, struct udp_report *rep, int64_t now);
+bool udp_report_parse(const uint8_t *buf, size_t len, struct udp_report *rep);
+#endif
@@ -0,0 +1,249 @@
+#include "common.h"
+#include "uring.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Just enough of io_uring to drive the traffic engine, talking to the
+ * kernel directly rather than pulling in liburing */
+struct uring {
+  int fd;
+
+  void *sq_ring;
+  size_t sq_ring_sz;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned sqe_tail;
+  unsigned submitted;
+
+  void *cq_ring;
+  size_t cq_ring_sz;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* Provided buffers for multishot receives */
+  struct io_uring_buf_ring *br;
+  unsigned br_entries;
+  unsigned short br_tail;
+  uint8_t *bufs;
+  size_t bufsz;
+};
+
+
+
+static int io_uring_setup(
+    unsigned entries,
+    struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(
+    int fd,
+    unsigned to_submit,
+    unsigned min_complete,
+    unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(
+    int fd,
+    unsigned opcode,
+    void *arg,
+    unsigned nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+
+struct uring * uring_new(
+    unsigned entries)
+{
+  struct uring *u;
+  struct io_uring_params p;
+  uint8_t *sq, *cq;
+
+  u = calloc(1, sizeof(struct uring));
+  assert(u);
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_SUBMIT_ALL;
+  u->fd = io_uring_setup(entries, &p);
+  if (u->fd < 0)
+    err(EXIT_FAILURE, "io_uring_setup");
+
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP))
+    errx(EXIT_FAILURE, "io_uring on this kernel is too old");
+
+  /* With a single mmap both rings live in the one region */
+  u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sq_ring_sz = MAX(u->sq_ring_sz, u->cq_ring_sz);
+
+  u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED)
+    err(EXIT_FAILURE, "io_uring mmap");
+  u->cq_ring = u->sq_ring;
+
+  u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    err(EXIT_FAILURE, "io_uring mmap");
+
+  sq = u->sq_ring;
+  u->sq_head = (unsigned *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+  u->sq_entries = p.sq_entries;
+  u->sqe_tail = *u->sq_tail;
+  u->submitted = u->sqe_tail;
+
+  cq = u->cq_ring;
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  return u;
+}
+
+
+
+int uring_fd(
+    struct uring *u)
+{
+  return u->fd;
+}
+
+
+
+/* Hands back a zeroed SQE, pushing what is queued to the kernel first
+ * if the ring is full */
+struct io_uring_sqe * uring_get_sqe(
+    struct uring *u)
+{
+  struct io_uring_sqe *sqe;
+  unsigned head, idx;
+
+  head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  if (u->sqe_tail - head >= u->sq_entries) {
+    uring_submit(u);
+    head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sqe_tail - head >= u->sq_entries)
+      errx(EXIT_FAILURE, "io_uring submission queue is full");
+  }
+
+  idx = u->sqe_tail & *u->sq_mask;
+  sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[idx] = idx;
+  u->sqe_tail++;
+  return sqe;
+}
+
+
+
+int uring_submit(
+    struct uring *u)
+{
+  int rc;
+  unsigned n = u->sqe_tail - u->submitted;
+
+  if (n == 0)
+    return 0;
+
+  __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+  do {
+    rc = io_uring_enter(u->fd, n, 0, 0);
+  } while (rc < 0 && errno == EINTR);
+
+  if (rc < 0)
+    err(EXIT_FAILURE, "io_uring_enter");
+  u->submitted = u->sqe_tail;
+  return rc;
+}
+
+
+
+struct io_uring_cqe * uring_peek_cqe(
+    struct uring *u)
+{
+  unsigned head = *u->cq_head;
+  unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+  if (head == tail)
+    return NULL;
+  return &u->cqes[head & *u->cq_mask];
+}
+
+
+
+void uring_cqe_seen(
+    struct uring *u)
+{
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+
+/* Registers a ring of nbufs buffers of bufsz as buffer group bgid */
+void uring_setup_buffers(
+    struct uring *u,
+    int bgid,
+    unsigned nbufs,
+    size_t bufsz)
+{
+  struct io_uring_buf_reg reg;
+  unsigned i;
+
+  assert(nbufs && (nbufs & (nbufs - 1)) == 0);
+
+  u->br = mmap(NULL, nbufs * sizeof(struct io_uring_buf), PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (u->br == MAP_FAILED)
+    err(EXIT_FAILURE, "mmap");
+
+  u->bufs = mmap(NULL, nbufs * bufsz, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (u->bufs == MAP_FAILED)
+    err(EXIT_FAILURE, "mmap");
+
+  u->br_entries = nbufs;
+  u->bufsz = bufsz;
+  u->br_tail = 0;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+  reg.ring_entries = nbufs;
+  reg.bgid = bgid;
+  if (io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    err(EXIT_FAILURE, "io_uring_register(IORING_REGISTER_PBUF_RING)");
+
+  for (i=0; i < nbufs; i++)
+    uring_buffer_recycle(u, i);
+}
+
+
+
+void uring_buffer_recycle(
+    struct uring *u,
+    unsigned bid)
+{
+  struct io_uring_buf *b;
+
+  b = &u->br->bufs[u->br_tail & (u->br_entries - 1)];
+  b->addr = (uint64_t)(uintptr_t)(u->bufs + (bid * u->bufsz));
+  b->len = u->bufsz;
+  b->bid = bid;
+  u->br_tail++;
+  __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
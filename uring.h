@@ -0,0 +1,17 @@
+#ifndef _URING_H_
+#define _URING_H_
+#include "common.h"
+#include <linux/io_uring.h>
+
+struct uring;
+
+struct uring * uring_new(unsigned entries);
+int uring_fd(struct uring *u);
+struct io_uring_sqe * uring_get_sqe(struct uring *u);
+int uring_submit(struct uring *u);
+struct io_uring_cqe * uring_peek_cqe(struct uring *u);
+void uring_cqe_seen(struct uring *u);
+
+void uring_setup_buffers(struct uring *u, int bgid, unsigned nbufs, size_t bufsz);
+void uring_buffer_recycle(struct uring *u, unsigned bid);
+#endif
@@ -0,0 +1,97 @@
+#include "common.h"
+#include "worker.h"
+#include "realtime.h"
+
+static struct {
+  int nworkers;
+  struct worker *workers;
+} workers;
+
+
+
+static void * worker_main(
+    void *data)
+{
+  struct worker *w = data;
+  realtime_thread(w->id);
+  ev_run(w->loop, 0);
+  return NULL;
+}
+
+
+
+void worker_init(
+    int nthreads)
+{
+  int i;
+  struct worker *w;
+
+  assert(nthreads > 0);
+
+  workers.nworkers = nthreads;
+  workers.workers = calloc(sizeof(struct worker), nthreads);
+  assert(workers.workers);
+
+  for (i=0; i < nthreads; i++) {
+    w = &workers.workers[i];
+    w->id = i;
+    w->sfd = -1;
+    w->nstreams = 0;
+    w->streams = NULL;
+    /* The first worker runs on the main thread and owns the default loop */
+    if (i == 0)
+      w->loop = EV_DEFAULT;
+    else
+      w->loop = ev_loop_new(EVFLAG_AUTO);
+    if (!w->loop)
+      errx(EXIT_FAILURE, "could not initialise libev loop for worker %d", i);
+  }
+}
+
+
+
+int worker_count(
+    void)
+{
+  return workers.nworkers;
+}
+
+
+
+struct worker * worker_get(
+    int id)
+{
+  assert(id >= 0 && id < workers.nworkers);
+  return &workers.workers[id];
+}
+
+
+
+void worker_add_stream(
+    struct worker *w,
+    struct rate_data *r)
+{
+  w->streams = realloc(w->streams, sizeof(struct rate_data *) * (w->nstreams+1));
+  assert(w->streams);
+  w->streams[w->nstreams++] = r;
+}
+
+
+
+/* Spawn a thread for every worker but the first, the caller is expected
+ * to run the default loop itself */
+void worker_start(
+    void)
+{
+  int i, rc;
+  struct worker *w;
+
+  for (i=1; i < workers.nworkers; i++) {
+    w = &workers.workers[i];
+    rc = pthread_create(&w->thread, NULL, worker_main, w);
+    if (rc) {
+      errno = rc;
+      err(EXIT_FAILURE, "pthread_create");
+    }
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef _WORKER_H_
+#define _WORKER_H_
+#include "common.h"
+#include <pthread.h>
+
+struct rate_data;
+struct handshake_hold;
+
+struct worker {
+  int id;
+  pthread_t thread;
+  struct ev_loop *loop;
+
+  /* Listeners only, one SO_REUSEPORT socket per worker */
+  int sfd;
+  ev_io lw;
+
+  /* Connection rate mode listeners hold what they accept a while */
+  struct handshake_hold *hold;
+
+  /* Receive buffer shared by every stream on this worker */
+  uint8_t *rxbuf;
+
+  /* UDP send and receive batches shared by every stream on this worker */
+  struct udp_batch *udp;
+
+  /* Batched TCP_INFO for the streams on this worker */
+  struct diag *diag;
+
+  /* io_uring engine, one ring per worker flushed before the loop sleeps */
+  struct uring *ring;
+  ev_io uw;
+  ev_prepare up;
+
+  int nstreams;
+  struct rate_data **streams;
+};
+
+void worker_init(int nthreads);
+int worker_count(void);
+struct worker * worker_get(int id);
+void worker_add_stream(struct worker *w, struct rate_data *r);
+void worker_start(void);
+#endif